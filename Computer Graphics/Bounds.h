@@ -0,0 +1,107 @@
+#pragma once
+
+// Std. Includes
+#include <cmath>
+#include <cfloat>
+
+// GL Includes
+#include <glm/glm.hpp>
+
+
+// Axis aligned bounding box
+struct AABB {
+	glm::vec3 Min;
+	glm::vec3 Max;
+
+	// Constructor, an empty box that any point extends
+	AABB() : Min(FLT_MAX), Max(-FLT_MAX) {}
+	AABB(glm::vec3 min, glm::vec3 max) : Min(min), Max(max) {}
+
+	bool IsEmpty() const
+	{
+		return this->Min.x > this->Max.x;
+	}
+
+	void Extend(glm::vec3 point)
+	{
+		this->Min = glm::min(this->Min, point);
+		this->Max = glm::max(this->Max, point);
+	}
+
+	void Extend(const AABB &box)
+	{
+		this->Min = glm::min(this->Min, box.Min);
+		this->Max = glm::max(this->Max, box.Max);
+	}
+
+	glm::vec3 Center() const
+	{
+		return 0.5f * (this->Min + this->Max);
+	}
+
+	glm::vec3 Extents() const
+	{
+		return 0.5f * (this->Max - this->Min);
+	}
+
+	// Box enclosing this box after an affine transformation (Arvo's method)
+	AABB Transform(const glm::mat4 &matrix) const
+	{
+		if (this->IsEmpty())
+			return *this;
+		glm::vec3 center = glm::vec3(matrix * glm::vec4(this->Center(), 1.0f));
+		glm::vec3 extents = this->Extents();
+		glm::vec3 newExtents;
+		for (int i = 0; i < 3; i++)
+			newExtents[i] = fabs(matrix[0][i]) * extents.x + fabs(matrix[1][i]) * extents.y + fabs(matrix[2][i]) * extents.z;
+		return AABB(center - newExtents, center + newExtents);
+	}
+
+	// The 8 corners of the box
+	void Corners(glm::vec3 corners[8]) const
+	{
+		for (int i = 0; i < 8; i++)
+			corners[i] = glm::vec3(i & 1 ? this->Max.x : this->Min.x, i & 2 ? this->Max.y : this->Min.y, i & 4 ? this->Max.z : this->Min.z);
+	}
+
+	bool IntersectsSphere(glm::vec3 center, float radius) const
+	{
+		glm::vec3 closest = glm::clamp(center, this->Min, this->Max);
+		glm::vec3 d = closest - center;
+		return glm::dot(d, d) <= radius * radius;
+	}
+};
+
+// Six clip planes of a view-projection matrix, pointing inwards
+struct Frustum {
+	glm::vec4 Planes[6];
+
+	// Constructor, extracts the planes from a view-projection (Gribb/Hartmann)
+	Frustum(const glm::mat4 &viewProjection)
+	{
+		glm::mat4 m = glm::transpose(viewProjection);
+		this->Planes[0] = m[3] + m[0];	// left
+		this->Planes[1] = m[3] - m[0];	// right
+		this->Planes[2] = m[3] + m[1];	// bottom
+		this->Planes[3] = m[3] - m[1];	// top
+		this->Planes[4] = m[3] + m[2];	// near
+		this->Planes[5] = m[3] - m[2];	// far
+		for (int i = 0; i < 6; i++)
+			this->Planes[i] /= glm::length(glm::vec3(this->Planes[i]));
+	}
+
+	// Conservative test: false only when the box is fully outside one of the planes
+	bool Intersects(const AABB &box) const
+	{
+		glm::vec3 center = box.Center();
+		glm::vec3 extents = box.Extents();
+		for (int i = 0; i < 6; i++)
+		{
+			glm::vec3 normal = glm::vec3(this->Planes[i]);
+			float radius = glm::dot(extents, glm::abs(normal));
+			if (glm::dot(normal, center) + this->Planes[i].w < -radius)
+				return false;
+		}
+		return true;
+	}
+};
@@ -0,0 +1,383 @@
+#pragma once
+
+// Std. Includes
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <xmmintrin.h>
+
+// GL Includes
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include "Shader.h"
+#include "Lights.h"
+#include "JobSystem.h"
+
+
+// Clustered forward lighting for any number of unshadowed point and spot lights. The view frustum
+// is cut into TilesX x TilesY screen tiles and Slices depth slices spaced exponentially, and every
+// frame each cluster gets the list of the lights whose range reaches it. A fragment finds its
+// cluster from gl_FragCoord and its view depth and only loops over that list.
+// GL 3.3 has no storage buffers, lights and lists are read from texture buffers.
+// Build fills the lists on a job system off the GL thread, Submit uploads them afterwards.
+class ClusteredLights
+{
+public:
+	static const GLuint LIGHTS_PER_JOB = 32;	// Lights a job of Build assigns to clusters
+
+	GLuint TilesX, TilesY, Slices;
+
+	// Constructor, the texture buffers are allocated by the first upload
+	ClusteredLights(GLuint tilesX, GLuint tilesY, GLuint slices)
+		: TilesX(tilesX), TilesY(tilesY), Slices(slices), lightBuffer(0), lights(0), references(0), boundsNear(0.0f), boundsFar(0.0f)
+	{
+	}
+
+	// Uploads the lights alone, 4 texels per light in world space, and their bounding spheres.
+	// Points get cut-offs of -2 and -1 so shaders can treat them as spots that light every direction.
+	void Upload(const std::vector<PointLight> &points, const std::vector<SpotLight> &spots)
+	{
+		this->gather(points, spots);
+		this->createBuffers();
+		upload(this->lightBuffer, &this->lightData[0], this->lightData.size() * sizeof(glm::vec4));
+		upload(this->sphereBuffer, this->spheres.data(), this->spheres.size() * sizeof(glm::vec4));
+	}
+
+	// Assigns the lights to the clusters of the camera, safe to run next to the GL thread. The
+	// clusters go from near to far, which must be the planes of the projection. The lights are
+	// gathered at once, then every job finds the clusters of LIGHTS_PER_JOB lights and counts
+	// its pairs per cluster. Once they are all done one job lays the lists out from the counts
+	// and the same jobs write their pairs in place, signalling done. Nothing may touch this
+	// object until done, then Submit uploads.
+	void Build(const std::vector<PointLight> &points, const std::vector<SpotLight> &spots, const glm::mat4 &projection, const glm::mat4 &view, GLfloat nearPlane, GLfloat farPlane, JobSystem &jobs, JobCounter &done)
+	{
+		this->prepare(points, spots, projection, nearPlane, farPlane);
+		GLuint count = this->spheres.size();
+		this->pairs.resize((count + LIGHTS_PER_JOB - 1) / LIGHTS_PER_JOB);
+		this->offsets.resize(this->pairs.size());
+		jobs.ParallelFor(count, LIGHTS_PER_JOB, [this, projection, view](GLuint begin, GLuint end) {
+			this->assignRange(begin, end, projection, view, begin / LIGHTS_PER_JOB);
+		}, this->assigned);
+		// - The scatter jobs signal done before the sort job returns, done cannot reach zero in between
+		JobSystem *system = &jobs;
+		JobCounter *signal = &done;
+		jobs.Run([this, system, signal]() {
+			this->sort();
+			system->ParallelFor(this->pairs.size(), 1, [this](GLuint begin, GLuint end) {
+				for (GLuint job = begin; job < end; job++)
+					this->scatter(job);
+			}, *signal);
+		}, &done, &this->assigned);
+	}
+
+	// Uploads the lights and the lists of the last Build
+	void Submit()
+	{
+		this->createBuffers();
+		upload(this->lightBuffer, &this->lightData[0], this->lightData.size() * sizeof(glm::vec4));
+		upload(this->sphereBuffer, this->spheres.data(), this->spheres.size() * sizeof(glm::vec4));
+		upload(this->clusterBuffer, &this->clusterData[0], this->clusterData.size() * sizeof(GLuint));
+		upload(this->indexBuffer, &this->indices[0], this->indices.size() * sizeof(GLushort));
+	}
+
+	// Binds the light, cluster and index buffers to units firstUnit to firstUnit + 2 and sets the
+	// uniforms shader needs to find its clusters
+	void Bind(Shader &shader, GLuint firstUnit, GLuint screenWidth, GLuint screenHeight)
+	{
+		glActiveTexture(GL_TEXTURE0 + firstUnit);
+		glBindTexture(GL_TEXTURE_BUFFER, this->lightTexture);
+		glUniform1i(glGetUniformLocation(shader.Program, "clusterLights"), firstUnit);
+		glActiveTexture(GL_TEXTURE0 + firstUnit + 1);
+		glBindTexture(GL_TEXTURE_BUFFER, this->clusterTexture);
+		glUniform1i(glGetUniformLocation(shader.Program, "clusters"), firstUnit + 1);
+		glActiveTexture(GL_TEXTURE0 + firstUnit + 2);
+		glBindTexture(GL_TEXTURE_BUFFER, this->indexTexture);
+		glUniform1i(glGetUniformLocation(shader.Program, "clusterIndices"), firstUnit + 2);
+		glUniform3i(glGetUniformLocation(shader.Program, "clusterDims"), this->TilesX, this->TilesY, this->Slices);
+		glUniform2f(glGetUniformLocation(shader.Program, "tileSize"), (GLfloat)screenWidth / this->TilesX, (GLfloat)screenHeight / this->TilesY);
+		glUniform1f(glGetUniformLocation(shader.Program, "clusterNear"), this->boundsNear);
+		glUniform1f(glGetUniformLocation(shader.Program, "clusterFar"), this->boundsFar);
+	}
+
+	// Light references in all the lists, the work the fragments share
+	GLuint References() const
+	{
+		return this->references;
+	}
+
+	// Texture buffer of the lights, 4 texels per light
+	GLuint LightTexture() const
+	{
+		return this->lightTexture;
+	}
+
+	// Texture buffer of the lights' world space bounding spheres, 1 texel per light
+	GLuint SphereTexture() const
+	{
+		return this->sphereTexture;
+	}
+
+	// Lights in the last upload
+	GLuint LightCount() const
+	{
+		return this->lights;
+	}
+
+	// Bounding sphere of a cone of the given range and outer cut-off cosine. Wide cones are
+	// bounded by their cap, narrow ones by the circle through the apex and the cap's rim.
+	static glm::vec4 ConeBounds(glm::vec3 apex, glm::vec3 direction, GLfloat cosAngle, GLfloat range)
+	{
+		direction = glm::normalize(direction);
+		if (cosAngle < 0.70710678f)
+			return glm::vec4(apex + direction * range * cosAngle, range * std::sqrt(1.0f - cosAngle * cosAngle));
+		GLfloat radius = range / (2.0f * cosAngle);
+		return glm::vec4(apex + direction * radius, radius);
+	}
+
+private:
+	GLuint lightBuffer, lightTexture;
+	GLuint sphereBuffer, sphereTexture;
+	GLuint clusterBuffer, clusterTexture;
+	GLuint indexBuffer, indexTexture;
+	std::vector<glm::vec4> lightData;
+	std::vector<glm::vec4> spheres;		// World space bounds of every light
+	GLuint lights;
+	std::vector<GLuint> clusterData;	// (offset, count) per cluster
+	std::vector<GLushort> indices;
+	GLuint references;
+	std::vector<std::vector<std::pair<GLuint, GLuint> > > pairs;	// (cluster, light) pairs found by each job
+	std::vector<std::vector<GLuint> > offsets;	// Each job's pairs per cluster, then where they go in indices
+	JobCounter assigned;
+	// View space bounds of every cluster as separate arrays, 4 clusters are tested at once.
+	// Each array is padded by 3 so the last group can be loaded whole.
+	std::vector<float> minX, minY, minZ, maxX, maxY, maxZ;
+	glm::mat4 boundsProjection;
+	GLfloat boundsNear, boundsFar;
+
+	void createBuffers()
+	{
+		if (this->lightBuffer != 0)
+			return;
+		this->createBuffer(this->lightBuffer, this->lightTexture, GL_RGBA32F);
+		this->createBuffer(this->sphereBuffer, this->sphereTexture, GL_RGBA32F);
+		this->createBuffer(this->clusterBuffer, this->clusterTexture, GL_RG32UI);
+		this->createBuffer(this->indexBuffer, this->indexTexture, GL_R16UI);
+	}
+
+	void createBuffer(GLuint &buffer, GLuint &texture, GLenum format)
+	{
+		glGenBuffers(1, &buffer);
+		glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+		glBufferData(GL_TEXTURE_BUFFER, 16, NULL, GL_STREAM_DRAW);
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_BUFFER, texture);
+		glTexBuffer(GL_TEXTURE_BUFFER, format, buffer);
+		glBindTexture(GL_TEXTURE_BUFFER, 0);
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	}
+
+	// Orphans last frame's storage so the driver never waits for the GPU to be done with it
+	static void upload(GLuint buffer, const void *data, size_t size)
+	{
+		glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+		glBufferData(GL_TEXTURE_BUFFER, size, NULL, GL_STREAM_DRAW);
+		glBufferSubData(GL_TEXTURE_BUFFER, 0, size, data);
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	}
+
+	// Light data, 4 texels per light, and the world space bounds of every light
+	void gather(const std::vector<PointLight> &points, const std::vector<SpotLight> &spots)
+	{
+		this->lightData.clear();
+		this->spheres.clear();
+		for (GLuint i = 0; i < points.size(); i++)
+		{
+			const PointLight &light = points[i];
+			GLfloat range = LightRange(light.Constant, light.Linear, light.Quadratic, light.Intensity);
+			this->lightData.push_back(glm::vec4(light.Position, range));
+			this->lightData.push_back(glm::vec4(light.Color * light.Intensity, 0.0f));
+			this->lightData.push_back(glm::vec4(0.0f, -1.0f, 0.0f, -2.0f));
+			this->lightData.push_back(glm::vec4(light.Constant, light.Linear, light.Quadratic, -1.0f));
+			this->spheres.push_back(glm::vec4(light.Position, range));
+		}
+		for (GLuint i = 0; i < spots.size(); i++)
+		{
+			const SpotLight &light = spots[i];
+			GLfloat range = LightRange(light.Constant, light.Linear, light.Quadratic, light.Intensity);
+			this->lightData.push_back(glm::vec4(light.Position, range));
+			this->lightData.push_back(glm::vec4(light.Color * light.Intensity, 1.0f));
+			this->lightData.push_back(glm::vec4(glm::normalize(light.Direction), light.OuterCutOff));
+			this->lightData.push_back(glm::vec4(light.Constant, light.Linear, light.Quadratic, light.CutOff));
+			this->spheres.push_back(ConeBounds(light.Position, light.Direction, light.OuterCutOff, range));
+		}
+		this->lights = this->spheres.size();
+		if (this->lightData.empty())
+			this->lightData.push_back(glm::vec4(0.0f));
+	}
+
+	void prepare(const std::vector<PointLight> &points, const std::vector<SpotLight> &spots, const glm::mat4 &projection, GLfloat nearPlane, GLfloat farPlane)
+	{
+		if (projection != this->boundsProjection || nearPlane != this->boundsNear || farPlane != this->boundsFar)
+			this->buildBounds(projection, nearPlane, farPlane);
+		this->gather(points, spots);
+	}
+
+	// (cluster, light) pairs of the lights begin to end, counted per cluster
+	void assignRange(GLuint begin, GLuint end, const glm::mat4 &projection, const glm::mat4 &view, GLuint job)
+	{
+		std::vector<std::pair<GLuint, GLuint> > &found = this->pairs[job];
+		std::vector<GLuint> &counts = this->offsets[job];
+		found.clear();
+		for (GLuint i = begin; i < end; i++)
+			this->assign(glm::vec3(view * glm::vec4(glm::vec3(this->spheres[i]), 1.0f)), this->spheres[i].w, projection, i, found);
+		counts.assign(this->TilesX * this->TilesY * this->Slices, 0);
+		for (GLuint i = 0; i < found.size(); i++)
+			counts[found[i].first]++;
+	}
+
+	// Counting sort, first half: the list of every cluster, and inside it a run per job in order
+	// so lights stay sorted whatever job wrote them
+	void sort()
+	{
+		GLuint clusterCount = this->TilesX * this->TilesY * this->Slices;
+		this->clusterData.assign(2 * clusterCount, 0);
+		GLuint offset = 0;
+		for (GLuint i = 0; i < clusterCount; i++)
+		{
+			this->clusterData[2 * i] = offset;
+			for (GLuint j = 0; j < this->offsets.size(); j++)
+			{
+				GLuint count = this->offsets[j][i];
+				this->offsets[j][i] = offset;
+				offset += count;
+			}
+			this->clusterData[2 * i + 1] = offset - this->clusterData[2 * i];
+		}
+		this->indices.assign(std::max(offset, 1u), 0);
+		this->references = offset;
+	}
+
+	// Second half, a job's pairs into their runs
+	void scatter(GLuint job)
+	{
+		const std::vector<std::pair<GLuint, GLuint> > &found = this->pairs[job];
+		std::vector<GLuint> &runs = this->offsets[job];
+		for (GLuint i = 0; i < found.size(); i++)
+			this->indices[runs[found[i].first]++] = (GLushort)found[i].second;
+	}
+
+	GLfloat sliceDepth(GLfloat slice) const
+	{
+		return this->boundsNear * std::pow(this->boundsFar / this->boundsNear, slice / this->Slices);
+	}
+
+	GLint sliceOf(GLfloat depth) const
+	{
+		GLint slice = (GLint)std::floor(std::log(depth / this->boundsNear) / std::log(this->boundsFar / this->boundsNear) * this->Slices);
+		return glm::clamp(slice, 0, (GLint)this->Slices - 1);
+	}
+
+	// View space AABB of every cluster, from the tile's corner rays cut at the slice's depths
+	void buildBounds(const glm::mat4 &projection, GLfloat nearPlane, GLfloat farPlane)
+	{
+		this->boundsProjection = projection;
+		this->boundsNear = nearPlane;
+		this->boundsFar = farPlane;
+		GLuint count = this->TilesX * this->TilesY * this->Slices + 3;
+		std::vector<float>* arrays[] = { &this->minX, &this->minY, &this->minZ, &this->maxX, &this->maxY, &this->maxZ };
+		for (GLuint i = 0; i < 6; i++)
+			arrays[i]->assign(count, 0.0f);
+
+		glm::mat4 inverseProjection = glm::inverse(projection);
+		for (GLuint z = 0; z < this->Slices; z++)
+		{
+			GLfloat depths[] = { this->sliceDepth((GLfloat)z), this->sliceDepth((GLfloat)z + 1.0f) };
+			for (GLuint y = 0; y < this->TilesY; y++)
+			{
+				for (GLuint x = 0; x < this->TilesX; x++)
+				{
+					glm::vec3 low(1e30f), high(-1e30f);
+					for (GLuint corner = 0; corner < 4; corner++)
+					{
+						glm::vec2 ndc(-1.0f + 2.0f * (x + (corner & 1)) / this->TilesX, -1.0f + 2.0f * (y + (corner >> 1)) / this->TilesY);
+						glm::vec4 point = inverseProjection * glm::vec4(ndc, -1.0f, 1.0f);
+						glm::vec3 ray = glm::vec3(point) / point.w;
+						for (GLuint d = 0; d < 2; d++)
+						{
+							glm::vec3 p = ray * (depths[d] / -ray.z);
+							low = glm::min(low, p);
+							high = glm::max(high, p);
+						}
+					}
+					GLuint i = x + this->TilesX * (y + this->TilesY * z);
+					this->minX[i] = low.x;
+					this->minY[i] = low.y;
+					this->minZ[i] = low.z;
+					this->maxX[i] = high.x;
+					this->maxY[i] = high.y;
+					this->maxZ[i] = high.z;
+				}
+			}
+		}
+	}
+
+	// Adds a pair for every cluster the view space sphere overlaps
+	void assign(glm::vec3 center, GLfloat radius, const glm::mat4 &projection, GLuint light, std::vector<std::pair<GLuint, GLuint> > &pairs)
+	{
+		GLfloat depth = -center.z;
+		if (depth + radius < this->boundsNear || depth - radius > this->boundsFar)
+			return;
+		GLint z0 = this->sliceOf(glm::max(depth - radius, this->boundsNear));
+		GLint z1 = this->sliceOf(glm::min(depth + radius, this->boundsFar));
+
+		// - Narrow down the tiles with the sphere's projected box, when all of it is in front of the camera
+		GLint x0 = 0, x1 = this->TilesX - 1, y0 = 0, y1 = this->TilesY - 1;
+		if (depth - radius > this->boundsNear)
+		{
+			glm::vec2 low(1e30f), high(-1e30f);
+			for (GLuint corner = 0; corner < 8; corner++)
+			{
+				glm::vec3 offset(corner & 1 ? radius : -radius, corner & 2 ? radius : -radius, corner & 4 ? radius : -radius);
+				glm::vec4 clip = projection * glm::vec4(center + offset, 1.0f);
+				glm::vec2 ndc = glm::vec2(clip) / clip.w;
+				low = glm::min(low, ndc);
+				high = glm::max(high, ndc);
+			}
+			if (high.x < -1.0f || high.y < -1.0f || low.x > 1.0f || low.y > 1.0f)
+				return;
+			x0 = glm::clamp((GLint)std::floor((low.x + 1.0f) * 0.5f * this->TilesX), 0, (GLint)this->TilesX - 1);
+			x1 = glm::clamp((GLint)std::floor((high.x + 1.0f) * 0.5f * this->TilesX), 0, (GLint)this->TilesX - 1);
+			y0 = glm::clamp((GLint)std::floor((low.y + 1.0f) * 0.5f * this->TilesY), 0, (GLint)this->TilesY - 1);
+			y1 = glm::clamp((GLint)std::floor((high.y + 1.0f) * 0.5f * this->TilesY), 0, (GLint)this->TilesY - 1);
+		}
+
+		// - Exact sphere/box test on 4 clusters of a row at a time: squared distance from the
+		// centre to the box, clamping each axis, against the squared radius
+		__m128 cx = _mm_set1_ps(center.x);
+		__m128 cy = _mm_set1_ps(center.y);
+		__m128 cz = _mm_set1_ps(center.z);
+		__m128 r2 = _mm_set1_ps(radius * radius);
+		__m128 zero = _mm_setzero_ps();
+		for (GLint z = z0; z <= z1; z++)
+		{
+			for (GLint y = y0; y <= y1; y++)
+			{
+				GLuint row = this->TilesX * (y + this->TilesY * z);
+				for (GLint x = x0; x <= x1; x += 4)
+				{
+					GLuint i = row + x;
+					__m128 dx = _mm_add_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(&this->minX[i]), cx), zero), _mm_max_ps(_mm_sub_ps(cx, _mm_loadu_ps(&this->maxX[i])), zero));
+					__m128 dy = _mm_add_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(&this->minY[i]), cy), zero), _mm_max_ps(_mm_sub_ps(cy, _mm_loadu_ps(&this->maxY[i])), zero));
+					__m128 dz = _mm_add_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(&this->minZ[i]), cz), zero), _mm_max_ps(_mm_sub_ps(cz, _mm_loadu_ps(&this->maxZ[i])), zero));
+					__m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+					GLint mask = _mm_movemask_ps(_mm_cmple_ps(distance, r2));
+					for (GLint lane = 0; lane < 4 && x + lane <= x1; lane++)
+						if (mask & (1 << lane))
+							pairs.push_back(std::make_pair(i + lane, light));
+				}
+			}
+		}
+	}
+};
@@ -0,0 +1,429 @@
+#pragma once
+
+// Std. Includes
+#include <vector>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <xmmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// GL Includes
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#include "Bounds.h"
+
+// The AVX2 kernel is built for AVX2 alone, it only runs once the CPU was found to have it
+#ifdef _MSC_VER
+#define ENTITY_TARGET_AVX2
+#else
+#define ENTITY_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#endif
+
+
+// Array of floats or matrices on 64 byte boundaries, so SIMD loads and stores never straddle
+// cache lines. Grows like a vector but never constructs its elements, it only holds PODs.
+template <typename T>
+class AlignedArray
+{
+public:
+	AlignedArray() : data(nullptr), capacity(0)
+	{
+	}
+
+	~AlignedArray()
+	{
+		_mm_free(this->data);
+	}
+
+	// Keeps the first count elements, the rest of the new space is zero
+	void Reserve(GLuint count)
+	{
+		if (count <= this->capacity)
+			return;
+		GLuint grown = std::max(count, this->capacity * 2);
+		T* grownData = (T*)_mm_malloc(grown * sizeof(T), 64);
+		std::memset((void*)grownData, 0, grown * sizeof(T));
+		if (this->data != nullptr)
+			std::memcpy(grownData, this->data, this->capacity * sizeof(T));
+		_mm_free(this->data);
+		this->data = grownData;
+		this->capacity = grown;
+	}
+
+	T &operator[](GLuint i)
+	{
+		return this->data[i];
+	}
+
+	const T &operator[](GLuint i) const
+	{
+		return this->data[i];
+	}
+
+	T* Data()
+	{
+		return this->data;
+	}
+
+	const T* Data() const
+	{
+		return this->data;
+	}
+
+private:
+	T* data;
+	GLuint capacity;
+
+	AlignedArray(const AlignedArray&);
+	AlignedArray &operator=(const AlignedArray&);
+};
+
+// Transforms and bounds of the scene's objects, one aligned array per component. Update turns
+// every entity's position, rotation quaternion and scale into its world matrix and its object
+// space box into a world space one in a single pass, 8 entities at a time with AVX2, 4 with SSE
+// or one at a time, whichever the CPU runs. The world matrices are contiguous, ready to be
+// uploaded as instance attributes, and Cull tests the world boxes 4 at a time.
+class EntityStore
+{
+public:
+	enum Kernel {
+		KERNEL_SCALAR,
+		KERNEL_SSE,
+		KERNEL_AVX2
+	};
+
+	// Entities are stored in groups of this many, the arrays are padded up to a whole group
+	static const GLuint GROUP = 8;
+
+	EntityStore() : count(0), kernel(Best())
+	{
+	}
+
+	// Adds an entity around its object space bounds
+	GLuint Create(glm::vec3 position, glm::quat rotation, glm::vec3 scale, const AABB &bounds)
+	{
+		GLuint entity = this->count++;
+		GLuint padded = (this->count + GROUP - 1) / GROUP * GROUP;
+		AlignedArray<float>* arrays[] = { &this->positionX, &this->positionY, &this->positionZ,
+			&this->rotationX, &this->rotationY, &this->rotationZ, &this->rotationW, &this->scaleX, &this->scaleY, &this->scaleZ,
+			&this->centerX, &this->centerY, &this->centerZ, &this->extentX, &this->extentY, &this->extentZ,
+			&this->minX, &this->minY, &this->minZ, &this->maxX, &this->maxY, &this->maxZ };
+		for (GLuint i = 0; i < sizeof(arrays) / sizeof(arrays[0]); i++)
+			arrays[i]->Reserve(padded);
+		this->worlds.Reserve(padded);
+		this->SetPosition(entity, position);
+		this->SetRotation(entity, rotation);
+		this->SetScale(entity, scale);
+		this->SetBounds(entity, bounds);
+		return entity;
+	}
+
+	void SetPosition(GLuint entity, glm::vec3 position)
+	{
+		this->positionX[entity] = position.x;
+		this->positionY[entity] = position.y;
+		this->positionZ[entity] = position.z;
+	}
+
+	void SetRotation(GLuint entity, glm::quat rotation)
+	{
+		this->rotationX[entity] = rotation.x;
+		this->rotationY[entity] = rotation.y;
+		this->rotationZ[entity] = rotation.z;
+		this->rotationW[entity] = rotation.w;
+	}
+
+	void SetScale(GLuint entity, glm::vec3 scale)
+	{
+		this->scaleX[entity] = scale.x;
+		this->scaleY[entity] = scale.y;
+		this->scaleZ[entity] = scale.z;
+	}
+
+	// Object space bounds, kept as centre and extents
+	void SetBounds(GLuint entity, const AABB &bounds)
+	{
+		glm::vec3 center = bounds.Center(), extents = bounds.Extents();
+		this->centerX[entity] = center.x;
+		this->centerY[entity] = center.y;
+		this->centerZ[entity] = center.z;
+		this->extentX[entity] = extents.x;
+		this->extentY[entity] = extents.y;
+		this->extentZ[entity] = extents.z;
+	}
+
+	glm::vec3 Position(GLuint entity) const
+	{
+		return glm::vec3(this->positionX[entity], this->positionY[entity], this->positionZ[entity]);
+	}
+
+	// World matrix as of the last Update
+	const glm::mat4 &World(GLuint entity) const
+	{
+		return this->worlds[entity];
+	}
+
+	// World matrices of all the entities in order, Count of them
+	const glm::mat4* Worlds() const
+	{
+		return this->worlds.Data();
+	}
+
+	// World space bounds as of the last Update
+	AABB WorldBounds(GLuint entity) const
+	{
+		return AABB(glm::vec3(this->minX[entity], this->minY[entity], this->minZ[entity]), glm::vec3(this->maxX[entity], this->maxY[entity], this->maxZ[entity]));
+	}
+
+	GLuint Count() const
+	{
+		return this->count;
+	}
+
+	// Composes the world matrix and world bounds of every entity
+	void Update()
+	{
+		if (this->kernel == KERNEL_AVX2)
+			this->updateAVX2(0, this->count);
+		else if (this->kernel == KERNEL_SSE)
+			this->updateSSE(0, this->count);
+		else
+			this->updateScalar(0, this->count);
+	}
+
+	// Entities whose world box is at least partly inside the frustum, in order
+	void Cull(const Frustum &frustum, std::vector<GLuint> &visible) const
+	{
+		visible.clear();
+		__m128 half = _mm_set1_ps(0.5f);
+		__m128 signMask = _mm_set1_ps(-0.0f);
+		for (GLuint i = 0; i < this->count; i += 4)
+		{
+			__m128 lowX = _mm_load_ps(&this->minX[i]), lowY = _mm_load_ps(&this->minY[i]), lowZ = _mm_load_ps(&this->minZ[i]);
+			__m128 highX = _mm_load_ps(&this->maxX[i]), highY = _mm_load_ps(&this->maxY[i]), highZ = _mm_load_ps(&this->maxZ[i]);
+			__m128 cx = _mm_mul_ps(_mm_add_ps(lowX, highX), half), ex = _mm_mul_ps(_mm_sub_ps(highX, lowX), half);
+			__m128 cy = _mm_mul_ps(_mm_add_ps(lowY, highY), half), ey = _mm_mul_ps(_mm_sub_ps(highY, lowY), half);
+			__m128 cz = _mm_mul_ps(_mm_add_ps(lowZ, highZ), half), ez = _mm_mul_ps(_mm_sub_ps(highZ, lowZ), half);
+			// - Outside when the centre is further behind a plane than the box reaches towards it
+			GLint outside = 0;
+			for (GLuint p = 0; p < 6; p++)
+			{
+				const glm::vec4 &plane = frustum.Planes[p];
+				__m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, _mm_set1_ps(plane.x)), _mm_mul_ps(cy, _mm_set1_ps(plane.y))),
+					_mm_add_ps(_mm_mul_ps(cz, _mm_set1_ps(plane.z)), _mm_set1_ps(plane.w)));
+				__m128 radius = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ex, _mm_set1_ps(std::fabs(plane.x))), _mm_mul_ps(ey, _mm_set1_ps(std::fabs(plane.y)))),
+					_mm_mul_ps(ez, _mm_set1_ps(std::fabs(plane.z))));
+				outside |= _mm_movemask_ps(_mm_cmplt_ps(distance, _mm_xor_ps(radius, signMask)));
+			}
+			for (GLuint lane = 0; lane < 4 && i + lane < this->count; lane++)
+				if ((outside & (1 << lane)) == 0)
+					visible.push_back(i + lane);
+		}
+	}
+
+	// Fastest kernel the CPU and the OS support
+	static Kernel Best()
+	{
+		return hasAVX2() ? KERNEL_AVX2 : KERNEL_SSE;
+	}
+
+	// Picks the kernel Update runs, for comparisons. AVX2 falls back when it is not supported.
+	void SetKernel(Kernel kernel)
+	{
+		this->kernel = kernel == KERNEL_AVX2 && !hasAVX2() ? KERNEL_SSE : kernel;
+	}
+
+	Kernel CurrentKernel() const
+	{
+		return this->kernel;
+	}
+
+	static const char* KernelName(Kernel kernel)
+	{
+		return kernel == KERNEL_AVX2 ? "AVX2" : kernel == KERNEL_SSE ? "SSE" : "scalar";
+	}
+
+private:
+	GLuint count;
+	Kernel kernel;
+	AlignedArray<float> positionX, positionY, positionZ;
+	AlignedArray<float> rotationX, rotationY, rotationZ, rotationW;
+	AlignedArray<float> scaleX, scaleY, scaleZ;
+	AlignedArray<float> centerX, centerY, centerZ, extentX, extentY, extentZ;	// Object space bounds
+	AlignedArray<float> minX, minY, minZ, maxX, maxY, maxZ;					// World space bounds
+	AlignedArray<glm::mat4> worlds;
+
+	// AVX2 and FMA in the CPU, and the OS saving the YMM registers on context switches
+	static bool hasAVX2()
+	{
+#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 0);
+		if (info[0] < 7)
+			return false;
+		__cpuid(info, 1);
+		bool fma = (info[2] & (1 << 12)) != 0;
+		bool osxsave = (info[2] & (1 << 27)) != 0;
+		if (!fma || !osxsave || (_xgetbv(0) & 6) != 6)
+			return false;
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;
+#else
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+	}
+
+	// Rotation times scale columns, then the box's world centre and extents (Arvo's method), as
+	// AABB::Transform does for one box
+	void updateScalar(GLuint begin, GLuint end)
+	{
+		for (GLuint i = begin; i < end; i++)
+		{
+			GLfloat x = this->rotationX[i], y = this->rotationY[i], z = this->rotationZ[i], w = this->rotationW[i];
+			GLfloat sx = this->scaleX[i], sy = this->scaleY[i], sz = this->scaleZ[i];
+			glm::mat4 &m = this->worlds[i];
+			m[0] = glm::vec4((1.0f - 2.0f * (y * y + z * z)) * sx, 2.0f * (x * y + w * z) * sx, 2.0f * (x * z - w * y) * sx, 0.0f);
+			m[1] = glm::vec4(2.0f * (x * y - w * z) * sy, (1.0f - 2.0f * (x * x + z * z)) * sy, 2.0f * (y * z + w * x) * sy, 0.0f);
+			m[2] = glm::vec4(2.0f * (x * z + w * y) * sz, 2.0f * (y * z - w * x) * sz, (1.0f - 2.0f * (x * x + y * y)) * sz, 0.0f);
+			m[3] = glm::vec4(this->positionX[i], this->positionY[i], this->positionZ[i], 1.0f);
+
+			glm::vec3 center = glm::vec3(m * glm::vec4(this->centerX[i], this->centerY[i], this->centerZ[i], 1.0f));
+			glm::vec3 extents;
+			for (GLuint k = 0; k < 3; k++)
+				extents[k] = std::fabs(m[0][k]) * this->extentX[i] + std::fabs(m[1][k]) * this->extentY[i] + std::fabs(m[2][k]) * this->extentZ[i];
+			this->minX[i] = center.x - extents.x;
+			this->minY[i] = center.y - extents.y;
+			this->minZ[i] = center.z - extents.z;
+			this->maxX[i] = center.x + extents.x;
+			this->maxY[i] = center.y + extents.y;
+			this->maxZ[i] = center.z + extents.z;
+		}
+	}
+
+	// Writes one column of 4 consecutive matrices from its x, y, z and w across the entities
+	static void storeColumn(glm::mat4* matrices, GLuint column, __m128 x, __m128 y, __m128 z, __m128 w)
+	{
+		_MM_TRANSPOSE4_PS(x, y, z, w);
+		_mm_store_ps(&matrices[0][column][0], x);
+		_mm_store_ps(&matrices[1][column][0], y);
+		_mm_store_ps(&matrices[2][column][0], z);
+		_mm_store_ps(&matrices[3][column][0], w);
+	}
+
+	// The same 4 entities at a time. The arrays are padded to a whole group, the padding is
+	// transformed along and never read.
+	void updateSSE(GLuint begin, GLuint end)
+	{
+		__m128 one = _mm_set1_ps(1.0f), two = _mm_set1_ps(2.0f), zero = _mm_setzero_ps();
+		__m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+		for (GLuint i = begin; i < end; i += 4)
+		{
+			__m128 x = _mm_load_ps(&this->rotationX[i]), y = _mm_load_ps(&this->rotationY[i]);
+			__m128 z = _mm_load_ps(&this->rotationZ[i]), w = _mm_load_ps(&this->rotationW[i]);
+			__m128 sx = _mm_load_ps(&this->scaleX[i]), sy = _mm_load_ps(&this->scaleY[i]), sz = _mm_load_ps(&this->scaleZ[i]);
+			__m128 xx = _mm_mul_ps(x, x), yy = _mm_mul_ps(y, y), zz = _mm_mul_ps(z, z);
+			__m128 xy = _mm_mul_ps(x, y), xz = _mm_mul_ps(x, z), yz = _mm_mul_ps(y, z);
+			__m128 wx = _mm_mul_ps(w, x), wy = _mm_mul_ps(w, y), wz = _mm_mul_ps(w, z);
+
+			__m128 m00 = _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(yy, zz))), sx);
+			__m128 m01 = _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(xy, wz)), sx);
+			__m128 m02 = _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(xz, wy)), sx);
+			__m128 m10 = _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(xy, wz)), sy);
+			__m128 m11 = _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, zz))), sy);
+			__m128 m12 = _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(yz, wx)), sy);
+			__m128 m20 = _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(xz, wy)), sz);
+			__m128 m21 = _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(yz, wx)), sz);
+			__m128 m22 = _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, yy))), sz);
+			__m128 px = _mm_load_ps(&this->positionX[i]), py = _mm_load_ps(&this->positionY[i]), pz = _mm_load_ps(&this->positionZ[i]);
+
+			glm::mat4* matrices = &this->worlds[i];
+			storeColumn(matrices, 0, m00, m01, m02, zero);
+			storeColumn(matrices, 1, m10, m11, m12, zero);
+			storeColumn(matrices, 2, m20, m21, m22, zero);
+			storeColumn(matrices, 3, px, py, pz, one);
+
+			__m128 cx = _mm_load_ps(&this->centerX[i]), cy = _mm_load_ps(&this->centerY[i]), cz = _mm_load_ps(&this->centerZ[i]);
+			__m128 ex = _mm_load_ps(&this->extentX[i]), ey = _mm_load_ps(&this->extentY[i]), ez = _mm_load_ps(&this->extentZ[i]);
+			__m128 centers[3], extents[3];
+			__m128 columns[3][3] = { { m00, m01, m02 }, { m10, m11, m12 }, { m20, m21, m22 } };
+			__m128 positions[3] = { px, py, pz };
+			for (GLuint k = 0; k < 3; k++)
+			{
+				centers[k] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(columns[0][k], cx), _mm_mul_ps(columns[1][k], cy)), _mm_add_ps(_mm_mul_ps(columns[2][k], cz), positions[k]));
+				extents[k] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_and_ps(columns[0][k], absMask), ex), _mm_mul_ps(_mm_and_ps(columns[1][k], absMask), ey)),
+					_mm_mul_ps(_mm_and_ps(columns[2][k], absMask), ez));
+			}
+			_mm_store_ps(&this->minX[i], _mm_sub_ps(centers[0], extents[0]));
+			_mm_store_ps(&this->minY[i], _mm_sub_ps(centers[1], extents[1]));
+			_mm_store_ps(&this->minZ[i], _mm_sub_ps(centers[2], extents[2]));
+			_mm_store_ps(&this->maxX[i], _mm_add_ps(centers[0], extents[0]));
+			_mm_store_ps(&this->maxY[i], _mm_add_ps(centers[1], extents[1]));
+			_mm_store_ps(&this->maxZ[i], _mm_add_ps(centers[2], extents[2]));
+		}
+	}
+
+	// Splits 8 entities' column into two groups of 4 matrices
+	ENTITY_TARGET_AVX2 static void storeColumns(glm::mat4* matrices, GLuint column, __m256 x, __m256 y, __m256 z, __m256 w)
+	{
+		storeColumn(matrices, column, _mm256_castps256_ps128(x), _mm256_castps256_ps128(y), _mm256_castps256_ps128(z), _mm256_castps256_ps128(w));
+		storeColumn(matrices + 4, column, _mm256_extractf128_ps(x, 1), _mm256_extractf128_ps(y, 1), _mm256_extractf128_ps(z, 1), _mm256_extractf128_ps(w, 1));
+	}
+
+	// The same 8 entities at a time, with the multiply-adds fused
+	ENTITY_TARGET_AVX2 void updateAVX2(GLuint begin, GLuint end)
+	{
+		__m256 one = _mm256_set1_ps(1.0f), two = _mm256_set1_ps(2.0f), zero = _mm256_setzero_ps();
+		__m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+		for (GLuint i = begin; i < end; i += 8)
+		{
+			__m256 x = _mm256_load_ps(&this->rotationX[i]), y = _mm256_load_ps(&this->rotationY[i]);
+			__m256 z = _mm256_load_ps(&this->rotationZ[i]), w = _mm256_load_ps(&this->rotationW[i]);
+			__m256 sx = _mm256_load_ps(&this->scaleX[i]), sy = _mm256_load_ps(&this->scaleY[i]), sz = _mm256_load_ps(&this->scaleZ[i]);
+			__m256 xx = _mm256_mul_ps(x, x), yy = _mm256_mul_ps(y, y), zz = _mm256_mul_ps(z, z);
+			__m256 xy = _mm256_mul_ps(x, y), xz = _mm256_mul_ps(x, z), yz = _mm256_mul_ps(y, z);
+			__m256 wx = _mm256_mul_ps(w, x), wy = _mm256_mul_ps(w, y), wz = _mm256_mul_ps(w, z);
+
+			__m256 m00 = _mm256_mul_ps(_mm256_fnmadd_ps(two, _mm256_add_ps(yy, zz), one), sx);
+			__m256 m01 = _mm256_mul_ps(_mm256_mul_ps(two, _mm256_add_ps(xy, wz)), sx);
+			__m256 m02 = _mm256_mul_ps(_mm256_mul_ps(two, _mm256_sub_ps(xz, wy)), sx);
+			__m256 m10 = _mm256_mul_ps(_mm256_mul_ps(two, _mm256_sub_ps(xy, wz)), sy);
+			__m256 m11 = _mm256_mul_ps(_mm256_fnmadd_ps(two, _mm256_add_ps(xx, zz), one), sy);
+			__m256 m12 = _mm256_mul_ps(_mm256_mul_ps(two, _mm256_add_ps(yz, wx)), sy);
+			__m256 m20 = _mm256_mul_ps(_mm256_mul_ps(two, _mm256_add_ps(xz, wy)), sz);
+			__m256 m21 = _mm256_mul_ps(_mm256_mul_ps(two, _mm256_sub_ps(yz, wx)), sz);
+			__m256 m22 = _mm256_mul_ps(_mm256_fnmadd_ps(two, _mm256_add_ps(xx, yy), one), sz);
+			__m256 px = _mm256_load_ps(&this->positionX[i]), py = _mm256_load_ps(&this->positionY[i]), pz = _mm256_load_ps(&this->positionZ[i]);
+
+			glm::mat4* matrices = &this->worlds[i];
+			storeColumns(matrices, 0, m00, m01, m02, zero);
+			storeColumns(matrices, 1, m10, m11, m12, zero);
+			storeColumns(matrices, 2, m20, m21, m22, zero);
+			storeColumns(matrices, 3, px, py, pz, one);
+
+			__m256 cx = _mm256_load_ps(&this->centerX[i]), cy = _mm256_load_ps(&this->centerY[i]), cz = _mm256_load_ps(&this->centerZ[i]);
+			__m256 ex = _mm256_load_ps(&this->extentX[i]), ey = _mm256_load_ps(&this->extentY[i]), ez = _mm256_load_ps(&this->extentZ[i]);
+			__m256 centers[3], extents[3];
+			__m256 columns[3][3] = { { m00, m01, m02 }, { m10, m11, m12 }, { m20, m21, m22 } };
+			__m256 positions[3] = { px, py, pz };
+			for (GLuint k = 0; k < 3; k++)
+			{
+				centers[k] = _mm256_fmadd_ps(columns[0][k], cx, _mm256_fmadd_ps(columns[1][k], cy, _mm256_fmadd_ps(columns[2][k], cz, positions[k])));
+				extents[k] = _mm256_fmadd_ps(_mm256_and_ps(columns[0][k], absMask), ex,
+					_mm256_fmadd_ps(_mm256_and_ps(columns[1][k], absMask), ey, _mm256_mul_ps(_mm256_and_ps(columns[2][k], absMask), ez)));
+			}
+			_mm256_store_ps(&this->minX[i], _mm256_sub_ps(centers[0], extents[0]));
+			_mm256_store_ps(&this->minY[i], _mm256_sub_ps(centers[1], extents[1]));
+			_mm256_store_ps(&this->minZ[i], _mm256_sub_ps(centers[2], extents[2]));
+			_mm256_store_ps(&this->maxX[i], _mm256_add_ps(centers[0], extents[0]));
+			_mm256_store_ps(&this->maxY[i], _mm256_add_ps(centers[1], extents[1]));
+			_mm256_store_ps(&this->maxZ[i], _mm256_add_ps(centers[2], extents[2]));
+		}
+	}
+};
@@ -0,0 +1,439 @@
+#pragma once
+
+// Std. Includes
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <functional>
+#include <iostream>
+
+// GL Includes
+#include <GL/glew.h>
+
+
+// Size and format of a render target allocated by the frame graph
+struct TargetDesc
+{
+	GLuint Width, Height;
+	GLenum InternalFormat;
+
+	TargetDesc(GLuint width = 0, GLuint height = 0, GLenum internalFormat = GL_NONE)
+		: Width(width), Height(height), InternalFormat(internalFormat)
+	{
+	}
+
+	bool operator==(const TargetDesc &other) const
+	{
+		return this->Width == other.Width && this->Height == other.Height && this->InternalFormat == other.InternalFormat;
+	}
+
+	bool IsDepth() const
+	{
+		return this->InternalFormat == GL_DEPTH_COMPONENT16 || this->InternalFormat == GL_DEPTH_COMPONENT24
+			|| this->InternalFormat == GL_DEPTH_COMPONENT32F || this->HasStencil();
+	}
+
+	bool HasStencil() const
+	{
+		return this->InternalFormat == GL_DEPTH24_STENCIL8 || this->InternalFormat == GL_DEPTH32F_STENCIL8;
+	}
+
+	// Bytes per texel, three component formats are counted padded to four as drivers store them
+	GLuint BytesPerPixel() const
+	{
+		switch (this->InternalFormat)
+		{
+		case GL_R8:
+			return 1;
+		case GL_RG8:
+		case GL_R16F:
+		case GL_DEPTH_COMPONENT16:
+			return 2;
+		case GL_RGBA16F:
+		case GL_RGB16F:
+		case GL_RG32F:
+		case GL_DEPTH32F_STENCIL8:
+			return 8;
+		case GL_RGBA32F:
+		case GL_RGB32F:
+			return 16;
+		default:
+			return 4;
+		}
+	}
+};
+
+// Declares the frame as passes reading and writing resources, rebuilt every frame. Compiling
+// culls the passes no output depends on and gives every transient target a lifetime, from the
+// first pass using it to the last one. Transient targets with the same description whose
+// lifetimes do not overlap share one texture, and attachments whose content is never read again
+// are invalidated so tiled GPUs do not have to write them back to memory.
+class FrameGraph
+{
+public:
+	typedef GLint Resource;
+	typedef std::function<void()> PassFunction;
+
+	// Constructor
+	FrameGraph() : frame(0)
+	{
+	}
+
+	// Starts declaring a new frame, pooled textures and framebuffers are kept
+	void Reset()
+	{
+		this->resources.clear();
+		this->passes.clear();
+		this->frame++;
+	}
+
+	// Declares a target the graph allocates for this frame only
+	Resource Create(const std::string &name, const TargetDesc &desc)
+	{
+		ResourceNode node;
+		node.Name = name;
+		node.Desc = desc;
+		node.Imported = false;
+		node.Root = this->resources.size();
+		this->resources.push_back(node);
+		return this->resources.size() - 1;
+	}
+
+	// Declares a texture owned outside of the graph, it is never aliased nor invalidated
+	Resource Import(const std::string &name, GLuint texture)
+	{
+		ResourceNode node;
+		node.Name = name;
+		node.Imported = true;
+		node.Texture = texture;
+		node.Root = this->resources.size();
+		this->resources.push_back(node);
+		return this->resources.size() - 1;
+	}
+
+	// New version of a resource, for a pass modifying it in place like blending into it: the pass
+	// reads the old version and writes the new one. Versions share one texture, but passes only
+	// depend on the version they read, so a modification nobody reads is still culled.
+	Resource Rename(Resource resource, const std::string &name)
+	{
+		ResourceNode node = this->resources[resource];
+		node.Name = name;
+		this->resources.push_back(node);
+		return this->resources.size() - 1;
+	}
+
+	// Adds a pass. When it writes transient targets the graph binds a framebuffer made of them
+	// (colors in order, then depth) and sets the viewport before running it, otherwise the pass
+	// binds its own. Passes with side effects, like drawing to the screen, are never culled.
+	void AddPass(const std::string &name, const std::vector<Resource> &reads, const std::vector<Resource> &writes, PassFunction function, bool sideEffect = false)
+	{
+		PassNode pass;
+		pass.Name = name;
+		pass.Reads = reads;
+		pass.Writes = writes;
+		pass.Function = function;
+		pass.SideEffect = sideEffect;
+		pass.Live = false;
+		this->passes.push_back(pass);
+	}
+
+	// Culls unused passes, computes lifetimes and assigns the pooled textures
+	void Compile()
+	{
+		// - Walk back from the passes with side effects, a pass lives if a live pass reads what it writes
+		std::vector<bool> needed(this->resources.size(), false);
+		for (GLint i = this->passes.size() - 1; i >= 0; i--)
+		{
+			PassNode &pass = this->passes[i];
+			pass.Live = pass.SideEffect;
+			for (GLuint j = 0; j < pass.Writes.size(); j++)
+				pass.Live = pass.Live || needed[pass.Writes[j]];
+			if (!pass.Live)
+				continue;
+			for (GLuint j = 0; j < pass.Reads.size(); j++)
+				needed[pass.Reads[j]] = true;
+		}
+
+		// - Lifetimes span the live passes using each resource
+		for (GLuint i = 0; i < this->resources.size(); i++)
+		{
+			this->resources[i].FirstPass = -1;
+			this->resources[i].LastPass = -1;
+			this->resources[i].Physical = -1;
+		}
+		for (GLuint i = 0; i < this->passes.size(); i++)
+		{
+			if (!this->passes[i].Live)
+				continue;
+			std::vector<Resource> used = this->passes[i].Reads;
+			used.insert(used.end(), this->passes[i].Writes.begin(), this->passes[i].Writes.end());
+			for (GLuint j = 0; j < used.size(); j++)
+			{
+				ResourceNode &resource = this->resources[used[j]];
+				if (resource.FirstPass < 0)
+					resource.FirstPass = i;
+				resource.LastPass = i;
+			}
+		}
+		// The texture lives as long as any of its versions
+		for (GLuint i = 0; i < this->resources.size(); i++)
+		{
+			ResourceNode &version = this->resources[i];
+			ResourceNode &root = this->resources[version.Root];
+			if (version.FirstPass < 0 || version.Root == (GLint)i)
+				continue;
+			if (root.FirstPass < 0 || version.FirstPass < root.FirstPass)
+				root.FirstPass = version.FirstPass;
+			root.LastPass = std::max(root.LastPass, version.LastPass);
+		}
+
+		// - Give each transient target a pooled texture that is free from its first pass on
+		std::vector<std::pair<GLint, GLuint> > transients;
+		for (GLuint i = 0; i < this->resources.size(); i++)
+			if (!this->resources[i].Imported && this->resources[i].FirstPass >= 0 && this->resources[i].Root == (GLint)i)
+				transients.push_back(std::make_pair(this->resources[i].FirstPass, i));
+		std::sort(transients.begin(), transients.end());
+		for (GLuint i = 0; i < this->pool.size(); i++)
+			this->pool[i].BusyUntil = -1;
+		for (GLuint i = 0; i < transients.size(); i++)
+		{
+			ResourceNode &resource = this->resources[transients[i].second];
+			for (GLuint j = 0; j < this->pool.size() && resource.Physical < 0; j++)
+				if (this->pool[j].Desc == resource.Desc && this->pool[j].BusyUntil < resource.FirstPass)
+					resource.Physical = j;
+			if (resource.Physical < 0)
+			{
+				this->pool.push_back(createTexture(resource.Desc));
+				resource.Physical = this->pool.size() - 1;
+			}
+			PooledTexture &texture = this->pool[resource.Physical];
+			texture.BusyUntil = resource.LastPass;
+			texture.LastFrame = this->frame;
+			resource.Texture = texture.Texture;
+		}
+		for (GLuint i = 0; i < this->resources.size(); i++)
+		{
+			ResourceNode &version = this->resources[i];
+			if (!version.Imported && version.FirstPass >= 0 && version.Root != (GLint)i)
+			{
+				version.Physical = this->resources[version.Root].Physical;
+				version.Texture = this->resources[version.Root].Texture;
+			}
+		}
+
+		// - Release the textures no frame has used for a while, like the targets of a mode switched off
+		for (GLint i = this->pool.size() - 1; i >= 0; i--)
+		{
+			if (this->frame - this->pool[i].LastFrame < POOL_FRAMES)
+				continue;
+			releaseTexture(this->pool[i].Texture);
+			this->pool.erase(this->pool.begin() + i);
+			for (GLuint j = 0; j < this->resources.size(); j++)
+				if (this->resources[j].Physical > i)
+					this->resources[j].Physical--;
+		}
+	}
+
+	// Runs the live passes in declaration order
+	void Execute()
+	{
+		for (GLuint i = 0; i < this->passes.size(); i++)
+		{
+			PassNode &pass = this->passes[i];
+			if (!pass.Live)
+				continue;
+
+			std::vector<GLuint> targets;
+			std::vector<GLenum> attachments;
+			std::vector<GLenum> started, ended;
+			GLuint colors = 0, width = 0, height = 0;
+			for (GLuint j = 0; j < pass.Writes.size(); j++)
+			{
+				const ResourceNode &resource = this->resources[this->resources[pass.Writes[j]].Root];
+				if (resource.Imported)
+					continue;
+				GLenum attachment = resource.Desc.HasStencil() ? GL_DEPTH_STENCIL_ATTACHMENT
+					: resource.Desc.IsDepth() ? GL_DEPTH_ATTACHMENT : GL_COLOR_ATTACHMENT0 + colors++;
+				targets.push_back(resource.Texture);
+				attachments.push_back(attachment);
+				width = resource.Desc.Width;
+				height = resource.Desc.Height;
+				if (resource.FirstPass == (GLint)i)
+					started.push_back(attachment);
+				if (resource.LastPass == (GLint)i)
+					ended.push_back(attachment);
+			}
+
+			GLuint fbo = 0;
+			if (!targets.empty())
+			{
+				fbo = framebufferFor(targets, attachments);
+				glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+				glViewport(0, 0, width, height);
+				// Whatever the texture held for a previous owner is not worth loading
+				invalidate(started);
+			}
+			pass.Function();
+			if (fbo != 0)
+			{
+				// Written but read by no later pass, like a depth buffer only used for testing
+				glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+				invalidate(ended);
+				glBindFramebuffer(GL_FRAMEBUFFER, 0);
+			}
+		}
+	}
+
+	// Texture of a resource, valid once compiled
+	GLuint Texture(Resource resource) const
+	{
+		return this->resources[resource].Texture;
+	}
+
+	GLuint PassCount() const
+	{
+		return this->passes.size();
+	}
+
+	GLuint LivePassCount() const
+	{
+		GLuint count = 0;
+		for (GLuint i = 0; i < this->passes.size(); i++)
+			count += this->passes[i].Live;
+		return count;
+	}
+
+	// Bytes of render targets in the pool
+	GLuint64 PoolBytes() const
+	{
+		GLuint64 bytes = 0;
+		for (GLuint i = 0; i < this->pool.size(); i++)
+			bytes += (GLuint64)this->pool[i].Desc.Width * this->pool[i].Desc.Height * this->pool[i].Desc.BytesPerPixel();
+		return bytes;
+	}
+
+	// Bytes the frame's transient targets would take without aliasing
+	GLuint64 TransientBytes() const
+	{
+		GLuint64 bytes = 0;
+		for (GLuint i = 0; i < this->resources.size(); i++)
+			if (!this->resources[i].Imported && this->resources[i].FirstPass >= 0 && this->resources[i].Root == (GLint)i)
+				bytes += (GLuint64)this->resources[i].Desc.Width * this->resources[i].Desc.Height * this->resources[i].Desc.BytesPerPixel();
+		return bytes;
+	}
+
+private:
+	static const GLuint POOL_FRAMES = 120;	// Frames a pooled texture survives unused
+
+	struct ResourceNode
+	{
+		std::string Name;
+		TargetDesc Desc;
+		bool Imported;
+		GLuint Texture;
+		GLint FirstPass, LastPass;	// Live passes using it, -1 when none does
+		GLint Physical;				// Index in the pool of transient targets
+		GLint Root;					// First version of the resource, itself when not renamed
+	};
+
+	struct PassNode
+	{
+		std::string Name;
+		std::vector<Resource> Reads, Writes;
+		PassFunction Function;
+		bool SideEffect;
+		bool Live;
+	};
+
+	struct PooledTexture
+	{
+		TargetDesc Desc;
+		GLuint Texture;
+		GLint BusyUntil;	// Last pass of the current owner this frame
+		GLuint LastFrame;	// Last frame it was assigned
+	};
+
+	std::vector<ResourceNode> resources;
+	std::vector<PassNode> passes;
+	std::vector<PooledTexture> pool;
+	// Framebuffers by attached textures, the pool keeps textures so their framebuffers are reused
+	std::map<std::vector<GLuint>, GLuint> framebuffers;
+	GLuint frame;
+
+	PooledTexture createTexture(const TargetDesc &desc)
+	{
+		PooledTexture texture;
+		texture.Desc = desc;
+		glGenTextures(1, &texture.Texture);
+		glBindTexture(GL_TEXTURE_2D, texture.Texture);
+		// No data is uploaded, any format and type matching the kind of target will do
+		if (desc.HasStencil())
+			glTexImage2D(GL_TEXTURE_2D, 0, desc.InternalFormat, desc.Width, desc.Height, 0, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, NULL);
+		else if (desc.IsDepth())
+			glTexImage2D(GL_TEXTURE_2D, 0, desc.InternalFormat, desc.Width, desc.Height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+		else
+			glTexImage2D(GL_TEXTURE_2D, 0, desc.InternalFormat, desc.Width, desc.Height, 0, GL_RGBA, GL_FLOAT, NULL);
+		GLint filter = desc.IsDepth() ? GL_NEAREST : GL_LINEAR;
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		return texture;
+	}
+
+	void releaseTexture(GLuint texture)
+	{
+		std::map<std::vector<GLuint>, GLuint>::iterator it = this->framebuffers.begin();
+		while (it != this->framebuffers.end())
+		{
+			if (std::find(it->first.begin(), it->first.end(), texture) != it->first.end())
+			{
+				glDeleteFramebuffers(1, &it->second);
+				it = this->framebuffers.erase(it);
+			}
+			else
+				++it;
+		}
+		glDeleteTextures(1, &texture);
+	}
+
+	GLuint framebufferFor(const std::vector<GLuint> &targets, const std::vector<GLenum> &attachments)
+	{
+		std::map<std::vector<GLuint>, GLuint>::iterator it = this->framebuffers.find(targets);
+		if (it != this->framebuffers.end())
+			return it->second;
+
+		GLuint fbo;
+		glGenFramebuffers(1, &fbo);
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		std::vector<GLenum> drawBuffers;
+		for (GLuint i = 0; i < targets.size(); i++)
+		{
+			glFramebufferTexture2D(GL_FRAMEBUFFER, attachments[i], GL_TEXTURE_2D, targets[i], 0);
+			if (attachments[i] != GL_DEPTH_ATTACHMENT && attachments[i] != GL_DEPTH_STENCIL_ATTACHMENT)
+				drawBuffers.push_back(attachments[i]);
+		}
+		if (drawBuffers.empty())
+		{
+			glDrawBuffer(GL_NONE);
+			glReadBuffer(GL_NONE);
+		}
+		else
+			glDrawBuffers(drawBuffers.size(), &drawBuffers[0]);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+			std::cout << "ERROR::FRAMEGRAPH:: Framebuffer is not complete!" << std::endl;
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		this->framebuffers[targets] = fbo;
+		return fbo;
+	}
+
+	// glInvalidateFramebuffer is GL 4.3, the 3.3 context only has it through ARB_invalidate_subdata
+	void invalidate(const std::vector<GLenum> &attachments)
+	{
+		if (attachments.empty() || !GLEW_ARB_invalidate_subdata)
+			return;
+		glInvalidateFramebuffer(GL_FRAMEBUFFER, attachments.size(), &attachments[0]);
+	}
+};
@@ -0,0 +1,11 @@
+#pragma once
+
+// Scalar types of the GL headers, for the code the lightmap baker shares with the renderer. The
+// baker has no GL, the renderer includes glew.h as well, which declares the very same types.
+typedef unsigned int GLenum;
+typedef unsigned int GLuint;
+typedef int GLint;
+typedef unsigned char GLubyte;
+typedef unsigned short GLushort;
+typedef float GLfloat;
+typedef double GLdouble;
@@ -0,0 +1,45 @@
+#pragma once
+
+// GL Includes
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "Shader.h"
+#include "ProbeGrid.h"
+
+
+// Probes of the static scene as the renderer uses them: the irradiance around a dynamic object
+// is blended from the grid and given to its shaders in one uniform block, a few multiply-adds
+// per fragment.
+class IrradianceVolume : public ProbeGrid
+{
+public:
+	IrradianceVolume() : UBO(0)
+	{
+	}
+
+	// Writes the irradiance an object draws with into the uniform block, 9 vec4 in std140
+	void Upload(const SH9 &irradiance)
+	{
+		glm::vec4 block[9];
+		for (GLuint k = 0; k < 9; k++)
+			block[k] = glm::vec4(irradiance.Coefficients[k], 0.0f);
+		if (this->UBO == 0)
+			glGenBuffers(1, &this->UBO);
+		glBindBuffer(GL_UNIFORM_BUFFER, this->UBO);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(block), block, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	}
+
+	// Binds the block to the shader's Probes uniform block through the given binding point
+	void Bind(Shader &shader, GLuint binding)
+	{
+		GLuint index = glGetUniformBlockIndex(shader.Program, "Probes");
+		if (index != GL_INVALID_INDEX)
+			glUniformBlockBinding(shader.Program, index, binding);
+		glBindBufferBase(GL_UNIFORM_BUFFER, binding, this->UBO);
+	}
+
+private:
+	GLuint UBO;
+};
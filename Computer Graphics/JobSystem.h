@@ -0,0 +1,257 @@
+#pragma once
+
+// Std. Includes
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+
+// GL Includes
+#include <GL/glew.h>
+
+
+// Jobs left to run before something can go on. Every job signalling the counter adds one
+// while it is queued or running, jobs that wait on it are parked here until it reaches zero.
+class JobCounter
+{
+public:
+	JobCounter() : pending(0)
+	{
+	}
+
+	// Once true the last job is done with the counter too, it can go out of scope
+	bool Done() const
+	{
+		if (this->pending.load() > 0)
+			return false;
+		std::lock_guard<std::mutex> lock(this->mutex);
+		return this->pending.load() == 0;
+	}
+
+private:
+	friend class JobSystem;
+
+	struct Parked
+	{
+		std::function<void()> Work;
+		JobCounter *Signal;
+	};
+
+	std::atomic<GLint> pending;
+	mutable std::mutex mutex;
+	std::vector<Parked> parked;
+};
+
+// Work-stealing job system for the CPU work of a frame. Every thread owns a deque: it pushes and
+// pops its own jobs at the back, where they are still in cache, and idle threads steal from the
+// front of the others. The thread that creates it takes part as thread 0 while it waits, the GL
+// thread keeps submitting and picks up jobs only once it needs their results.
+class JobSystem
+{
+public:
+	// Constructor, starts threads - 1 workers next to the calling thread
+	JobSystem(GLuint threads = std::max(std::thread::hardware_concurrency(), 1u))
+		: queued(0), stopping(false)
+	{
+		threads = std::max(threads, 1u);
+		for (GLuint i = 0; i < threads; i++)
+			this->queues.push_back(std::unique_ptr<Queue>(new Queue()));
+		for (GLuint i = 1; i < threads; i++)
+			this->workers.push_back(std::thread(&JobSystem::work, this, i));
+	}
+
+	// Jobs still queued are dropped, wait on their counters first
+	~JobSystem()
+	{
+		{
+			std::lock_guard<std::mutex> lock(this->sleepMutex);
+			this->stopping = true;
+		}
+		this->wake.notify_all();
+		for (GLuint i = 0; i < this->workers.size(); i++)
+			this->workers[i].join();
+	}
+
+	GLuint Threads() const
+	{
+		return this->queues.size();
+	}
+
+	// Queues work on the calling thread's deque. signal, if any, counts it until it returns;
+	// after, if any, holds it back until all the jobs signalling it are done.
+	void Run(std::function<void()> work, JobCounter *signal = nullptr, JobCounter *after = nullptr)
+	{
+		if (signal != nullptr)
+			signal->pending++;
+		if (after != nullptr && after->pending.load() > 0)
+		{
+			std::lock_guard<std::mutex> lock(after->mutex);
+			// - Checked again under the lock, the last job may have finished in between
+			if (after->pending.load() > 0)
+			{
+				JobCounter::Parked job = { work, signal };
+				after->parked.push_back(job);
+				return;
+			}
+		}
+		this->push(work, signal);
+	}
+
+	// Splits [0, count) into ranges of grain and runs work(begin, end) on each, signalling done
+	void ParallelFor(GLuint count, GLuint grain, std::function<void(GLuint, GLuint)> work, JobCounter &done, JobCounter *after = nullptr)
+	{
+		grain = std::max(grain, 1u);
+		for (GLuint begin = 0; begin < count; begin += grain)
+		{
+			GLuint end = std::min(begin + grain, count);
+			this->Run([work, begin, end]() { work(begin, end); }, &done, after);
+		}
+	}
+
+	// Same, returns once every range is done
+	void ParallelFor(GLuint count, GLuint grain, std::function<void(GLuint, GLuint)> work)
+	{
+		JobCounter done;
+		this->ParallelFor(count, grain, work, done);
+		this->Wait(done);
+	}
+
+	// Runs jobs, its own first, until the counter reaches zero
+	void Wait(JobCounter &counter)
+	{
+		GLuint index = this->threadIndex();
+		while (!counter.Done())
+		{
+			Job job;
+			if (this->take(index, job))
+				this->execute(job);
+			else
+				std::this_thread::yield();
+		}
+	}
+
+private:
+	struct Job
+	{
+		std::function<void()> Work;
+		JobCounter *Signal;
+	};
+
+	struct Queue
+	{
+		std::mutex Mutex;
+		std::deque<Job> Jobs;
+	};
+
+	std::vector<std::unique_ptr<Queue> > queues;
+	std::vector<std::thread> workers;
+	std::atomic<GLint> queued;		// Jobs in all the deques, idle workers sleep while it is zero
+	bool stopping;
+	std::mutex sleepMutex;
+	std::condition_variable wake;
+
+	// Index of the calling thread among this system's, any other thread shares thread 0's deque
+	struct ThreadSlot
+	{
+		const JobSystem *System;
+		GLuint Index;
+	};
+
+	static ThreadSlot &threadSlot()
+	{
+		static thread_local ThreadSlot slot = { nullptr, 0 };
+		return slot;
+	}
+
+	GLuint threadIndex() const
+	{
+		const ThreadSlot &slot = threadSlot();
+		return slot.System == this ? slot.Index : 0;
+	}
+
+	void push(const std::function<void()> &work, JobCounter *signal)
+	{
+		Queue &queue = *this->queues[this->threadIndex()];
+		{
+			std::lock_guard<std::mutex> lock(queue.Mutex);
+			Job job = { work, signal };
+			queue.Jobs.push_back(job);
+		}
+		this->queued++;
+		// - Taken so a worker between its check and its wait cannot miss the notification
+		{
+			std::lock_guard<std::mutex> lock(this->sleepMutex);
+		}
+		this->wake.notify_one();
+	}
+
+	// Newest job of the thread's own deque, or else the oldest of another's
+	bool take(GLuint index, Job &job)
+	{
+		if (this->queued.load() == 0)
+			return false;
+		for (GLuint i = 0; i < this->queues.size(); i++)
+		{
+			Queue &queue = *this->queues[(index + i) % this->queues.size()];
+			std::lock_guard<std::mutex> lock(queue.Mutex);
+			if (queue.Jobs.empty())
+				continue;
+			if (i == 0)
+			{
+				job = queue.Jobs.back();
+				queue.Jobs.pop_back();
+			}
+			else
+			{
+				job = queue.Jobs.front();
+				queue.Jobs.pop_front();
+			}
+			this->queued--;
+			return true;
+		}
+		return false;
+	}
+
+	// Runs a job, then releases the jobs parked on its counter when it was the last one
+	void execute(Job &job)
+	{
+		job.Work();
+		JobCounter *signal = job.Signal;
+		if (signal == nullptr)
+			return;
+		std::vector<JobCounter::Parked> released;
+		{
+			std::lock_guard<std::mutex> lock(signal->mutex);
+			if (--signal->pending > 0)
+				return;
+			released.swap(signal->parked);
+		}
+		for (GLuint i = 0; i < released.size(); i++)
+			this->push(released[i].Work, released[i].Signal);
+	}
+
+	void work(GLuint index)
+	{
+		ThreadSlot &slot = threadSlot();
+		slot.System = this;
+		slot.Index = index;
+		while (true)
+		{
+			Job job;
+			if (this->take(index, job))
+			{
+				this->execute(job);
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(this->sleepMutex);
+			this->wake.wait(lock, [this]() { return this->stopping || this->queued.load() > 0; });
+			if (this->stopping)
+				return;
+		}
+	}
+};
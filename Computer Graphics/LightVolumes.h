@@ -0,0 +1,97 @@
+#pragma once
+
+// Std. Includes
+#include <vector>
+#include <cmath>
+
+// GL Includes
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+#include "Shader.h"
+
+
+// Bounding volumes of the lamps for the deferred path: one sphere drawn per lamp, placed and
+// scaled by the vertex shader from the lamp's bounding sphere, so a lamp only shades the pixels it can
+// reach on screen. The back faces are drawn without depth test, they still cover the lamp's
+// pixels with the camera inside the sphere.
+class LightVolumes
+{
+public:
+	// Constructor, builds a unit sphere of the given segments around and rings from pole to pole
+	LightVolumes(GLuint segments = 16, GLuint rings = 8)
+	{
+		// The vertices are pushed out so the flat faces still enclose the unit sphere
+		GLfloat scale = 1.0f / (std::cos(glm::pi<GLfloat>() / segments) * std::cos(glm::pi<GLfloat>() / (2.0f * rings)));
+		std::vector<glm::vec3> vertices;
+		for (GLuint ring = 0; ring <= rings; ring++)
+		{
+			GLfloat theta = glm::pi<GLfloat>() * ring / rings;
+			for (GLuint segment = 0; segment <= segments; segment++)
+			{
+				GLfloat phi = 2.0f * glm::pi<GLfloat>() * segment / segments;
+				vertices.push_back(scale * glm::vec3(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi)));
+			}
+		}
+		std::vector<GLushort> indices;
+		for (GLuint ring = 0; ring < rings; ring++)
+		{
+			for (GLuint segment = 0; segment < segments; segment++)
+			{
+				GLushort a = ring * (segments + 1) + segment;
+				GLushort b = a + segments + 1;
+				// Counter-clockwise seen from outside
+				indices.push_back(a);
+				indices.push_back(a + 1);
+				indices.push_back(b);
+				indices.push_back(b);
+				indices.push_back(a + 1);
+				indices.push_back(b + 1);
+			}
+		}
+		this->indexCount = indices.size();
+
+		glGenVertexArrays(1, &this->VAO);
+		glGenBuffers(1, &this->VBO);
+		glGenBuffers(1, &this->EBO);
+		glBindVertexArray(this->VAO);
+		glBindBuffer(GL_ARRAY_BUFFER, this->VBO);
+		glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(glm::vec3), &vertices[0], GL_STATIC_DRAW);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, this->EBO);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLushort), &indices[0], GL_STATIC_DRAW);
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (GLvoid*)0);
+		glBindVertexArray(0);
+	}
+
+	// Draws one volume per lamp, adding their light to the bound target. The lamps are read from
+	// the texture buffer on the given unit, 4 texels each, their bounding spheres from the one on
+	// the next unit.
+	void Draw(Shader &shader, GLuint lampTexture, GLuint sphereTexture, GLuint unit, GLuint lamps)
+	{
+		glActiveTexture(GL_TEXTURE0 + unit);
+		glBindTexture(GL_TEXTURE_BUFFER, lampTexture);
+		glUniform1i(glGetUniformLocation(shader.Program, "lamps"), unit);
+		glActiveTexture(GL_TEXTURE0 + unit + 1);
+		glBindTexture(GL_TEXTURE_BUFFER, sphereTexture);
+		glUniform1i(glGetUniformLocation(shader.Program, "lampBounds"), unit + 1);
+
+		glDisable(GL_DEPTH_TEST);
+		glEnable(GL_CULL_FACE);
+		glCullFace(GL_FRONT);
+		glEnable(GL_BLEND);
+		glBlendFunc(GL_ONE, GL_ONE);
+		glBindVertexArray(this->VAO);
+		glDrawElementsInstanced(GL_TRIANGLES, this->indexCount, GL_UNSIGNED_SHORT, 0, lamps);
+		glBindVertexArray(0);
+		glDisable(GL_BLEND);
+		glCullFace(GL_BACK);
+		glDisable(GL_CULL_FACE);
+		glEnable(GL_DEPTH_TEST);
+	}
+
+private:
+	GLuint VAO, VBO, EBO;
+	GLuint indexCount;
+};
@@ -0,0 +1,36 @@
+#pragma once
+
+// Std. Includes
+#include <string>
+#include <vector>
+#include <fstream>
+
+// GL Includes
+#include <GL/glew.h>
+
+#include "LightmapLayout.h"
+
+
+// Uploads a DXT5 DDS as the lightmap baker writes them, compressed as it is. SOIL's own loader
+// queries GL_EXTENSIONS with glGetString, which a core profile no longer answers.
+inline GLuint LightmapFromFile(const std::string &path)
+{
+	std::ifstream file(path.c_str(), std::ios::binary);
+	GLuint header[32];
+	if (!file.read((char*)header, sizeof(header)) || header[0] != 0x20534444 || header[21] != 0x35545844)
+		return 0;
+	GLuint height = header[3], width = header[4];
+	std::vector<char> blocks(((width + 3) / 4) * ((height + 3) / 4) * 16);
+	if (!file.read(&blocks[0], blocks.size()))
+		return 0;
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glCompressedTexImage2D(GL_TEXTURE_2D, 0, GL_COMPRESSED_RGBA_S3TC_DXT5_EXT, width, height, 0, blocks.size(), &blocks[0]);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	return texture;
+}
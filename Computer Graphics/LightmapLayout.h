@@ -0,0 +1,254 @@
+#pragma once
+
+// Std. Includes
+#include <string>
+#include <vector>
+#include <map>
+#include <tuple>
+#include <fstream>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+// GL Includes
+#include "GLTypes.h"
+#include <glm/glm.hpp>
+
+
+// Lightmaps hold RGBM: rgb / (a * LIGHTMAP_RANGE), so light up to LIGHTMAP_RANGE survives 8 bits
+const GLfloat LIGHTMAP_RANGE = 8.0f;
+const GLfloat LIGHTMAP_TEXELS_PER_UNIT = 16.0f;	// Density the bake aims for, halved until a mesh fits
+const GLuint LIGHTMAP_MAX_SIZE = 1024;
+const GLuint LIGHTMAP_PADDING = 2;				// Texels around every chart, bilinear filtering never reaches a neighbour
+
+// Second UV set of a mesh. Vertices shared by several charts are split, every vertex of the
+// layout points back to the original vertex it copies, so the runtime can apply the exact
+// layout the bake used to the mesh it loads.
+struct LightmapLayout
+{
+	GLuint Size;						// Width and height of the lightmap
+	std::vector<GLuint> Sources;		// Original vertex of every vertex
+	std::vector<glm::vec2> Coords;		// Lightmap coordinates of every vertex
+	std::vector<GLuint> Indices;		// Triangles over the new vertices
+
+	LightmapLayout() : Size(0)
+	{
+	}
+
+	// Cuts the triangles into charts joined across shared edges while they face the same major
+	// axis, projects every chart on the plane of that axis and packs the charts on shelves
+	static LightmapLayout Unwrap(const std::vector<glm::vec3> &positions, const std::vector<GLuint> &indices, GLfloat texelsPerUnit = LIGHTMAP_TEXELS_PER_UNIT, GLuint maxSize = LIGHTMAP_MAX_SIZE)
+	{
+		GLuint triangles = indices.size() / 3;
+
+		// - Major axis of every triangle, as 2 * axis + 1 when facing the negative side
+		std::vector<GLuint> facing(triangles);
+		for (GLuint t = 0; t < triangles; t++)
+		{
+			glm::vec3 n = glm::cross(positions[indices[3 * t + 1]] - positions[indices[3 * t]], positions[indices[3 * t + 2]] - positions[indices[3 * t]]);
+			glm::vec3 a = glm::abs(n);
+			GLuint axis = a.x >= a.y && a.x >= a.z ? 0 : a.y >= a.z ? 1 : 2;
+			facing[t] = 2 * axis + (n[axis] < 0.0f ? 1 : 0);
+		}
+
+		// - Edges are matched by position, importers duplicate vertices along texture seams
+		std::map<std::tuple<GLint, GLint, GLint>, GLuint> welded;
+		std::vector<GLuint> positionId(positions.size());
+		for (GLuint i = 0; i < positions.size(); i++)
+		{
+			glm::ivec3 key = glm::ivec3(glm::round(positions[i] * 10000.0f));
+			std::tuple<GLint, GLint, GLint> tuple(key.x, key.y, key.z);
+			std::map<std::tuple<GLint, GLint, GLint>, GLuint>::iterator it = welded.find(tuple);
+			if (it == welded.end())
+				it = welded.insert(std::make_pair(tuple, (GLuint)welded.size())).first;
+			positionId[i] = it->second;
+		}
+		std::map<std::pair<GLuint, GLuint>, std::vector<GLuint> > edges;
+		for (GLuint t = 0; t < triangles; t++)
+		{
+			for (GLuint j = 0; j < 3; j++)
+			{
+				GLuint a = positionId[indices[3 * t + j]], b = positionId[indices[3 * t + (j + 1) % 3]];
+				edges[std::make_pair(std::min(a, b), std::max(a, b))].push_back(t);
+			}
+		}
+
+		// - Flood fill the charts
+		std::vector<GLint> chartOf(triangles, -1);
+		std::vector<std::vector<GLuint> > charts;
+		for (GLuint seed = 0; seed < triangles; seed++)
+		{
+			if (chartOf[seed] >= 0)
+				continue;
+			std::vector<GLuint> chart;
+			std::vector<GLuint> open(1, seed);
+			chartOf[seed] = charts.size();
+			while (!open.empty())
+			{
+				GLuint t = open.back();
+				open.pop_back();
+				chart.push_back(t);
+				for (GLuint j = 0; j < 3; j++)
+				{
+					GLuint a = positionId[indices[3 * t + j]], b = positionId[indices[3 * t + (j + 1) % 3]];
+					const std::vector<GLuint> &neighbours = edges[std::make_pair(std::min(a, b), std::max(a, b))];
+					for (GLuint k = 0; k < neighbours.size(); k++)
+					{
+						if (chartOf[neighbours[k]] < 0 && facing[neighbours[k]] == facing[seed])
+						{
+							chartOf[neighbours[k]] = charts.size();
+							open.push_back(neighbours[k]);
+						}
+					}
+				}
+			}
+			charts.push_back(chart);
+		}
+
+		// - Pack, halving the density until everything fits
+		std::vector<glm::vec2> chartMin(charts.size());
+		std::vector<glm::uvec2> chartOffset(charts.size());
+		GLuint size = 0;
+		for (;; texelsPerUnit *= 0.5f)
+		{
+			std::vector<glm::uvec2> chartSize(charts.size());
+			GLfloat area = 0.0f;
+			GLuint widest = 1;
+			for (GLuint c = 0; c < charts.size(); c++)
+			{
+				GLuint axis = facing[charts[c][0]] / 2;
+				glm::vec2 low(FLT_MAX), high(-FLT_MAX);
+				for (GLuint i = 0; i < charts[c].size(); i++)
+				{
+					for (GLuint j = 0; j < 3; j++)
+					{
+						glm::vec2 p = project(positions[indices[3 * charts[c][i] + j]], axis) * texelsPerUnit;
+						low = glm::min(low, p);
+						high = glm::max(high, p);
+					}
+				}
+				chartMin[c] = low;
+				chartSize[c] = glm::uvec2(glm::ceil(high - low)) + glm::uvec2(1 + 2 * LIGHTMAP_PADDING);
+				area += (GLfloat)chartSize[c].x * chartSize[c].y;
+				widest = std::max(widest, chartSize[c].x);
+			}
+			std::vector<GLuint> sorted(charts.size());
+			for (GLuint c = 0; c < charts.size(); c++)
+				sorted[c] = c;
+			std::stable_sort(sorted.begin(), sorted.end(), [&](GLuint a, GLuint b) { return chartSize[a].y > chartSize[b].y; });
+
+			size = nextPowerOfTwo(std::max((GLuint)std::ceil(std::sqrt(area)), widest));
+			for (;; size *= 2)
+			{
+				GLuint x = 0, y = 0, shelf = 0;
+				for (GLuint i = 0; i < sorted.size(); i++)
+				{
+					glm::uvec2 extent = chartSize[sorted[i]];
+					if (x + extent.x > size)
+					{
+						x = 0;
+						y += shelf;
+						shelf = 0;
+					}
+					chartOffset[sorted[i]] = glm::uvec2(x, y);
+					x += extent.x;
+					shelf = std::max(shelf, extent.y);
+				}
+				if (y + shelf <= size)
+					break;
+			}
+			if (size <= maxSize)
+				break;
+		}
+
+		// - One vertex per original vertex and chart
+		LightmapLayout layout;
+		layout.Size = size;
+		std::map<std::pair<GLuint, GLuint>, GLuint> remap;
+		for (GLuint t = 0; t < triangles; t++)
+		{
+			GLuint chart = chartOf[t];
+			GLuint axis = facing[t] / 2;
+			for (GLuint j = 0; j < 3; j++)
+			{
+				GLuint source = indices[3 * t + j];
+				std::pair<GLuint, GLuint> key(source, chart);
+				std::map<std::pair<GLuint, GLuint>, GLuint>::iterator it = remap.find(key);
+				if (it == remap.end())
+				{
+					glm::vec2 texel = glm::vec2(chartOffset[chart]) + GLfloat(LIGHTMAP_PADDING) + project(positions[source], axis) * texelsPerUnit - chartMin[chart];
+					it = remap.insert(std::make_pair(key, (GLuint)layout.Sources.size())).first;
+					layout.Sources.push_back(source);
+					layout.Coords.push_back((texel + 0.5f) / (GLfloat)size);
+				}
+				layout.Indices.push_back(it->second);
+			}
+		}
+		return layout;
+	}
+
+	// Rebuilds the vertices and indices the layout was made from with the lightmap coordinates
+	template <typename VertexType>
+	bool Apply(std::vector<VertexType> &vertices, std::vector<GLuint> &indices) const
+	{
+		std::vector<VertexType> split(this->Sources.size());
+		for (GLuint i = 0; i < this->Sources.size(); i++)
+		{
+			if (this->Sources[i] >= vertices.size())
+				return false;
+			split[i] = vertices[this->Sources[i]];
+			split[i].LightmapCoords = this->Coords[i];
+		}
+		vertices.swap(split);
+		indices = this->Indices;
+		return true;
+	}
+
+	bool Save(const std::string &path) const
+	{
+		std::ofstream file(path.c_str(), std::ios::binary);
+		GLuint counts[3] = { this->Size, (GLuint)this->Sources.size(), (GLuint)this->Indices.size() };
+		file.write((const char*)counts, sizeof(counts));
+		file.write((const char*)&this->Sources[0], this->Sources.size() * sizeof(GLuint));
+		file.write((const char*)&this->Coords[0], this->Coords.size() * sizeof(glm::vec2));
+		file.write((const char*)&this->Indices[0], this->Indices.size() * sizeof(GLuint));
+		return file.good();
+	}
+
+	bool Load(const std::string &path)
+	{
+		std::ifstream file(path.c_str(), std::ios::binary);
+		GLuint counts[3];
+		if (!file.read((char*)counts, sizeof(counts)) || counts[1] == 0 || counts[2] == 0)
+			return false;
+		this->Size = counts[0];
+		this->Sources.resize(counts[1]);
+		this->Coords.resize(counts[1]);
+		this->Indices.resize(counts[2]);
+		file.read((char*)&this->Sources[0], this->Sources.size() * sizeof(GLuint));
+		file.read((char*)&this->Coords[0], this->Coords.size() * sizeof(glm::vec2));
+		file.read((char*)&this->Indices[0], this->Indices.size() * sizeof(GLuint));
+		return file.good();
+	}
+
+private:
+	// Coordinates on the plane of a major axis
+	static glm::vec2 project(glm::vec3 p, GLuint axis)
+	{
+		return axis == 0 ? glm::vec2(p.z, p.y) : axis == 1 ? glm::vec2(p.x, p.z) : glm::vec2(p.x, p.y);
+	}
+
+	static GLuint nextPowerOfTwo(GLuint value)
+	{
+		GLuint power = 1;
+		while (power < value)
+			power *= 2;
+		return power;
+	}
+};
+
+// Paths of a mesh's layout and lightmap, meshes are numbered in the order the model loads them
+inline std::string LightmapPath(const std::string &directory, GLuint mesh, const char *extension)
+{
+	return directory + "/mesh" + std::to_string(mesh) + extension;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+// Std. Includes
+#include <cmath>
+
+// GL Includes
+#include <glm/glm.hpp>
+
+
+// A point light with distance attenuation 1 / (constant + linear * d + quadratic * d^2)
+struct PointLight {
+	glm::vec3 Position;
+	glm::vec3 Color;
+	float Intensity;
+
+	float Constant;
+	float Linear;
+	float Quadratic;
+};
+
+// A spot light, cut-offs are stored as cosines of the cone half-angles
+struct SpotLight {
+	glm::vec3 Position;
+	glm::vec3 Direction;
+	glm::vec3 Color;
+	float Intensity;
+
+	float CutOff;
+	float OuterCutOff;
+	float Constant;
+	float Linear;
+	float Quadratic;
+};
+
+// Distance at which a light of the given intensity is attenuated below threshold.
+// Solves intensity / (constant + linear * d + quadratic * d^2) = threshold for d.
+inline float LightRange(float constant, float linear, float quadratic, float intensity, float threshold = 1.0f / 256.0f)
+{
+	float c = constant - intensity / threshold;
+	if (quadratic <= 0.0f)
+		return linear > 0.0f ? -c / linear : 1e6f;
+	return (-linear + sqrt(linear * linear - 4.0f * quadratic * c)) / (2.0f * quadratic);
+}
+
+inline float LightRange(const PointLight &light)
+{
+	// The ambient term is not scaled by the intensity, never let the range drop below its reach
+	return LightRange(light.Constant, light.Linear, light.Quadratic, glm::max(light.Intensity, 1.0f));
+}
+
+inline float LightRange(const SpotLight &light)
+{
+	return LightRange(light.Constant, light.Linear, light.Quadratic, glm::max(light.Intensity, 1.0f));
+}
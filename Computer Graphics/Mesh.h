@@ -11,6 +11,8 @@ using namespace std;
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
+#include "Shader.h"
+#include "Bounds.h"
 
 struct Vertex {
 	// Position
@@ -21,6 +23,8 @@ struct Vertex {
 	glm::vec2 TexCoords;
 	// Tangent
 	glm::vec3 Tangent;
+	// Lightmap coordinates, a second set unique over the whole mesh
+	glm::vec2 LightmapCoords;
 };
 
 struct Texture {
@@ -35,6 +39,8 @@ public:
 	vector<Vertex> vertices;
 	vector<GLuint> indices;
 	vector<Texture> textures;
+	AABB Bounds;	// Object space bounds of the vertices
+	ShaderDefines Defines;	// Shader variant matching the maps the mesh has
 
 	/*  Functions  */
 	// Constructor
@@ -43,19 +49,30 @@ public:
 		this->vertices = vertices;
 		this->indices = indices;
 		this->textures = textures;
+		for (GLuint i = 0; i < this->vertices.size(); i++)
+			this->Bounds.Extend(this->vertices[i].Position);
+		for (GLuint i = 0; i < this->textures.size(); i++)
+		{
+			if (this->textures[i].type == "texture_normal")
+				this->Defines["HAS_NORMAL_MAP"] = "1";
+			else if (this->textures[i].type == "texture_specular")
+				this->Defines["HAS_SPECULAR_MAP"] = "1";
+			else if (this->textures[i].type == "texture_lightmap")
+				this->Defines["HAS_LIGHTMAP"] = "1";
+		}
 
 		// Now that we have all the required data, set the vertex buffers and its attribute pointers.
 		this->setupMesh();
 	}
 
 	// Render the mesh
-	void Draw(Shader shader)
+	void Draw(Shader &shader)
 	{
 		// Bind appropriate textures
 		GLuint diffuseNr = 1;
 		GLuint specularNr = 1;
 		GLuint normalNr = 1;
-		bool hasNormalMap = false;
+		GLuint lightmapNr = 1;
 		for (GLuint i = 0; i < this->textures.size(); i++)
 		{
 			glActiveTexture(GL_TEXTURE1 + i); // Active proper texture unit before binding
@@ -68,15 +85,12 @@ public:
 			else if (name == "texture_specular")
 				ss << specularNr++; // Transfer GLuint to stream
 			else if (name == "texture_normal")
-			{
 				ss << normalNr++;
-				hasNormalMap = true;
-			}
+			else if (name == "texture_lightmap")
+				ss << lightmapNr++;
 			number = ss.str();
 			// Now set the sampler to the correct texture unit
 			glUniform1i(glGetUniformLocation(shader.Program, (name + number).c_str()), i+1);
-			// Set the mapping booleans
-			glUniform1i(glGetUniformLocation(shader.Program, "hasNormalMap"), hasNormalMap);
 			// And finally bind the texture
 			glBindTexture(GL_TEXTURE_2D, this->textures[i].id);
 		}
@@ -99,9 +113,25 @@ public:
 		}
 	}
 
+	// Render the mesh's depth alone, from the position-only stream
+	void DrawDepth()
+	{
+		glBindVertexArray(this->depthVAO);
+		glDrawElements(GL_TRIANGLES, this->indices.size(), GL_UNSIGNED_INT, 0);
+		glBindVertexArray(0);
+	}
+
+	// Returns the number of triangles submitted by Draw
+	GLuint TriangleCount()
+	{
+		return this->indices.size() / 3;
+	}
+
 private:
 	/*  Render data  */
 	GLuint VAO, VBO, EBO;
+	// Positions packed on their own, depth-only passes fetch 12 bytes per vertex instead of 52
+	GLuint depthVAO, positionVBO;
 
 	/*  Functions    */
 	// Initializes all the buffer objects/arrays
@@ -136,8 +166,25 @@ private:
 		//Vertex Tangents
 		glEnableVertexAttribArray(3);
 		glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)offsetof(Vertex, Tangent));
+		// Vertex Lightmap Coords
+		glEnableVertexAttribArray(4);
+		glVertexAttribPointer(4, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)offsetof(Vertex, LightmapCoords));
 
 
 		glBindVertexArray(0);
+
+		// Position-only stream, sharing the index buffer
+		vector<glm::vec3> positions(this->vertices.size());
+		for (GLuint i = 0; i < this->vertices.size(); i++)
+			positions[i] = this->vertices[i].Position;
+		glGenVertexArrays(1, &this->depthVAO);
+		glGenBuffers(1, &this->positionVBO);
+		glBindVertexArray(this->depthVAO);
+		glBindBuffer(GL_ARRAY_BUFFER, this->positionVBO);
+		glBufferData(GL_ARRAY_BUFFER, positions.size() * sizeof(glm::vec3), &positions[0], GL_STATIC_DRAW);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, this->EBO);
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (GLvoid*)0);
+		glBindVertexArray(0);
 	}
 };
\ No newline at end of file
@@ -6,43 +6,137 @@
 #include <iostream>
 #include <map>
 #include <vector>
+#include <functional>
 using namespace std;
 // GL Includes
 #include <GL/glew.h> // Contains all the necessery OpenGL includes
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/type_ptr.hpp>
 #include <SOIL.h>
 #include <assimp/Importer.hpp>
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
 
 #include "Mesh.h"
+#include "Lightmap.h"
+#include "SceneGraph.h"
 
-GLint TextureFromFile(const char* path, string directory);
+GLint TextureFromFile(const char* path, string directory, bool sRGB = false);
 
 class Model
 {
 public:
+	/*  Model Data  */
+	vector<Mesh> meshes;
+	SceneGraph Nodes;			// Assimp's node hierarchy under a placement node, node 0
+	vector<GLuint> MeshNodes;	// Node of every mesh
+
 	/*  Functions   */
-	// Constructor, expects a filepath to a 3D model.
-	Model(GLchar* path)
+	// Constructor, expects a filepath to a 3D model. Meshes baked into the lightmaps directory,
+	// next to the model, get their lightmap layout and texture.
+	Model(const GLchar* path, const string &lightmaps = "")
+		: lightmaps(lightmaps)
 	{
+		this->Nodes.Add(SceneGraph::NO_PARENT, glm::mat4(), "placement");
 		this->loadModel(path);
 	}
 
-	// Draws the model, and thus all its meshes
-	void Draw(Shader shader)
+	// Places the whole model in the world, takes effect at the next UpdateTransforms
+	void SetTransform(const glm::mat4 &transform)
+	{
+		this->Nodes.SetLocal(0, transform);
+	}
+
+	// Brings the world transforms of the nodes changed since the last call up to date
+	GLuint UpdateTransforms()
+	{
+		return this->Nodes.Update();
+	}
+
+	// World transform of a mesh, its node's
+	const glm::mat4 &MeshTransform(GLuint mesh) const
+	{
+		return this->Nodes.World(this->MeshNodes[mesh]);
+	}
+
+	// Draws the model, and thus all its meshes, setting shader's model matrix to each mesh's
+	void Draw(Shader &shader)
 	{
+		GLint model = glGetUniformLocation(shader.Program, "model");
 		for (GLuint i = 0; i < this->meshes.size(); i++)
+		{
+			this->setTransform(model, i);
 			this->meshes[i].Draw(shader);
+		}
+	}
+
+	// Draws the depth of every mesh from the position-only streams, no textures are bound
+	void DrawDepth(Shader &shader)
+	{
+		GLint model = glGetUniformLocation(shader.Program, "model");
+		for (GLuint i = 0; i < this->meshes.size(); i++)
+		{
+			this->setTransform(model, i);
+			this->meshes[i].DrawDepth();
+		}
+	}
+
+	// Draws every mesh with the variant of shaders matching its maps, on top of the given defines.
+	// Meshes are grouped by variant and prepare is called once per variant, after Use, to set
+	// the uniforms the meshes share.
+	void Draw(ShaderVariants &shaders, const ShaderDefines &defines, std::function<void(Shader&)> prepare)
+	{
+		map<Shader*, vector<GLuint> > batches;
+		for (GLuint i = 0; i < this->meshes.size(); i++)
+		{
+			ShaderDefines variant = defines;
+			variant.insert(this->meshes[i].Defines.begin(), this->meshes[i].Defines.end());
+			batches[&shaders.Get(variant)].push_back(i);
+		}
+		for (map<Shader*, vector<GLuint> >::iterator it = batches.begin(); it != batches.end(); ++it)
+		{
+			it->first->Use();
+			prepare(*it->first);
+			GLint model = glGetUniformLocation(it->first->Program, "model");
+			for (GLuint i = 0; i < it->second.size(); i++)
+			{
+				this->setTransform(model, it->second[i]);
+				this->meshes[it->second[i]].Draw(*it->first);
+			}
+		}
+	}
+
+	// Returns the number of triangles submitted by Draw
+	GLuint TriangleCount()
+	{
+		GLuint count = 0;
+		for (GLuint i = 0; i < this->meshes.size(); i++)
+			count += this->meshes[i].TriangleCount();
+		return count;
+	}
+
+	// Returns the world space bounds of all the meshes, as of the last UpdateTransforms
+	AABB Bounds()
+	{
+		AABB bounds;
+		for (GLuint i = 0; i < this->meshes.size(); i++)
+			bounds.Extend(this->meshes[i].Bounds.Transform(this->MeshTransform(i)));
+		return bounds;
 	}
 
 private:
 	/*  Model Data  */
-	vector<Mesh> meshes;
 	string directory;
+	string lightmaps;
 	vector<Texture> textures_loaded;	// Stores all the textures loaded so far, optimization to make sure textures aren't loaded more than once.
 
+	// Sets the model matrix to a mesh's, location is looked up once per draw rather than per mesh
+	void setTransform(GLint location, GLuint mesh)
+	{
+		glUniformMatrix4fv(location, 1, GL_FALSE, glm::value_ptr(this->MeshTransform(mesh)));
+	}
+
 										/*  Functions   */
 										// Loads a model with supported ASSIMP extensions from file and stores the resulting meshes in the meshes vector.
 	void loadModel(string path)
@@ -60,12 +154,14 @@ private:
 		this->directory = path.substr(0, path.find_last_of('/'));
 
 		// Process ASSIMP's root node recursively
-		this->processNode(scene->mRootNode, scene);
+		this->processNode(scene->mRootNode, scene, 0);
 	}
 
 	// Processes a node in a recursive fashion. Processes each individual mesh located at the node and repeats this process on its children nodes (if any).
-	void processNode(aiNode* node, const aiScene* scene)
+	// The node keeps its transform in the hierarchy, under parent.
+	void processNode(aiNode* node, const aiScene* scene, GLuint parent)
 	{
+		GLuint index = this->Nodes.Add(parent, AssimpMatrix(node->mTransformation), node->mName.C_Str());
 		// Process each mesh located at the current node
 		for (GLuint i = 0; i < node->mNumMeshes; i++)
 		{
@@ -73,11 +169,12 @@ private:
 			// The scene contains all the data, node is just to keep stuff organized (like relations between nodes).
 			aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
 			this->meshes.push_back(this->processMesh(mesh, scene));
+			this->MeshNodes.push_back(index);
 		}
 		// After we've processed all of the meshes (if any) we then recursively process each of the children nodes
 		for (GLuint i = 0; i < node->mNumChildren; i++)
 		{
-			this->processNode(node->mChildren[i], scene);
+			this->processNode(node->mChildren[i], scene, index);
 		}
 
 	}
@@ -126,6 +223,7 @@ private:
 				vertex.TexCoords = glm::vec2(0.0f, 0.0f);
 				vertex.Tangent = glm::vec3(0.0f, 0.0f, 1.0f);
 			}
+			vertex.LightmapCoords = glm::vec2(0.0f, 0.0f);
 			vertices.push_back(vertex);
 		}
 		// Now wak through each of the mesh's faces (a face is a mesh its triangle) and retrieve the corresponding vertex indices.
@@ -157,6 +255,20 @@ private:
 			vector<Texture> normalMaps = this->loadMaterialTextures(material, aiTextureType_HEIGHT, "texture_normal");
 			textures.insert(textures.end(), normalMaps.begin(), normalMaps.end());
 		}
+		// 4. Lightmap, the layout splits the vertices along the chart seams of the bake
+		if (!this->lightmaps.empty())
+		{
+			string directory = this->directory + '/' + this->lightmaps;
+			LightmapLayout layout;
+			if (layout.Load(LightmapPath(directory, this->meshes.size(), ".layout")) && layout.Apply(vertices, indices))
+			{
+				Texture texture;
+				texture.id = LightmapFromFile(LightmapPath(directory, this->meshes.size(), ".dds"));
+				texture.type = "texture_lightmap";
+				if (texture.id != 0)
+					textures.push_back(texture);
+			}
+		}
 
 		// Return a mesh object created from the extracted mesh data
 		return Mesh(vertices, indices, textures);
@@ -185,7 +297,8 @@ private:
 			if (!skip)
 			{   // If texture hasn't been loaded already, load it
 				Texture texture;
-				texture.id = TextureFromFile(str.C_Str(), this->directory);
+				// Colors are authored in sRGB, lighting is computed on linear values
+				texture.id = TextureFromFile(str.C_Str(), this->directory, type == aiTextureType_DIFFUSE);
 				texture.type = typeName;
 				texture.path = str;
 				textures.push_back(texture);
@@ -199,7 +312,7 @@ private:
 
 
 
-GLint TextureFromFile(const char* path, string directory)
+GLint TextureFromFile(const char* path, string directory, bool sRGB)
 {
 	//Generate texture ID and load texture data 
 	string filename = string(path);
@@ -210,7 +323,7 @@ GLint TextureFromFile(const char* path, string directory)
 	unsigned char* image = SOIL_load_image(filename.c_str(), &width, &height, 0, SOIL_LOAD_RGB);
 	// Assign texture to ID
 	glBindTexture(GL_TEXTURE_2D, textureID);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
+	glTexImage2D(GL_TEXTURE_2D, 0, sRGB ? GL_SRGB8 : GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
 	glGenerateMipmap(GL_TEXTURE_2D);
 
 	// Parameters
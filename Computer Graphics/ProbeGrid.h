@@ -0,0 +1,122 @@
+#pragma once
+
+// Std. Includes
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <cmath>
+
+// GL Includes
+#include "GLTypes.h"
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+#include "Bounds.h"
+
+
+// Constants of the real SH basis, in the order of the polynomials below
+const GLfloat SH_BASIS[9] = { 0.282095f, 0.488603f, 0.488603f, 0.488603f, 1.092548f, 1.092548f, 0.315392f, 1.092548f, 0.546274f };
+
+// Irradiance as L2 spherical harmonics, 9 RGB coefficients. The basis constants and the cosine
+// lobe are folded in, a normal gives the light to multiply the albedo with:
+// c0 + c1 y + c2 z + c3 x + c4 xy + c5 yz + c6 (3z^2 - 1) + c7 xz + c8 (x^2 - y^2)
+struct SH9
+{
+	glm::vec3 Coefficients[9];
+
+	SH9()
+	{
+		for (GLuint i = 0; i < 9; i++)
+			this->Coefficients[i] = glm::vec3(0.0f);
+	}
+};
+
+// Grid of irradiance probes over the static scene, one per cell. The lightmap baker fills and
+// saves it from the light the static surfaces reflect, the renderer loads and samples it.
+class ProbeGrid
+{
+public:
+	// Probe count along each axis for cells of about spacing
+	static glm::uvec3 CountsFor(const AABB &bounds, GLfloat spacing, GLuint maxCount = 16)
+	{
+		glm::vec3 cells = glm::ceil((bounds.Max - bounds.Min) / spacing);
+		return glm::uvec3(glm::clamp(cells, glm::vec3(2.0f), glm::vec3((GLfloat)maxCount)));
+	}
+
+	bool Save(const std::string &path) const
+	{
+		std::ofstream file(path.c_str(), std::ios::binary);
+		file.write((const char*)&this->bounds, sizeof(AABB));
+		file.write((const char*)&this->counts, sizeof(glm::uvec3));
+		file.write((const char*)&this->probes[0], this->probes.size() * sizeof(SH9));
+		file.write((const char*)&this->weights[0], this->weights.size() * sizeof(GLfloat));
+		return file.good();
+	}
+
+	bool Load(const std::string &path)
+	{
+		std::ifstream file(path.c_str(), std::ios::binary);
+		if (!file.read((char*)&this->bounds, sizeof(AABB)) || !file.read((char*)&this->counts, sizeof(glm::uvec3)))
+			return false;
+		GLuint count = this->counts.x * this->counts.y * this->counts.z;
+		if (count == 0 || glm::any(glm::lessThan(this->counts, glm::uvec3(2))))
+			return false;
+		this->probes.resize(count);
+		this->weights.resize(count);
+		file.read((char*)&this->probes[0], count * sizeof(SH9));
+		file.read((char*)&this->weights[0], count * sizeof(GLfloat));
+		return file.good();
+	}
+
+	// Trilinear blend of the 8 probes around position, probes in walls are left out
+	SH9 Sample(glm::vec3 position) const
+	{
+		SH9 result;
+		if (this->probes.empty())
+			return result;
+		glm::vec3 grid = glm::clamp((position - this->bounds.Min) / this->cellSize() - 0.5f, glm::vec3(0.0f), glm::vec3(this->counts) - 1.0f);
+		glm::uvec3 base = glm::min(glm::uvec3(grid), this->counts - 2u);
+		glm::vec3 f = grid - glm::vec3(base);
+		GLfloat total = 0.0f;
+		for (GLuint corner = 0; corner < 8; corner++)
+		{
+			glm::uvec3 offset(corner & 1, (corner >> 1) & 1, (corner >> 2) & 1);
+			glm::uvec3 cell = base + offset;
+			GLuint index = cell.x + this->counts.x * (cell.y + this->counts.y * cell.z);
+			glm::vec3 w = glm::mix(1.0f - f, f, glm::vec3(offset));
+			GLfloat weight = w.x * w.y * w.z * this->weights[index];
+			for (GLuint k = 0; k < 9; k++)
+				result.Coefficients[k] += weight * this->probes[index].Coefficients[k];
+			total += weight;
+		}
+		if (total > 0.0f)
+			for (GLuint k = 0; k < 9; k++)
+				result.Coefficients[k] /= total;
+		return result;
+	}
+
+	GLuint ProbeCount() const
+	{
+		return this->probes.size();
+	}
+
+protected:
+	AABB bounds;
+	glm::uvec3 counts;
+	std::vector<SH9> probes;
+	std::vector<GLfloat> weights;
+
+	glm::vec3 cellSize() const
+	{
+		return (this->bounds.Max - this->bounds.Min) / glm::vec3(this->counts);
+	}
+
+	// SH basis functions in direction d
+	static void evaluate(glm::vec3 d, GLfloat basis[9])
+	{
+		GLfloat polynomials[9] = { 1.0f, d.y, d.z, d.x, d.x * d.y, d.y * d.z, 3.0f * d.z * d.z - 1.0f, d.x * d.z, d.x * d.x - d.y * d.y };
+		for (GLuint k = 0; k < 9; k++)
+			basis[k] = SH_BASIS[k] * polynomials[k];
+	}
+};
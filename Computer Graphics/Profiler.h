@@ -0,0 +1,100 @@
+#pragma once
+
+// GL Includes
+#include <GL/glew.h>
+
+
+// Averages a query over the frames, between Begin and End, e.g. GL_SAMPLES_PASSED.
+// Results are read back a few frames later so measuring never stalls the pipeline.
+class GpuCounter
+{
+public:
+	// Constructor
+	GpuCounter(GLenum target) : target(target), initialized(false), current(0), pending(0), total(0.0), samples(0)
+	{
+	}
+
+	void Begin()
+	{
+		// Queries are created on first use, so timers can be declared before the context exists
+		if (!this->initialized)
+		{
+			glGenQueries(QUERY_COUNT, this->queries);
+			this->initialized = true;
+		}
+		// Collect every finished result before reusing its query object
+		this->collect();
+		if (this->pending == QUERY_COUNT)
+			return;
+		glBeginQuery(this->target, this->queries[this->current]);
+	}
+
+	void End()
+	{
+		if (this->pending == QUERY_COUNT)
+			return;
+		glEndQuery(this->target);
+		this->current = (this->current + 1) % QUERY_COUNT;
+		this->pending++;
+	}
+
+	// Average result since the last Reset
+	double Average()
+	{
+		return this->samples > 0 ? this->total / this->samples : 0.0;
+	}
+
+	GLuint Samples()
+	{
+		return this->samples;
+	}
+
+	void Reset()
+	{
+		this->total = 0.0;
+		this->samples = 0;
+	}
+
+private:
+	static const GLuint QUERY_COUNT = 4;
+	GLenum target;
+	GLuint queries[QUERY_COUNT];
+	bool initialized;
+	GLuint current;		// Next query to issue
+	GLuint pending;		// Issued queries whose result has not been read yet
+	double total;
+	GLuint samples;
+
+	void collect()
+	{
+		while (this->pending > 0)
+		{
+			GLuint oldest = (this->current + QUERY_COUNT - this->pending) % QUERY_COUNT;
+			GLint available = 0;
+			glGetQueryObjectiv(this->queries[oldest], GL_QUERY_RESULT_AVAILABLE, &available);
+			if (!available)
+				return;
+			GLuint64 result = 0;
+			glGetQueryObjectui64v(this->queries[oldest], GL_QUERY_RESULT, &result);
+			this->total += (double)result;
+			this->samples++;
+			this->pending--;
+		}
+	}
+};
+
+// Measures the GPU time spent between Begin and End with GL_TIME_ELAPSED queries
+class GpuTimer : public GpuCounter
+{
+public:
+	// Constructor
+	GpuTimer() : GpuCounter(GL_TIME_ELAPSED)
+	{
+	}
+
+	// Average time in milliseconds since the last Reset
+	double Average()
+	{
+		return GpuCounter::Average() / 1000000.0;
+	}
+};
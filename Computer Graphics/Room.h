@@ -0,0 +1,21 @@
+#pragma once
+
+// GL Includes
+#include <glm/glm.hpp>
+
+#include "Lights.h"
+
+
+// The static room and the lights baked into its lightmaps, shared by the renderer and the
+// lightmap baker so both place and light it the same way. Paths are relative to the renderer's
+// working directory, the baker runs from there too.
+const char ROOM_MODEL[] = "nope/nope.obj";
+const char ROOM_LIGHTMAPS[] = "lightmaps";				// Next to the model
+const char ROOM_PROBES[] = "nope/lightmaps/probes.sh";
+
+// The room never moves, its point and spot light are baked into lightmaps with this offset
+const glm::vec3 ROOM_OFFSET(0.0f, -1.75f, 0.0f);
+
+const PointLight ROOM_POINT_LIGHT = { glm::vec3(0.5f, -0.8f, -4.2f), glm::vec3(1.0f, 1.0f, 1.0f), 0.5f, 1.0f, 0.09f, 0.032f };
+const SpotLight ROOM_SPOT_LIGHT = { glm::vec3(-0.1f, 1.0f, 2.3f), glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(1.0f, 1.0f, 1.0f), 0.5f,
+	glm::cos(glm::radians(12.5f)), glm::cos(glm::radians(15.0f)), 1.0f, 0.09f, 0.032f };
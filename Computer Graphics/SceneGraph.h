@@ -0,0 +1,125 @@
+#pragma once
+
+// Std. Includes
+#include <string>
+#include <vector>
+#include <algorithm>
+
+// GL Includes
+#include "GLTypes.h"
+#include <glm/glm.hpp>
+#include <assimp/matrix4x4.h>
+
+
+// Assimp's matrices are row major, glm's column major
+inline glm::mat4 AssimpMatrix(const aiMatrix4x4 &matrix)
+{
+	glm::mat4 result;
+	for (GLuint row = 0; row < 4; row++)
+		for (GLuint column = 0; column < 4; column++)
+			result[column][row] = matrix[row][column];
+	return result;
+}
+
+// Transform hierarchy stored flat, one array per field. Nodes are added depth first, so a
+// parent always comes before its children and every subtree is one run of nodes: End is one
+// past the last node of a node's subtree. Changing a node's local transform marks it dirty,
+// Update then walks the run of every dirty node once, parents before children, and leaves the
+// rest of the hierarchy alone.
+class SceneGraph
+{
+public:
+	static const GLuint NO_PARENT = 0xFFFFFFFF;
+
+	// Adds a node under parent, which must be the last node added or one of its ancestors
+	GLuint Add(GLuint parent, const glm::mat4 &local, const std::string &name = "")
+	{
+		GLuint index = this->locals.size();
+		this->parents.push_back(parent);
+		this->ends.push_back(index + 1);
+		this->locals.push_back(local);
+		this->worlds.push_back(parent == NO_PARENT ? local : this->worlds[parent] * local);
+		this->dirty.push_back(0);
+		this->names.push_back(name);
+		for (GLuint ancestor = parent; ancestor != NO_PARENT; ancestor = this->parents[ancestor])
+			this->ends[ancestor] = index + 1;
+		return index;
+	}
+
+	void SetLocal(GLuint node, const glm::mat4 &local)
+	{
+		this->locals[node] = local;
+		if (!this->dirty[node])
+		{
+			this->dirty[node] = 1;
+			this->dirtyNodes.push_back(node);
+		}
+	}
+
+	// Recomputes the world transforms of the dirty nodes and everything under them, returns how many
+	GLuint Update()
+	{
+		// - In order, a dirty node inside a subtree already walked is skipped
+		std::sort(this->dirtyNodes.begin(), this->dirtyNodes.end());
+		GLuint walked = 0, updated = 0;
+		for (GLuint i = 0; i < this->dirtyNodes.size(); i++)
+		{
+			GLuint node = this->dirtyNodes[i];
+			this->dirty[node] = 0;
+			if (node < walked)
+				continue;
+			walked = this->ends[node];
+			for (GLuint j = node; j < walked; j++)
+			{
+				GLuint parent = this->parents[j];
+				this->worlds[j] = parent == NO_PARENT ? this->locals[j] : this->worlds[parent] * this->locals[j];
+			}
+			updated += walked - node;
+		}
+		this->dirtyNodes.clear();
+		return updated;
+	}
+
+	const glm::mat4 &Local(GLuint node) const
+	{
+		return this->locals[node];
+	}
+
+	// World transform as of the last Update
+	const glm::mat4 &World(GLuint node) const
+	{
+		return this->worlds[node];
+	}
+
+	GLuint Parent(GLuint node) const
+	{
+		return this->parents[node];
+	}
+
+	// One past the last node under node
+	GLuint End(GLuint node) const
+	{
+		return this->ends[node];
+	}
+
+	// First node with the given name, or NO_PARENT
+	GLuint Find(const std::string &name) const
+	{
+		std::vector<std::string>::const_iterator it = std::find(this->names.begin(), this->names.end(), name);
+		return it == this->names.end() ? NO_PARENT : (GLuint)(it - this->names.begin());
+	}
+
+	GLuint NodeCount() const
+	{
+		return this->locals.size();
+	}
+
+private:
+	std::vector<GLuint> parents;
+	std::vector<GLuint> ends;
+	std::vector<glm::mat4> locals;
+	std::vector<glm::mat4> worlds;
+	std::vector<GLubyte> dirty;
+	std::vector<GLuint> dirtyNodes;	// Nodes marked dirty since the last Update, each once
+	std::vector<std::string> names;
+};
@@ -5,24 +5,50 @@
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <map>
+#include <vector>
+#include <iterator>
+#include <tuple>
+#include <chrono>
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
 
 #include <GL/glew.h>
 
+// Preprocessor defines a shader is compiled with, name to value
+typedef std::map<std::string, std::string> ShaderDefines;
+
+// Programs built since startup, compiled from source or loaded from the binary cache
+struct ShaderStats
+{
+	GLuint Compiled, Cached, Rejected;	// Rejected binaries were compiled again
+	double CompileMs, CacheMs;			// Time the calling thread spent submitting and finishing each kind
+};
+
 class Shader
 {
 public:
 	GLuint Program;
-	// Constructor generates the shader on the fly
-	Shader(const GLchar* vertexPath, const GLchar* fragmentPath)
+	// Constructor generates the shader on the fly, the geometry shader is optional.
+	// The defines are inserted right after the #version line of every stage. Without wait
+	// the program is only submitted, call Finish (or Use) once every program is submitted.
+	Shader(const GLchar* vertexPath, const GLchar* fragmentPath, const GLchar* geometryPath = nullptr, const ShaderDefines &defines = ShaderDefines(), bool wait = true)
+		: pending(false)
 	{
-		// 1. Retrieve the vertex/fragment source code from filePath
+		// 1. Retrieve the vertex/fragment/geometry source code from filePath
 		std::string vertexCode;
 		std::string fragmentCode;
+		std::string geometryCode;
 		std::ifstream vShaderFile;
 		std::ifstream fShaderFile;
+		std::ifstream gShaderFile;
 		// ensures ifstream objects can throw exceptions:
 		vShaderFile.exceptions(std::ifstream::badbit);
 		fShaderFile.exceptions(std::ifstream::badbit);
+		gShaderFile.exceptions(std::ifstream::badbit);
 		try
 		{
 			// Open files
@@ -38,44 +64,100 @@ public:
 			// Convert stream into string
 			vertexCode = vShaderStream.str();
 			fragmentCode = fShaderStream.str();
+			if (geometryPath != nullptr)
+			{
+				gShaderFile.open(geometryPath);
+				std::stringstream gShaderStream;
+				gShaderStream << gShaderFile.rdbuf();
+				gShaderFile.close();
+				geometryCode = gShaderStream.str();
+			}
 		}
 		catch (std::ifstream::failure e)
 		{
 			std::cout << "ERROR::SHADER::FILE_NOT_SUCCESFULLY_READ" << std::endl;
 		}
+		vertexCode = InsertDefines(InsertIncludes(vertexCode, vertexPath), defines);
+		fragmentCode = InsertDefines(InsertIncludes(fragmentCode, fragmentPath), defines);
+		geometryCode = InsertDefines(InsertIncludes(geometryCode, geometryPath != nullptr ? geometryPath : ""), defines);
+		// 2. Load the program a previous run linked from the same sources on the same driver
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		std::string cachePath = binaryPath(vertexCode + '\0' + fragmentCode + '\0' + geometryCode);
+		this->Program = glCreateProgram();
+		if (this->loadBinary(cachePath))
+		{
+			Stats().Cached++;
+			Stats().CacheMs += millisecondsSince(start);
+			return;
+		}
 		const GLchar* vShaderCode = vertexCode.c_str();
 		const GLchar * fShaderCode = fragmentCode.c_str();
-		// 2. Compile shaders
-		GLuint vertex, fragment;
+		// 3. Submit the compiles and the link, their status is only queried by Finish so the
+		// driver can work on several programs at once
+		this->vertex = glCreateShader(GL_VERTEX_SHADER);
+		glShaderSource(this->vertex, 1, &vShaderCode, NULL);
+		glCompileShader(this->vertex);
+		this->fragment = glCreateShader(GL_FRAGMENT_SHADER);
+		glShaderSource(this->fragment, 1, &fShaderCode, NULL);
+		glCompileShader(this->fragment);
+		this->geometry = 0;
+		if (geometryPath != nullptr)
+		{
+			const GLchar* gShaderCode = geometryCode.c_str();
+			this->geometry = glCreateShader(GL_GEOMETRY_SHADER);
+			glShaderSource(this->geometry, 1, &gShaderCode, NULL);
+			glCompileShader(this->geometry);
+		}
+		// Shader Program
+		glAttachShader(this->Program, this->vertex);
+		glAttachShader(this->Program, this->fragment);
+		if (this->geometry != 0)
+			glAttachShader(this->Program, this->geometry);
+		if (binariesSupported())
+			glProgramParameteri(this->Program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+		glLinkProgram(this->Program);
+		this->cachePath = cachePath;
+		this->pending = true;
+		Stats().CompileMs += millisecondsSince(start);
+		if (wait)
+			this->Finish();
+	}
+
+	// A submitted program owns its stage objects and cache path, copies would finish it twice
+	Shader(const Shader&) = delete;
+	Shader& operator=(const Shader&) = delete;
+
+	// Waits for a submitted program, prints its errors if any and caches its binary
+	void Finish()
+	{
+		if (!this->pending)
+			return;
+		this->pending = false;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
 		GLint success;
 		GLchar infoLog[512];
-		// Vertex Shader
-		vertex = glCreateShader(GL_VERTEX_SHADER);
-		glShaderSource(vertex, 1, &vShaderCode, NULL);
-		glCompileShader(vertex);
 		// Print compile errors if any
-		glGetShaderiv(vertex, GL_COMPILE_STATUS, &success);
+		glGetShaderiv(this->vertex, GL_COMPILE_STATUS, &success);
 		if (!success)
 		{
-			glGetShaderInfoLog(vertex, 512, NULL, infoLog);
+			glGetShaderInfoLog(this->vertex, 512, NULL, infoLog);
 			std::cout << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n" << infoLog << std::endl;
 		}
-		// Fragment Shader
-		fragment = glCreateShader(GL_FRAGMENT_SHADER);
-		glShaderSource(fragment, 1, &fShaderCode, NULL);
-		glCompileShader(fragment);
-		// Print compile errors if any
-		glGetShaderiv(fragment, GL_COMPILE_STATUS, &success);
+		glGetShaderiv(this->fragment, GL_COMPILE_STATUS, &success);
 		if (!success)
 		{
-			glGetShaderInfoLog(fragment, 512, NULL, infoLog);
+			glGetShaderInfoLog(this->fragment, 512, NULL, infoLog);
 			std::cout << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n" << infoLog << std::endl;
 		}
-		// Shader Program
-		this->Program = glCreateProgram();
-		glAttachShader(this->Program, vertex);
-		glAttachShader(this->Program, fragment);
-		glLinkProgram(this->Program);
+		if (this->geometry != 0)
+		{
+			glGetShaderiv(this->geometry, GL_COMPILE_STATUS, &success);
+			if (!success)
+			{
+				glGetShaderInfoLog(this->geometry, 512, NULL, infoLog);
+				std::cout << "ERROR::SHADER::GEOMETRY::COMPILATION_FAILED\n" << infoLog << std::endl;
+			}
+		}
 		// Print linking errors if any
 		glGetProgramiv(this->Program, GL_LINK_STATUS, &success);
 		if (!success)
@@ -83,16 +165,281 @@ public:
 			glGetProgramInfoLog(this->Program, 512, NULL, infoLog);
 			std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
 		}
+		else
+			this->saveBinary(this->cachePath);
 		// Delete the shaders as they're linked into our program now and no longer necessery
-		glDeleteShader(vertex);
-		glDeleteShader(fragment);
+		glDeleteShader(this->vertex);
+		glDeleteShader(this->fragment);
+		if (this->geometry != 0)
+			glDeleteShader(this->geometry);
+		Stats().Compiled++;
+		Stats().CompileMs += millisecondsSince(start);
+	}
 
+	// Whether Finish would return without waiting. Only ARB_parallel_shader_compile can tell,
+	// without it a submitted program is always reported ready and Finish may block.
+	bool IsReady() const
+	{
+		if (!this->pending || !GLEW_ARB_parallel_shader_compile)
+			return true;
+		GLint done = GL_FALSE;
+		glGetProgramiv(this->Program, GL_COMPLETION_STATUS_ARB, &done);
+		return done == GL_TRUE;
 	}
-	// Uses the current shader
+
+	// Uses the current shader, waiting for it if it is still compiling
 	void Use()
 	{
+		this->Finish();
 		glUseProgram(this->Program);
 	}
+
+	// Source with a #define line per define after its #version line
+	static std::string InsertDefines(const std::string &source, const ShaderDefines &defines)
+	{
+		if (defines.empty() || source.empty())
+			return source;
+		std::string lines;
+		for (ShaderDefines::const_iterator it = defines.begin(); it != defines.end(); ++it)
+			lines += "#define " + it->first + " " + it->second + "\n";
+		size_t version = source.find("#version");
+		if (version == std::string::npos)
+			return lines + source;
+		size_t end = source.find('\n', version);
+		if (end == std::string::npos)
+			return source + "\n" + lines;
+		return source.substr(0, end + 1) + lines + source.substr(end + 1);
+	}
+
+	// Source with every #include "file" line replaced by the file, found next to the shader at path.
+	// Included files may include others, the cache is keyed on the result so editing one rebuilds
+	// every program that includes it.
+	static std::string InsertIncludes(const std::string &source, const std::string &path)
+	{
+		size_t slash = path.find_last_of("/\\");
+		std::string directory = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+		std::string result;
+		size_t start = 0;
+		while (start < source.size())
+		{
+			size_t end = source.find('\n', start);
+			if (end == std::string::npos)
+				end = source.size();
+			std::string line = source.substr(start, end - start);
+			size_t open = line.find('"');
+			size_t close = open == std::string::npos ? std::string::npos : line.find('"', open + 1);
+			if (line.compare(0, 8, "#include") == 0 && close != std::string::npos)
+			{
+				std::string includePath = directory + line.substr(open + 1, close - open - 1);
+				std::ifstream file(includePath.c_str());
+				if (!file)
+					std::cout << "ERROR::SHADER::INCLUDE_NOT_FOUND " << includePath << std::endl;
+				std::stringstream stream;
+				stream << file.rdbuf();
+				result += InsertIncludes(stream.str(), includePath);
+			}
+			else
+				result += line + "\n";
+			start = end + 1;
+		}
+		return result;
+	}
+
+	// 64 bit FNV-1a hash of the defines, the map keeps them sorted so equal sets hash the same
+	static GLuint64 Hash(const ShaderDefines &defines)
+	{
+		std::string entries;
+		for (ShaderDefines::const_iterator it = defines.begin(); it != defines.end(); ++it)
+			entries += it->first + "=" + it->second + ";";
+		return Hash(entries);
+	}
+
+	// 64 bit FNV-1a hash of a string
+	static GLuint64 Hash(const std::string &text)
+	{
+		GLuint64 hash = 14695981039346656037ULL;
+		for (size_t i = 0; i < text.size(); i++)
+		{
+			hash ^= (unsigned char)text[i];
+			hash *= 1099511628211ULL;
+		}
+		return hash;
+	}
+
+	static ShaderStats& Stats()
+	{
+		static ShaderStats stats = { 0, 0, 0, 0.0, 0.0 };
+		return stats;
+	}
+
+private:
+	// Submitted program, see Finish
+	bool pending;
+	GLuint vertex, fragment, geometry;
+	std::string cachePath;
+
+	// glGetProgramBinary is GL 4.1, the 3.3 context needs ARB_get_program_binary and at least one format
+	static bool binariesSupported()
+	{
+		if (!GLEW_ARB_get_program_binary)
+			return false;
+		GLint formats = 0;
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+		return formats > 0;
+	}
+
+	// Cache file of a program. Binaries only work on the driver that produced them, so the key
+	// covers the vendor, renderer and driver version along with the sources and their defines.
+	static std::string binaryPath(const std::string &sources)
+	{
+		std::string driver = std::string((const char*)glGetString(GL_VENDOR)) + '\0'
+			+ (const char*)glGetString(GL_RENDERER) + '\0' + (const char*)glGetString(GL_VERSION);
+		std::stringstream path;
+		path << cacheDirectory() << "/" << std::hex << Hash(driver + '\0' + sources) << ".bin";
+		return path.str();
+	}
+
+	// Loads a cached binary into Program, a missing file or a binary the driver rejects leaves
+	// a fresh program object to compile into
+	bool loadBinary(const std::string &path)
+	{
+		if (!binariesSupported())
+			return false;
+		std::ifstream file(path.c_str(), std::ios::binary);
+		if (!file)
+			return false;
+		GLenum format = 0;
+		file.read((char*)&format, sizeof(format));
+		std::vector<char> binary((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		if (binary.empty())
+			return false;
+		glProgramBinary(this->Program, format, &binary[0], binary.size());
+		GLint success;
+		glGetProgramiv(this->Program, GL_LINK_STATUS, &success);
+		if (success)
+			return true;
+		// Usually a driver update, the binary is replaced once the program is compiled again
+		Stats().Rejected++;
+		glDeleteProgram(this->Program);
+		this->Program = glCreateProgram();
+		return false;
+	}
+
+	void saveBinary(const std::string &path)
+	{
+		if (!binariesSupported())
+			return;
+		GLint length = 0;
+		glGetProgramiv(this->Program, GL_PROGRAM_BINARY_LENGTH, &length);
+		if (length <= 0)
+			return;
+		std::vector<char> binary(length);
+		GLenum format = 0;
+		glGetProgramBinary(this->Program, length, NULL, &format, &binary[0]);
+#ifdef _WIN32
+		_mkdir(cacheDirectory());
+#else
+		mkdir(cacheDirectory(), 0755);
+#endif
+		std::ofstream file(path.c_str(), std::ios::binary);
+		file.write((const char*)&format, sizeof(format));
+		file.write(&binary[0], binary.size());
+	}
+
+	static double millisecondsSince(std::chrono::steady_clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	// Program binaries are cached next to the shader sources
+	static const char* cacheDirectory()
+	{
+		return "shaders/cache";
+	}
+};
+
+// Every variant of a shader, built from the same sources with different defines. A variant is
+// compiled the first time it is asked for and cached by the hash of its defines, so branches
+// a material never takes are removed at compile time instead of tested per fragment.
+// Once a fallback is set, variants compile in the background and the fallback stands in for
+// them until they are ready, so a frame never waits for the compiler.
+class ShaderVariants
+{
+public:
+	// Constructor, nothing is compiled yet. The base defines are part of every variant.
+	ShaderVariants(const GLchar* vertexPath, const GLchar* fragmentPath, const GLchar* geometryPath = nullptr, const ShaderDefines &defines = ShaderDefines())
+		: vertexPath(vertexPath), fragmentPath(fragmentPath), geometryPath(geometryPath != nullptr ? geometryPath : ""), base(defines), fallback(nullptr)
+	{
+	}
+
+	// Variant with the given defines on top of the base ones, or the fallback while it compiles
+	Shader& Get(const ShaderDefines &defines = ShaderDefines())
+	{
+		Shader &variant = this->submit(defines);
+		if (this->fallback == nullptr || variant.IsReady())
+		{
+			variant.Finish();
+			return variant;
+		}
+		return *this->fallback;
+	}
+
+	// Compiles a variant right away, it is used in place of the variants still compiling
+	void SetFallback(const ShaderDefines &defines = ShaderDefines())
+	{
+		this->fallback = &this->submit(defines);
+		this->fallback->Finish();
+	}
+
+	// Submits a variant ahead of its first use
+	void Prefetch(const ShaderDefines &defines)
+	{
+		this->submit(defines);
+	}
+
+	// Leaves a define the sources never test out of every variant, so meshes that differ only
+	// by it share one program instead of compiling identical copies
+	void Ignore(const std::string &name)
+	{
+		this->ignored.push_back(name);
+	}
+
+	// Number of variants submitted so far
+	GLuint Count() const
+	{
+		return this->variants.size();
+	}
+
+	// Number of variants still compiling
+	GLuint PendingCount() const
+	{
+		GLuint pending = 0;
+		for (std::map<GLuint64, Shader>::const_iterator it = this->variants.begin(); it != this->variants.end(); ++it)
+			pending += !it->second.IsReady();
+		return pending;
+	}
+
+private:
+	std::string vertexPath, fragmentPath, geometryPath;
+	ShaderDefines base;
+	std::vector<std::string> ignored;
+	std::map<GLuint64, Shader> variants;
+	Shader* fallback;
+
+	Shader& submit(const ShaderDefines &defines)
+	{
+		ShaderDefines all = this->base;
+		for (ShaderDefines::const_iterator it = defines.begin(); it != defines.end(); ++it)
+			all[it->first] = it->second;
+		for (GLuint i = 0; i < this->ignored.size(); i++)
+			all.erase(this->ignored[i]);
+		GLuint64 hash = Shader::Hash(all);
+		std::map<GLuint64, Shader>::iterator variant = this->variants.find(hash);
+		if (variant == this->variants.end())
+			variant = this->variants.emplace(std::piecewise_construct, std::forward_as_tuple(hash), std::forward_as_tuple(this->vertexPath.c_str(),
+				this->fragmentPath.c_str(), this->geometryPath.empty() ? nullptr : this->geometryPath.c_str(), all, false)).first;
+		return variant->second;
+	}
 };
 
 #endif
\ No newline at end of file
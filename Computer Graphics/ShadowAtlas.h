@@ -0,0 +1,275 @@
+#pragma once
+
+// Std. Includes
+#include <vector>
+#include <cmath>
+
+// GL Includes
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+
+// A square region of the atlas, in texels
+struct AtlasTile {
+	GLint X, Y;
+	GLuint Size;
+	GLint Node;		// Quadtree node backing the tile, -1 when unallocated
+
+	AtlasTile() : X(0), Y(0), Size(0), Node(-1) {}
+};
+
+// One large depth texture shared by the shadows of every local light. Tiles are handed out
+// by a quadtree allocator so the memory budget stays fixed whatever the number of lights.
+class ShadowAtlas
+{
+public:
+	GLuint FBO;
+	GLuint DepthMap;
+	GLuint Size;
+	GLuint MinTileSize, MaxTileSize;
+
+	// Constructor, size must be a power of two
+	ShadowAtlas(GLuint size, GLuint minTileSize, GLuint maxTileSize)
+		: Size(size), MinTileSize(minTileSize), MaxTileSize(maxTileSize)
+	{
+		// Root of the quadtree covers the whole atlas
+		this->nodes.push_back(Node(0, 0, size, -1));
+
+		glGenTextures(1, &this->DepthMap);
+		glBindTexture(GL_TEXTURE_2D, this->DepthMap);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, size, size, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		glGenFramebuffers(1, &this->FBO);
+		glBindFramebuffer(GL_FRAMEBUFFER, this->FBO);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, this->DepthMap, 0);
+		glDrawBuffer(GL_NONE);
+		glReadBuffer(GL_NONE);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+
+	// Finds a free square of the given size (rounded up to a power of two), returns false when the atlas is full
+	bool Allocate(GLuint size, AtlasTile &tile)
+	{
+		size = this->roundSize(size);
+		GLint node = this->allocate(0, size);
+		if (node < 0)
+			return false;
+		tile.X = this->nodes[node].X;
+		tile.Y = this->nodes[node].Y;
+		tile.Size = this->nodes[node].Size;
+		tile.Node = node;
+		return true;
+	}
+
+	// Returns a tile to the allocator, merging free siblings back into their parent
+	void Free(AtlasTile &tile)
+	{
+		if (tile.Node < 0)
+			return;
+		this->nodes[tile.Node].Used = false;
+		GLint parent = this->nodes[tile.Node].Parent;
+		while (parent >= 0 && this->isFree(parent))
+		{
+			this->nodes[parent].Children = -1;
+			parent = this->nodes[parent].Parent;
+		}
+		tile.Node = -1;
+	}
+
+	// Maps the importance of a light (fraction of the screen height it covers) to a tile size
+	GLuint TileSizeFor(GLfloat importance)
+	{
+		importance = glm::clamp(importance, 0.0f, 1.0f);
+		return this->roundSize((GLuint)(importance * this->MaxTileSize));
+	}
+
+	// Matrix mapping light clip space into the tile: xy to atlas uv, z to [0,1] depth
+	glm::mat4 TileMatrix(const AtlasTile &tile)
+	{
+		GLfloat scale = (GLfloat)tile.Size / this->Size;
+		glm::mat4 matrix;
+		matrix = glm::translate(matrix, glm::vec3((GLfloat)tile.X / this->Size, (GLfloat)tile.Y / this->Size, 0.0f));
+		matrix = glm::scale(matrix, glm::vec3(scale, scale, 1.0f));
+		matrix = glm::translate(matrix, glm::vec3(0.5f));
+		matrix = glm::scale(matrix, glm::vec3(0.5f));
+		return matrix;
+	}
+
+	// Tile bounds in atlas uv, shrunk by a texel so filtering never reads a neighbouring tile
+	glm::vec4 TileBounds(const AtlasTile &tile)
+	{
+		GLfloat texel = 1.0f / this->Size;
+		return glm::vec4(tile.X * texel + texel, tile.Y * texel + texel,
+			(tile.X + tile.Size) * texel - texel, (tile.Y + tile.Size) * texel - texel);
+	}
+
+	// Fraction of the screen height covered by a sphere, used as the importance of a light
+	// projectionScale is projection[1][1] of the camera, i.e. 1 / tan(fovY / 2)
+	static GLfloat ScreenImportance(glm::vec3 center, GLfloat radius, glm::vec3 viewPos, GLfloat projectionScale)
+	{
+		GLfloat distance = glm::length(center - viewPos);
+		if (distance <= radius)
+			return 1.0f;
+		return radius * projectionScale / distance;
+	}
+
+private:
+	struct Node {
+		GLint X, Y;
+		GLuint Size;
+		GLint Parent;
+		GLint Children;		// Index of the first of 4 children, -1 for a leaf
+		bool Used;
+		Node(GLint x, GLint y, GLuint size, GLint parent) : X(x), Y(y), Size(size), Parent(parent), Children(-1), Used(false) {}
+	};
+	std::vector<Node> nodes;
+
+	GLuint roundSize(GLuint size)
+	{
+		GLuint rounded = this->MinTileSize;
+		while (rounded < size && rounded < this->MaxTileSize)
+			rounded *= 2;
+		return rounded;
+	}
+
+	// True when nothing below the node is in use
+	bool isFree(GLint node)
+	{
+		if (this->nodes[node].Used)
+			return false;
+		if (this->nodes[node].Children < 0)
+			return true;
+		for (GLint i = 0; i < 4; i++)
+			if (!this->isFree(this->nodes[node].Children + i))
+				return false;
+		return true;
+	}
+
+	// Depth-first search for a free node of the requested size, splitting leaves on the way down
+	GLint allocate(GLint node, GLuint size)
+	{
+		if (this->nodes[node].Used || this->nodes[node].Size < size)
+			return -1;
+		if (this->nodes[node].Size == size)
+		{
+			if (!this->isFree(node))
+				return -1;
+			this->nodes[node].Children = -1;
+			this->nodes[node].Used = true;
+			return node;
+		}
+		if (this->nodes[node].Children < 0)
+			this->split(node);
+		for (GLint i = 0; i < 4; i++)
+		{
+			GLint found = this->allocate(this->nodes[node].Children + i, size);
+			if (found >= 0)
+				return found;
+		}
+		return -1;
+	}
+
+	void split(GLint node)
+	{
+		GLuint half = this->nodes[node].Size / 2;
+		GLint x = this->nodes[node].X, y = this->nodes[node].Y;
+		// Children of a merged node are recycled, otherwise appended
+		if (this->nodes[node].Children < 0)
+		{
+			GLint first = this->findRecycled(node);
+			if (first < 0)
+			{
+				first = this->nodes.size();
+				for (GLint i = 0; i < 4; i++)
+					this->nodes.push_back(Node(0, 0, 0, node));
+			}
+			this->nodes[node].Children = first;
+		}
+		GLint first = this->nodes[node].Children;
+		this->nodes[first + 0] = Node(x, y, half, node);
+		this->nodes[first + 1] = Node(x + half, y, half, node);
+		this->nodes[first + 2] = Node(x, y + half, half, node);
+		this->nodes[first + 3] = Node(x + half, y + half, half, node);
+	}
+
+	// Children are always created in runs of 4 right after each other and keep their parent
+	// index when merged, so a merged node can reuse its old run
+	GLint findRecycled(GLint node)
+	{
+		for (GLuint i = 1; i + 3 < this->nodes.size(); i += 4)
+			if (this->nodes[i].Parent == node)
+				return i;
+		return -1;
+	}
+};
+
+
+// Shadow of one light stored in the atlas: one tile for a spot light, one per cube face for a point light
+struct AtlasShadow {
+	std::vector<AtlasTile> Tiles;
+	std::vector<glm::mat4> LightSpaceMatrices;	// Light view-projection rendered into each tile
+	GLuint TileSize;		// Size of the allocated tiles
+	GLuint RequestedSize;	// Size asked for, may be larger than TileSize when the atlas is full
+
+	AtlasShadow() : TileSize(0), RequestedSize(0) {}
+};
+
+// Makes sure the shadow owns tileCount tiles of the given size. Tiles are only reallocated when
+// the requested size changes; when the atlas is full smaller tiles are tried. Returns false if
+// no tile could be found at all.
+inline bool ReserveTiles(ShadowAtlas &atlas, AtlasShadow &shadow, GLuint tileCount, GLuint size)
+{
+	if (shadow.RequestedSize == size && shadow.Tiles.size() == tileCount)
+		return true;
+	shadow.RequestedSize = size;
+
+	for (GLuint i = 0; i < shadow.Tiles.size(); i++)
+		atlas.Free(shadow.Tiles[i]);
+	shadow.Tiles.assign(tileCount, AtlasTile());
+	for (; size >= atlas.MinTileSize; size /= 2)
+	{
+		GLuint allocated = 0;
+		while (allocated < tileCount && atlas.Allocate(size, shadow.Tiles[allocated]))
+			allocated++;
+		if (allocated == tileCount)
+		{
+			shadow.TileSize = size;
+			return true;
+		}
+		for (GLuint i = 0; i < allocated; i++)
+			atlas.Free(shadow.Tiles[i]);
+	}
+	shadow.Tiles.clear();
+	shadow.TileSize = 0;
+	return false;
+}
+
+// View-projection of the 6 cube faces of a point light, in the usual +X, -X, +Y, -Y, +Z, -Z order
+inline std::vector<glm::mat4> PointLightMatrices(glm::vec3 position, GLfloat near_plane, GLfloat far_plane)
+{
+	glm::mat4 projection = glm::perspective(glm::radians(90.0f), 1.0f, near_plane, far_plane);
+	std::vector<glm::mat4> matrices;
+	matrices.push_back(projection * glm::lookAt(position, position + glm::vec3(1.0, 0.0, 0.0), glm::vec3(0.0, -1.0, 0.0)));
+	matrices.push_back(projection * glm::lookAt(position, position + glm::vec3(-1.0, 0.0, 0.0), glm::vec3(0.0, -1.0, 0.0)));
+	matrices.push_back(projection * glm::lookAt(position, position + glm::vec3(0.0, 1.0, 0.0), glm::vec3(0.0, 0.0, 1.0)));
+	matrices.push_back(projection * glm::lookAt(position, position + glm::vec3(0.0, -1.0, 0.0), glm::vec3(0.0, 0.0, -1.0)));
+	matrices.push_back(projection * glm::lookAt(position, position + glm::vec3(0.0, 0.0, 1.0), glm::vec3(0.0, -1.0, 0.0)));
+	matrices.push_back(projection * glm::lookAt(position, position + glm::vec3(0.0, 0.0, -1.0), glm::vec3(0.0, -1.0, 0.0)));
+	return matrices;
+}
+
+// View-projection of a spot light, the frustum encloses the outer cone (outerCutOff is a cosine)
+inline glm::mat4 SpotLightMatrix(glm::vec3 position, glm::vec3 direction, GLfloat outerCutOff, GLfloat near_plane, GLfloat far_plane)
+{
+	glm::vec3 up = fabs(direction.y) > 0.99f ? glm::vec3(0.0, 0.0, 1.0) : glm::vec3(0.0, 1.0, 0.0);
+	GLfloat fov = 2.0f * acos(outerCutOff) + glm::radians(2.0f);
+	return glm::perspective(fov, 1.0f, near_plane, far_plane) * glm::lookAt(position, position + direction, up);
+}
@@ -0,0 +1,367 @@
+#pragma once
+
+// Std. Includes
+#include <cmath>
+#include <vector>
+
+// GL Includes
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "Shader.h"
+#include "Bounds.h"
+
+// Defined in main.cpp, renders a full-screen quad
+void RenderQuad();
+
+// A depth-only framebuffer used to render the scene from the light's point of view
+class ShadowMap
+{
+public:
+	GLuint FBO;
+	GLuint DepthMap;
+	GLuint Width, Height;
+
+	// Constructor, creates the depth texture and attaches it to a new framebuffer
+	ShadowMap(GLuint width, GLuint height) : Width(width), Height(height)
+	{
+		glGenFramebuffers(1, &this->FBO);
+		// - Create depth texture
+		glGenTextures(1, &this->DepthMap);
+		glBindTexture(GL_TEXTURE_2D, this->DepthMap);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, width, height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+		// Linear filtering + depth compare: a sampler2DShadow fetch returns a bilinear 2x2 PCF result
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+		// Everything outside of the light's frustum is lit
+		GLfloat borderColor[] = { 1.0f, 1.0f, 1.0f, 1.0f };
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+		glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, borderColor);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		glBindFramebuffer(GL_FRAMEBUFFER, this->FBO);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, this->DepthMap, 0);
+		glDrawBuffer(GL_NONE);
+		glReadBuffer(GL_NONE);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+
+	// Binds the framebuffer and sets the viewport to cover the whole map
+	void Bind()
+	{
+		glViewport(0, 0, this->Width, this->Height);
+		glBindFramebuffer(GL_FRAMEBUFFER, this->FBO);
+	}
+};
+
+
+// Orthographic frustum of a directional light, fitted to the receivers the camera can see
+struct ShadowFit {
+	glm::mat4 LightView;
+	glm::vec2 Min, Max;				// Snapped xy extent in light view space, margin included
+	glm::vec2 ReceiversMin, ReceiversMax;	// xy extent the shadow has to cover, without margin
+	GLfloat Near, Far;
+	GLfloat TexelSize;				// World units covered by one shadow texel
+
+	ShadowFit() : Near(0.0f), Far(0.0f), TexelSize(0.0f) {}
+
+	glm::mat4 Matrix() const
+	{
+		return glm::ortho(this->Min.x, this->Max.x, this->Min.y, this->Max.y, this->Near, this->Far) * this->LightView;
+	}
+
+	// True when this frustum still covers the receivers of another fit
+	bool Covers(const ShadowFit &other) const
+	{
+		return glm::all(glm::lessThanEqual(this->Min, other.ReceiversMin))
+			&& glm::all(glm::greaterThanEqual(this->Max, other.ReceiversMax));
+	}
+};
+
+// Fits the light frustum to the intersection of the scene bounds and the camera frustum (given by
+// its 8 world space corners). The light view only depends on the light direction and the scene, and
+// the extent is quantized and snapped to whole texels, so the rasterized shadow does not shimmer
+// as the camera moves. margin pads the extent (as a fraction of it) so the fit can be reused.
+inline ShadowFit FitDirectionalShadow(glm::vec3 lightDir, const AABB &scene, const glm::vec3 cameraCorners[8], GLuint resolution, GLfloat margin)
+{
+	ShadowFit fit;
+	lightDir = glm::normalize(lightDir);
+	glm::vec3 up = fabs(lightDir.y) > 0.99f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+	GLfloat sceneRadius = glm::length(scene.Extents());
+	glm::vec3 center = scene.Center();
+	fit.LightView = glm::lookAt(center + lightDir * sceneRadius, center, up);
+
+	// - Receivers: the visible part of the scene, in light view space
+	AABB sceneLight = scene.Transform(fit.LightView);
+	AABB visible;
+	for (int i = 0; i < 8; i++)
+		visible.Extend(glm::vec3(fit.LightView * glm::vec4(cameraCorners[i], 1.0f)));
+	AABB receivers(glm::max(visible.Min, sceneLight.Min), glm::min(visible.Max, sceneLight.Max));
+	if (glm::any(glm::greaterThan(receivers.Min, receivers.Max)))
+		receivers = sceneLight;
+	fit.ReceiversMin = glm::vec2(receivers.Min);
+	fit.ReceiversMax = glm::vec2(receivers.Max);
+
+	// - Square extent, quantized to 1/16th of the scene so it only changes in steps
+	GLfloat step = sceneRadius / 8.0f;
+	GLfloat size = glm::max(receivers.Max.x - receivers.Min.x, receivers.Max.y - receivers.Min.y) * (1.0f + 2.0f * margin);
+	size = glm::min(ceil(size / step) * step, 2.0f * sceneRadius);
+	fit.TexelSize = size / resolution;
+
+	// - Snap the origin to whole texels, the extent stays a whole number of texels
+	glm::vec2 origin = 0.5f * (fit.ReceiversMin + fit.ReceiversMax) - glm::vec2(0.5f * size);
+	fit.Min = glm::floor(origin / fit.TexelSize) * fit.TexelSize;
+	fit.Max = fit.Min + glm::vec2((GLfloat)resolution * fit.TexelSize);
+
+	// - Depth covers every caster of the scene, the light looks down -z
+	fit.Near = -sceneLight.Max.z;
+	fit.Far = -sceneLight.Min.z;
+	return fit;
+}
+
+
+// A shadow map split in two layers: the depth of the static casters is cached and only
+// re-rendered when the light direction moved past an angular threshold, while the dynamic
+// casters are drawn every frame on top of a copy of the cached depth.
+// The light frustum is refitted to the visible receivers along with the static layer.
+class CachedShadowMap
+{
+public:
+	ShadowMap Static;				// Depth of the static casters only
+	ShadowMap Composite;			// Static depth + dynamic casters, sampled by the lighting passes
+	GLfloat Threshold;				// Angle (in degrees) the light can move before the static layer is refreshed
+	glm::mat4 LightSpaceMatrix;		// Light transform the static layer was rendered with
+	ShadowFit Fit;					// Light frustum the static layer was rendered with
+	GLfloat MaxDensityLoss;			// How much coarser than a fresh fit the cached texels may get before a refit
+
+	// Constructor, threshold is expressed in degrees
+	CachedShadowMap(GLuint width, GLuint height, GLfloat threshold)
+		: Static(width, height), Composite(width, height), Threshold(threshold), MaxDensityLoss(2.0f), valid(false)
+	{
+	}
+
+	// Returns true when the cached static depth no longer matches the given light direction, or
+	// when its frustum misses part of the receivers or wastes too much resolution compared to fit
+	bool NeedsUpdate(glm::vec3 lightDir, const ShadowFit &fit)
+	{
+		if (!this->valid)
+			return true;
+		GLfloat cosAngle = glm::dot(glm::normalize(lightDir), this->cachedDir);
+		cosAngle = glm::clamp(cosAngle, -1.0f, 1.0f);
+		if (glm::degrees(acos(cosAngle)) > this->Threshold)
+			return true;
+		return !this->Fit.Covers(fit) || this->Fit.TexelSize > fit.TexelSize * this->MaxDensityLoss;
+	}
+
+	// Binds the static layer for rendering; static casters must then be drawn with LightSpaceMatrix
+	void BeginStatic(glm::vec3 lightDir, const ShadowFit &fit)
+	{
+		this->cachedDir = glm::normalize(lightDir);
+		this->Fit = fit;
+		this->LightSpaceMatrix = fit.Matrix();
+		this->valid = true;
+		this->Static.Bind();
+		glClear(GL_DEPTH_BUFFER_BIT);
+	}
+
+	// Copies the cached static depth into the composite layer and binds it, so the
+	// dynamic casters can be drawn on top with LightSpaceMatrix
+	void BeginDynamic()
+	{
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, this->Static.FBO);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, this->Composite.FBO);
+		glBlitFramebuffer(0, 0, this->Static.Width, this->Static.Height,
+			0, 0, this->Composite.Width, this->Composite.Height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+		this->Composite.Bind();
+	}
+
+	// Forces the static layer to be re-rendered on the next frame
+	void Invalidate()
+	{
+		this->valid = false;
+	}
+
+	// Depth texture to sample when computing shadows
+	GLuint DepthMap()
+	{
+		return this->Composite.DepthMap;
+	}
+
+private:
+	glm::vec3 cachedDir;
+	bool valid;
+};
+
+
+// Exponential variance shadow map. The composited depth is warped to exp(c * depth) and its
+// square, blurred with a separable Gaussian and mip-mapped once per update, so receivers
+// get a filtered shadow from a single fetch instead of filtering per pixel.
+class EVSMShadowMap
+{
+public:
+	GLuint Moments;		// RG32F warped moments, mip-mapped
+	GLuint Size;
+	GLfloat Exponent;	// Warp exponent c, must stay below ~42 so the second moment fits in a float
+
+	// Constructor, the moments are stored at size x size regardless of the depth map resolution
+	EVSMShadowMap(GLuint size, GLfloat exponent) : Size(size), Exponent(exponent)
+	{
+		GLuint levels = 1;
+		while ((size >> levels) > 0)
+			levels++;
+		// Outside of the light's frustum the moments of the far plane are returned, i.e. lit
+		GLfloat borderColor[] = { exp(exponent), exp(2.0f * exponent), 0.0f, 0.0f };
+
+		glGenTextures(1, &this->Moments);
+		glBindTexture(GL_TEXTURE_2D, this->Moments);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, size, size, 0, GL_RG, GL_FLOAT, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+		glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, borderColor);
+		glGenerateMipmap(GL_TEXTURE_2D);
+		// Intermediate target of the separable blur
+		glGenTextures(1, &this->temp);
+		glBindTexture(GL_TEXTURE_2D, this->temp);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, size, size, 0, GL_RG, GL_FLOAT, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		glGenFramebuffers(1, &this->momentsFBO);
+		glBindFramebuffer(GL_FRAMEBUFFER, this->momentsFBO);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, this->Moments, 0);
+		glGenFramebuffers(1, &this->tempFBO);
+		glBindFramebuffer(GL_FRAMEBUFFER, this->tempFBO);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, this->temp, 0);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+		// The depth map is set up for hardware compares, read the raw depth through a separate sampler
+		glGenSamplers(1, &this->rawDepthSampler);
+		glSamplerParameteri(this->rawDepthSampler, GL_TEXTURE_COMPARE_MODE, GL_NONE);
+		glSamplerParameteri(this->rawDepthSampler, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glSamplerParameteri(this->rawDepthSampler, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glSamplerParameteri(this->rawDepthSampler, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glSamplerParameteri(this->rawDepthSampler, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+
+	// Converts the depth map into warped moments, blurs them and rebuilds the mip chain
+	void Update(GLuint depthMap, Shader &convert, Shader &blur)
+	{
+		glViewport(0, 0, this->Size, this->Size);
+		glDisable(GL_DEPTH_TEST);
+
+		// - Warp depth into moments, downsampling the depth map with a 2x2 box in moment space
+		glBindFramebuffer(GL_FRAMEBUFFER, this->momentsFBO);
+		convert.Use();
+		glUniform1f(glGetUniformLocation(convert.Program, "exponent"), this->Exponent);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, depthMap);
+		glBindSampler(0, this->rawDepthSampler);
+		glUniform1i(glGetUniformLocation(convert.Program, "depthMap"), 0);
+		RenderQuad();
+		glBindSampler(0, 0);
+
+		// - Separable Gaussian: horizontal into the temp target, vertical back into the moments
+		blur.Use();
+		glUniform1i(glGetUniformLocation(blur.Program, "image"), 0);
+		glBindFramebuffer(GL_FRAMEBUFFER, this->tempFBO);
+		glBindTexture(GL_TEXTURE_2D, this->Moments);
+		glUniform2f(glGetUniformLocation(blur.Program, "direction"), 1.0f / this->Size, 0.0f);
+		RenderQuad();
+		glBindFramebuffer(GL_FRAMEBUFFER, this->momentsFBO);
+		glBindTexture(GL_TEXTURE_2D, this->temp);
+		glUniform2f(glGetUniformLocation(blur.Program, "direction"), 0.0f, 1.0f / this->Size);
+		RenderQuad();
+
+		// - Mip chain for receivers far away from the light's texel density
+		glBindTexture(GL_TEXTURE_2D, this->Moments);
+		glGenerateMipmap(GL_TEXTURE_2D);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glEnable(GL_DEPTH_TEST);
+	}
+
+private:
+	GLuint temp;
+	GLuint momentsFBO, tempFBO;
+	GLuint rawDepthSampler;
+};
+
+
+// Omnidirectional shadow map of a point light stored in a depth cube map. All six faces can be
+// rendered in a single layered pass (the geometry shader picks gl_Layer) or one face at a time.
+class CubeShadowMap
+{
+public:
+	GLuint LayeredFBO;		// Whole cube attached, for single-pass layered rendering
+	GLuint FaceFBOs[6];		// One face attached each, for the six-pass path
+	GLuint DepthMap;
+	GLuint Size;
+
+	// Constructor, creates a size x size depth cube map set up for samplerCubeShadow
+	CubeShadowMap(GLuint size) : Size(size)
+	{
+		glGenTextures(1, &this->DepthMap);
+		glBindTexture(GL_TEXTURE_CUBE_MAP, this->DepthMap);
+		for (GLuint i = 0; i < 6; i++)
+			glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_DEPTH_COMPONENT24, size, size, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+		glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+
+		glGenFramebuffers(1, &this->LayeredFBO);
+		glBindFramebuffer(GL_FRAMEBUFFER, this->LayeredFBO);
+		glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, this->DepthMap, 0);
+		glDrawBuffer(GL_NONE);
+		glReadBuffer(GL_NONE);
+		glGenFramebuffers(6, this->FaceFBOs);
+		for (GLuint i = 0; i < 6; i++)
+		{
+			glBindFramebuffer(GL_FRAMEBUFFER, this->FaceFBOs[i]);
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, this->DepthMap, 0);
+			glDrawBuffer(GL_NONE);
+			glReadBuffer(GL_NONE);
+		}
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+
+	// Binds the whole cube for a layered pass and clears every face
+	void BindLayered()
+	{
+		glViewport(0, 0, this->Size, this->Size);
+		glBindFramebuffer(GL_FRAMEBUFFER, this->LayeredFBO);
+		glClear(GL_DEPTH_BUFFER_BIT);
+	}
+
+	// Binds and clears a single face, in +X, -X, +Y, -Y, +Z, -Z order
+	void BindFace(GLuint face)
+	{
+		glViewport(0, 0, this->Size, this->Size);
+		glBindFramebuffer(GL_FRAMEBUFFER, this->FaceFBOs[face]);
+		glClear(GL_DEPTH_BUFFER_BIT);
+	}
+
+	// Faces whose frustum overlaps the world space box, bit i set for face i
+	static GLint FaceMask(const AABB &box, const std::vector<Frustum> &faces)
+	{
+		GLint mask = 0;
+		for (GLuint i = 0; i < faces.size(); i++)
+			if (faces[i].Intersects(box))
+				mask |= 1 << i;
+		return mask;
+	}
+};
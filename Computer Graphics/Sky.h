@@ -0,0 +1,206 @@
+#pragma once
+
+// Std. Includes
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+// GL Includes
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+#include "Shader.h"
+
+
+// Rayleigh scattering at sea level for 680, 550 and 440 nm, per metre
+const glm::vec3 SKY_RAYLEIGH(5.8e-6f, 13.5e-6f, 33.1e-6f);
+const glm::vec3 SKY_LUMINANCE(0.2126f, 0.7152f, 0.0722f);
+
+// Sun and sky light of a day, from a single scattering atmosphere (Rayleigh and Mie, as in
+// Nishita's model) tabulated once by the elevation of the sun. One texture holds:
+//	rows 0..VIEW_ELEVATIONS-1: light scattered towards the ground along each view elevation,
+//	  rgb Rayleigh and a the red channel of Mie, both still to be multiplied by their phase
+//	row VIEW_ELEVATIONS: transmittance of the sun's light down to the ground
+//	row VIEW_ELEVATIONS+1: irradiance of the sky on an upward facing surface
+// Columns are sun elevations and rows view elevations, both indexed by sqrt(sin(elevation)) to
+// spend the texels near the horizon. Everything is scaled so the sun lights a white surface
+// facing it at noon with 1, the value a white sun with lightInt 1 had.
+class Sky
+{
+public:
+	static const GLuint SUN_ELEVATIONS = 64;
+	static const GLuint VIEW_ELEVATIONS = 32;
+
+	GLuint Texture;
+
+	// Light of the sky for a sun at some elevation above the horizon
+	struct Light
+	{
+		glm::vec3 Sun;		// Colour times intensity of the sun reaching the ground
+		glm::vec3 Ambient;	// Sky light on a surface facing up
+	};
+
+	// Constructor, integrates the atmosphere on the CPU and uploads the table
+	Sky()
+		: table(SUN_ELEVATIONS * (VIEW_ELEVATIONS + 2))
+	{
+		for (GLuint x = 0; x < SUN_ELEVATIONS; x++)
+		{
+			GLfloat sunSin = elevationSin(x, SUN_ELEVATIONS);
+			for (GLuint y = 0; y < VIEW_ELEVATIONS; y++)
+			{
+				glm::vec3 rayleigh, mie;
+				inscattering(elevationSin(y, VIEW_ELEVATIONS), sunSin, rayleigh, mie);
+				this->table[y * SUN_ELEVATIONS + x] = glm::vec4(rayleigh, mie.r);
+			}
+			this->table[VIEW_ELEVATIONS * SUN_ELEVATIONS + x] = glm::vec4(transmittance(GROUND_RADIUS, sunSin), 1.0f);
+		}
+		// - The sky's irradiance needs the whole sky of a sun elevation, it comes last
+		for (GLuint x = 0; x < SUN_ELEVATIONS; x++)
+			this->table[(VIEW_ELEVATIONS + 1) * SUN_ELEVATIONS + x] = glm::vec4(this->irradiance(x), 1.0f);
+
+		// - Normalized to the sun at the zenith
+		glm::vec3 noon = transmittance(GROUND_RADIUS, 1.0f);
+		GLfloat scale = 1.0f / glm::dot(noon, SKY_LUMINANCE);
+		for (GLuint i = 0; i < this->table.size(); i++)
+			this->table[i] *= scale;
+
+		glGenTextures(1, &this->Texture);
+		glBindTexture(GL_TEXTURE_2D, this->Texture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, SUN_ELEVATIONS, VIEW_ELEVATIONS + 2, 0, GL_RGBA, GL_FLOAT, &this->table[0]);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+
+	// Sun and ambient light for a sun at elevation radians, read from the table the sky uses
+	Light LightAt(GLfloat elevation) const
+	{
+		GLfloat u = std::sqrt(glm::clamp(std::sin(elevation), 0.0f, 1.0f)) * (SUN_ELEVATIONS - 1);
+		GLuint x = std::min((GLuint)u, SUN_ELEVATIONS - 2);
+		GLfloat f = u - x;
+		Light light;
+		light.Sun = glm::vec3(glm::mix(this->table[VIEW_ELEVATIONS * SUN_ELEVATIONS + x], this->table[VIEW_ELEVATIONS * SUN_ELEVATIONS + x + 1], f));
+		light.Ambient = glm::vec3(glm::mix(this->table[(VIEW_ELEVATIONS + 1) * SUN_ELEVATIONS + x], this->table[(VIEW_ELEVATIONS + 1) * SUN_ELEVATIONS + x + 1], f));
+		return light;
+	}
+
+	// Binds the table and the constants to read it with
+	void Bind(Shader &shader, GLuint unit)
+	{
+		glActiveTexture(GL_TEXTURE0 + unit);
+		glBindTexture(GL_TEXTURE_2D, this->Texture);
+		glUniform1i(glGetUniformLocation(shader.Program, "skyTable"), unit);
+		glUniform2i(glGetUniformLocation(shader.Program, "skyTableSize"), SUN_ELEVATIONS, VIEW_ELEVATIONS);
+		glUniform3fv(glGetUniformLocation(shader.Program, "rayleighScattering"), 1, &SKY_RAYLEIGH[0]);
+		glUniform1f(glGetUniformLocation(shader.Program, "mieG"), MIE_G);
+	}
+
+private:
+	// Earth's atmosphere, in metres
+	static constexpr GLfloat GROUND_RADIUS = 6360e3f;
+	static constexpr GLfloat TOP_RADIUS = 6420e3f;
+	static constexpr GLfloat RAYLEIGH_HEIGHT = 8000.0f;
+	static constexpr GLfloat MIE_HEIGHT = 1200.0f;
+	static constexpr GLfloat MIE_SCATTERING = 21e-6f;
+	static constexpr GLfloat MIE_EXTINCTION = 1.1f * 21e-6f;
+	static constexpr GLfloat MIE_G = 0.76f;
+
+	std::vector<glm::vec4> table;
+
+	// Sine of the elevation at texel i of n, sqrt(sin) is spread evenly
+	static GLfloat elevationSin(GLuint i, GLuint n)
+	{
+		GLfloat u = (GLfloat)i / (n - 1);
+		return u * u;
+	}
+
+	// Distance from radius r to the top of the atmosphere, looking up at mu = sin(elevation)
+	static GLfloat distanceToTop(GLfloat r, GLfloat mu)
+	{
+		return -r * mu + std::sqrt(std::max(r * r * (mu * mu - 1.0f) + TOP_RADIUS * TOP_RADIUS, 0.0f));
+	}
+
+	// Transmittance from radius r to space along mu
+	static glm::vec3 transmittance(GLfloat r, GLfloat mu)
+	{
+		const GLuint STEPS = 32;
+		GLfloat ds = distanceToTop(r, mu) / STEPS;
+		GLfloat rayleigh = 0.0f, mie = 0.0f;
+		for (GLuint i = 0; i < STEPS; i++)
+		{
+			GLfloat s = (i + 0.5f) * ds;
+			GLfloat h = std::sqrt(r * r + s * s + 2.0f * r * s * mu) - GROUND_RADIUS;
+			rayleigh += std::exp(-h / RAYLEIGH_HEIGHT) * ds;
+			mie += std::exp(-h / MIE_HEIGHT) * ds;
+		}
+		return glm::exp(-(SKY_RAYLEIGH * rayleigh + glm::vec3(MIE_EXTINCTION * mie)));
+	}
+
+	// Single scattering towards the ground along viewSin from the sun at sunSin, without phase.
+	// The sun's transmittance only depends on the altitude of a point, the phase alone depends
+	// on the angle between the view and the sun, so both elevations are enough.
+	static void inscattering(GLfloat viewSin, GLfloat sunSin, glm::vec3 &rayleigh, glm::vec3 &mie)
+	{
+		const GLuint STEPS = 32;
+		GLfloat ds = distanceToTop(GROUND_RADIUS, viewSin) / STEPS;
+		rayleigh = mie = glm::vec3(0.0f);
+		GLfloat depthRayleigh = 0.0f, depthMie = 0.0f;
+		for (GLuint i = 0; i < STEPS; i++)
+		{
+			GLfloat s = (i + 0.5f) * ds;
+			GLfloat r = std::sqrt(GROUND_RADIUS * GROUND_RADIUS + s * s + 2.0f * GROUND_RADIUS * s * viewSin);
+			GLfloat h = r - GROUND_RADIUS;
+			GLfloat densityRayleigh = std::exp(-h / RAYLEIGH_HEIGHT) * ds;
+			GLfloat densityMie = std::exp(-h / MIE_HEIGHT) * ds;
+			depthRayleigh += densityRayleigh;
+			depthMie += densityMie;
+			glm::vec3 attenuation = glm::exp(-(SKY_RAYLEIGH * depthRayleigh + glm::vec3(MIE_EXTINCTION * depthMie))) * transmittance(r, sunSin);
+			rayleigh += attenuation * densityRayleigh;
+			mie += attenuation * densityMie;
+		}
+		rayleigh *= SKY_RAYLEIGH;
+		mie *= MIE_SCATTERING;
+	}
+
+	static GLfloat rayleighPhase(GLfloat c)
+	{
+		return 3.0f / (16.0f * glm::pi<GLfloat>()) * (1.0f + c * c);
+	}
+
+	// Cornette-Shanks
+	static GLfloat miePhase(GLfloat c)
+	{
+		GLfloat g2 = MIE_G * MIE_G;
+		return 3.0f / (8.0f * glm::pi<GLfloat>()) * (1.0f - g2) * (1.0f + c * c) / ((2.0f + g2) * std::pow(1.0f + g2 - 2.0f * MIE_G * c, 1.5f));
+	}
+
+	// Cosine weighted integral of the sky over the upper hemisphere, for the sun of column x.
+	// Shaders light a white surface with diff * light, so a white surface shades to it as is.
+	glm::vec3 irradiance(GLuint x) const
+	{
+		const GLuint ELEVATIONS = 16, AZIMUTHS = 32;
+		GLfloat sunSin = elevationSin(x, SUN_ELEVATIONS);
+		GLfloat sunCos = std::sqrt(1.0f - sunSin * sunSin);
+		glm::vec3 result(0.0f);
+		for (GLuint i = 0; i < ELEVATIONS; i++)
+		{
+			GLfloat mu = (i + 0.5f) / ELEVATIONS;
+			GLfloat y = std::sqrt(mu) * (VIEW_ELEVATIONS - 1);
+			GLuint row = std::min((GLuint)y, VIEW_ELEVATIONS - 2);
+			glm::vec4 texel = glm::mix(this->table[row * SUN_ELEVATIONS + x], this->table[(row + 1) * SUN_ELEVATIONS + x], y - row);
+			glm::vec3 rayleigh = glm::vec3(texel);
+			glm::vec3 mie = texel.r > 0.0f ? rayleigh * (texel.a / texel.r) * (SKY_RAYLEIGH.r / SKY_RAYLEIGH) : glm::vec3(0.0f);
+			for (GLuint j = 0; j < AZIMUTHS; j++)
+			{
+				GLfloat phi = 2.0f * glm::pi<GLfloat>() * (j + 0.5f) / AZIMUTHS;
+				GLfloat c = mu * sunSin + std::sqrt(1.0f - mu * mu) * sunCos * std::cos(phi);
+				result += (rayleigh * rayleighPhase(c) + mie * miePhase(c)) * mu;
+			}
+		}
+		return result * (2.0f * glm::pi<GLfloat>() / (ELEVATIONS * AZIMUTHS));
+	}
+};
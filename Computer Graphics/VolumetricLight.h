@@ -0,0 +1,415 @@
+#pragma once
+
+// Std. Includes
+#include <vector>
+#include <cmath>
+#include <cfloat>
+
+// GL Includes
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include "Shader.h"
+
+// Defined in main.cpp, renders a full-screen quad
+void RenderQuad();
+
+// Volumetric light scattering marched at a fraction of the screen resolution. Each frame every
+// ray starts at a different jittered offset and the result is blended with the reprojected
+// history, so a handful of samples per pixel converge over a few frames. The result is then
+// brought back to full resolution with a depth-aware upsample.
+class VolumetricScattering
+{
+public:
+	GLuint Width, Height;		// Resolution the rays are marched at
+	GLuint Downsample;			// 2 for half resolution, 4 for quarter resolution
+	GLfloat HistoryWeight;		// Weight of the reprojected history when accumulating
+	GLfloat MaxDistance;		// Rays are never marched further than this
+
+	// Constructor, allocates two accumulation targets at screen size / downsample
+	VolumetricScattering(GLuint screenWidth, GLuint screenHeight, GLuint downsample)
+		: Width(screenWidth / downsample), Height(screenHeight / downsample), Downsample(downsample),
+		HistoryWeight(0.9f), MaxDistance(50.0f), current(0), frame(0), historyValid(false)
+	{
+		glGenTextures(2, this->history);
+		glGenFramebuffers(2, this->historyFBOs);
+		for (GLuint i = 0; i < 2; i++)
+		{
+			// rgb: scattering, a: linear depth it was computed at, for reprojection and upsampling
+			glBindTexture(GL_TEXTURE_2D, this->history[i]);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, this->Width, this->Height, 0, GL_RGBA, GL_FLOAT, NULL);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			glBindFramebuffer(GL_FRAMEBUFFER, this->historyFBOs[i]);
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, this->history[i], 0);
+		}
+		glBindTexture(GL_TEXTURE_2D, 0);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+
+	// Marches the rays into the next accumulation target. march must be in use with its light and
+	// shadow uniforms already set; the scene depth and the history go to units 1 and 2.
+	void March(Shader &march, GLuint sceneDepth, const glm::mat4 &projection, const glm::mat4 &view, GLfloat nearPlane, GLfloat farPlane)
+	{
+		glm::mat4 viewProjection = projection * view;
+		GLuint next = 1 - this->current;
+		glBindFramebuffer(GL_FRAMEBUFFER, this->historyFBOs[next]);
+		glViewport(0, 0, this->Width, this->Height);
+		glDisable(GL_DEPTH_TEST);
+
+		glUniformMatrix4fv(glGetUniformLocation(march.Program, "inverseViewProjection"), 1, GL_FALSE, glm::value_ptr(glm::inverse(viewProjection)));
+		glUniformMatrix4fv(glGetUniformLocation(march.Program, "previousViewProjection"), 1, GL_FALSE, glm::value_ptr(this->previousViewProjection));
+		glUniform1f(glGetUniformLocation(march.Program, "nearPlane"), nearPlane);
+		glUniform1f(glGetUniformLocation(march.Program, "farPlane"), farPlane);
+		glUniform1f(glGetUniformLocation(march.Program, "maxDistance"), this->MaxDistance);
+		glUniform1i(glGetUniformLocation(march.Program, "historyValid"), this->historyValid);
+		glUniform1f(glGetUniformLocation(march.Program, "historyWeight"), this->HistoryWeight);
+		glUniform1i(glGetUniformLocation(march.Program, "frame"), this->frame);
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, sceneDepth);
+		glUniform1i(glGetUniformLocation(march.Program, "sceneDepth"), 1);
+		glActiveTexture(GL_TEXTURE2);
+		glBindTexture(GL_TEXTURE_2D, this->history[this->current]);
+		glUniform1i(glGetUniformLocation(march.Program, "history"), 2);
+		RenderQuad();
+
+		glEnable(GL_DEPTH_TEST);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		this->current = next;
+		this->previousViewProjection = viewProjection;
+		this->historyValid = true;
+		this->frame++;
+	}
+
+	// Upsamples the latest result into the currently bound full resolution framebuffer
+	void Upsample(Shader &upsample, GLuint sceneDepth, GLfloat nearPlane, GLfloat farPlane)
+	{
+		glDisable(GL_DEPTH_TEST);
+		upsample.Use();
+		glUniform1f(glGetUniformLocation(upsample.Program, "nearPlane"), nearPlane);
+		glUniform1f(glGetUniformLocation(upsample.Program, "farPlane"), farPlane);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, this->history[this->current]);
+		glUniform1i(glGetUniformLocation(upsample.Program, "image"), 0);
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, sceneDepth);
+		glUniform1i(glGetUniformLocation(upsample.Program, "sceneDepth"), 1);
+		RenderQuad();
+		glEnable(GL_DEPTH_TEST);
+	}
+
+	// Drops the accumulated history, e.g. after a camera cut
+	void Invalidate()
+	{
+		this->historyValid = false;
+	}
+
+	// Target holding the latest result
+	GLuint Latest() const
+	{
+		return this->history[this->current];
+	}
+
+private:
+	GLuint history[2];
+	GLuint historyFBOs[2];
+	GLuint current;				// Target holding the latest result
+	glm::mat4 previousViewProjection;
+	GLint frame;
+	bool historyValid;
+};
+
+
+// Volumetric light scattering sampled along epipolar lines. Lines run from the sun's position on
+// screen to points spread around the screen border; every ray of a line lies in a plane containing
+// the light direction, so in the shadow map all of them fall on one line as well. The shadow map is
+// resampled along that line into a 1D min/max tree, so ray segments entirely lit or entirely
+// shadowed are resolved in one step, and the screen is interpolated from the line samples.
+class EpipolarScattering
+{
+public:
+	GLuint Lines;			// Number of epipolar lines
+	GLuint Samples;			// Rays marched along each line
+	GLuint TreeSize;		// Shadow map samples along each line, a power of two
+	GLuint TreeLevels;
+	GLfloat MaxDistance;	// Rays are never marched further than this
+	glm::vec2 SunPosition;	// Sun in screen uv, where every line starts
+
+	// Constructor, allocates the per-line data, the min/max trees and the line samples
+	EpipolarScattering(GLuint lines, GLuint samples, GLuint treeSize)
+		: Lines(lines), Samples(samples), TreeSize(treeSize), TreeLevels(0), MaxDistance(50.0f)
+	{
+		while ((1u << this->TreeLevels) < treeSize)
+			this->TreeLevels++;
+
+		// - Row 0: line on screen, row 1: line in the shadow map
+		this->slices = this->createTarget(GL_RGBA32F, GL_RGBA, lines, 2, nullptr);
+		// - Every level of a tree side by side in one row per line
+		this->minMaxTree = this->createTarget(GL_RG32F, GL_RG, 2 * treeSize - 1, lines, &this->minMaxFBO);
+		this->scattering = this->createTarget(GL_RGBA16F, GL_RGBA, samples, lines, &this->scatteringFBO);
+
+		glGenSamplers(1, &this->rawDepthSampler);
+		glSamplerParameteri(this->rawDepthSampler, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glSamplerParameteri(this->rawDepthSampler, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glSamplerParameteri(this->rawDepthSampler, GL_TEXTURE_COMPARE_MODE, GL_NONE);
+	}
+
+	// Places the lines for this frame. lightDir points towards the light.
+	void Update(const glm::mat4 &projection, const glm::mat4 &view, const glm::mat4 &lightSpaceMatrix, glm::vec3 lightDir, glm::vec3 viewPos)
+	{
+		glm::mat4 viewProjection = projection * view;
+		glm::mat4 inverseViewProjection = glm::inverse(viewProjection);
+		// Behind the camera the projection lands on the anti-solar point, where the lines converge as well
+		glm::vec4 sunClip = viewProjection * glm::vec4(glm::normalize(lightDir), 0.0f);
+		GLfloat w = fabs(sunClip.w) < 1e-4f ? 1e-4f : sunClip.w;
+		this->SunPosition = glm::clamp(glm::vec2(sunClip) / w * 0.5f + 0.5f, glm::vec2(-100.0f), glm::vec2(100.0f));
+		glm::vec2 origin = glm::vec2(lightSpaceMatrix * glm::vec4(viewPos, 1.0f)) * 0.5f + 0.5f;
+
+		std::vector<glm::vec4> data(2 * this->Lines);
+		for (GLuint i = 0; i < this->Lines; i++)
+		{
+			// - Screen line from the sun (or where its line enters the screen) to the border
+			glm::vec2 exit = borderPoint((i + 0.5f) / this->Lines * 4.0f);
+			GLfloat enter, leave;
+			glm::vec2 entry = exit;
+			if (clipToUnitSquare(this->SunPosition, exit - this->SunPosition, enter, leave))
+				entry = this->SunPosition + (exit - this->SunPosition) * glm::clamp(enter, 0.0f, 1.0f);
+			data[i] = glm::vec4(entry, exit);
+
+			// - Shadow map line: from the camera along the projection of any ray of the line
+			glm::vec4 farPoint = inverseViewProjection * glm::vec4(exit * 2.0f - 1.0f, 1.0f, 1.0f);
+			glm::vec3 ray = glm::normalize(glm::vec3(farPoint) / farPoint.w - viewPos);
+			glm::vec2 direction = glm::vec2(lightSpaceMatrix * glm::vec4(viewPos + ray, 1.0f)) * 0.5f + 0.5f - origin;
+			data[this->Lines + i] = glm::vec4(0.0f);
+			if (glm::length(direction) < 1e-6f)
+				continue;
+			direction = glm::normalize(direction);
+			if (clipToUnitSquare(origin, direction, enter, leave) && leave > glm::max(enter, 0.0f))
+			{
+				enter = glm::max(enter, 0.0f);
+				data[this->Lines + i] = glm::vec4(origin + direction * enter, direction * (leave - enter));
+			}
+		}
+		glBindTexture(GL_TEXTURE_2D, this->slices);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, this->Lines, 2, GL_RGBA, GL_FLOAT, &data[0]);
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+
+	// Resamples the raw depth of the shadow map along every line into the min/max trees
+	void BuildMinMax(Shader &minMax, GLuint shadowDepth)
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, this->minMaxFBO);
+		glViewport(0, 0, 2 * this->TreeSize - 1, this->Lines);
+		glDisable(GL_DEPTH_TEST);
+		minMax.Use();
+		glUniform1i(glGetUniformLocation(minMax.Program, "treeSize"), this->TreeSize);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, shadowDepth);
+		glBindSampler(0, this->rawDepthSampler);
+		glUniform1i(glGetUniformLocation(minMax.Program, "shadowDepth"), 0);
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, this->slices);
+		glUniform1i(glGetUniformLocation(minMax.Program, "slices"), 1);
+		RenderQuad();
+		glBindSampler(0, 0);
+		glEnable(GL_DEPTH_TEST);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+
+	// Marches one ray per line sample. march must be in use with its light uniforms already set;
+	// the scene depth, the lines and the trees go to units 1, 2 and 3.
+	void March(Shader &march, GLuint sceneDepth, const glm::mat4 &projection, const glm::mat4 &view, GLfloat nearPlane, GLfloat farPlane)
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, this->scatteringFBO);
+		glViewport(0, 0, this->Samples, this->Lines);
+		glDisable(GL_DEPTH_TEST);
+		glUniformMatrix4fv(glGetUniformLocation(march.Program, "inverseViewProjection"), 1, GL_FALSE, glm::value_ptr(glm::inverse(projection * view)));
+		glUniform1f(glGetUniformLocation(march.Program, "nearPlane"), nearPlane);
+		glUniform1f(glGetUniformLocation(march.Program, "farPlane"), farPlane);
+		glUniform1f(glGetUniformLocation(march.Program, "maxDistance"), this->MaxDistance);
+		glUniform1i(glGetUniformLocation(march.Program, "treeSize"), this->TreeSize);
+		glUniform1i(glGetUniformLocation(march.Program, "treeLevels"), this->TreeLevels);
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, sceneDepth);
+		glUniform1i(glGetUniformLocation(march.Program, "sceneDepth"), 1);
+		glActiveTexture(GL_TEXTURE2);
+		glBindTexture(GL_TEXTURE_2D, this->slices);
+		glUniform1i(glGetUniformLocation(march.Program, "slices"), 2);
+		glActiveTexture(GL_TEXTURE3);
+		glBindTexture(GL_TEXTURE_2D, this->minMaxTree);
+		glUniform1i(glGetUniformLocation(march.Program, "minMaxTree"), 3);
+		RenderQuad();
+		glEnable(GL_DEPTH_TEST);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+
+	// Scattering marched along the lines, one row per line
+	GLuint LineSamples() const
+	{
+		return this->scattering;
+	}
+
+	// Interpolates the line samples into the currently bound full resolution framebuffer
+	void Interpolate(Shader &interpolate, GLuint sceneDepth, GLfloat nearPlane, GLfloat farPlane)
+	{
+		glDisable(GL_DEPTH_TEST);
+		interpolate.Use();
+		glUniform2fv(glGetUniformLocation(interpolate.Program, "sunPosition"), 1, glm::value_ptr(this->SunPosition));
+		glUniform1f(glGetUniformLocation(interpolate.Program, "nearPlane"), nearPlane);
+		glUniform1f(glGetUniformLocation(interpolate.Program, "farPlane"), farPlane);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, this->scattering);
+		glUniform1i(glGetUniformLocation(interpolate.Program, "scattering"), 0);
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, sceneDepth);
+		glUniform1i(glGetUniformLocation(interpolate.Program, "sceneDepth"), 1);
+		glActiveTexture(GL_TEXTURE2);
+		glBindTexture(GL_TEXTURE_2D, this->slices);
+		glUniform1i(glGetUniformLocation(interpolate.Program, "slices"), 2);
+		RenderQuad();
+		glEnable(GL_DEPTH_TEST);
+	}
+
+private:
+	GLuint slices;
+	GLuint minMaxTree, minMaxFBO;
+	GLuint scattering, scatteringFBO;
+	GLuint rawDepthSampler;
+
+	// Unfiltered float texture, attached to a new framebuffer when fbo is given
+	GLuint createTarget(GLenum internalFormat, GLenum format, GLuint width, GLuint height, GLuint *fbo)
+	{
+		GLuint texture;
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, GL_FLOAT, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		if (fbo != nullptr)
+		{
+			glGenFramebuffers(1, fbo);
+			glBindFramebuffer(GL_FRAMEBUFFER, *fbo);
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+			glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		}
+		return texture;
+	}
+
+	// Point of the screen border at position p in [0, 4): bottom, right, top then left edge
+	static glm::vec2 borderPoint(GLfloat p)
+	{
+		if (p < 1.0f)
+			return glm::vec2(p, 0.0f);
+		if (p < 2.0f)
+			return glm::vec2(1.0f, p - 1.0f);
+		if (p < 3.0f)
+			return glm::vec2(3.0f - p, 1.0f);
+		return glm::vec2(0.0f, 4.0f - p);
+	}
+
+	// Parameters where origin + t * direction enters and leaves [0, 1]^2, false if it misses it
+	static bool clipToUnitSquare(glm::vec2 origin, glm::vec2 direction, GLfloat &enter, GLfloat &leave)
+	{
+		enter = -FLT_MAX;
+		leave = FLT_MAX;
+		for (int axis = 0; axis < 2; axis++)
+		{
+			if (fabs(direction[axis]) < 1e-8f)
+			{
+				if (origin[axis] < 0.0f || origin[axis] > 1.0f)
+					return false;
+				continue;
+			}
+			GLfloat t0 = (0.0f - origin[axis]) / direction[axis];
+			GLfloat t1 = (1.0f - origin[axis]) / direction[axis];
+			enter = glm::max(enter, glm::min(t0, t1));
+			leave = glm::min(leave, glm::max(t0, t1));
+		}
+		return enter <= leave;
+	}
+};
+
+
+// Camera aligned froxel volume (frustum voxels, slices distributed exponentially in depth) holding
+// the fog between the camera and every froxel. Each slice injects the light of every source and is
+// integrated front to back onto the previous one in the same pass, so shading a pixel costs one
+// fetch and the cost does not depend on the screen resolution.
+class FroxelFog
+{
+public:
+	GLuint Width, Height, Depth;
+	GLfloat Near, Far;		// View depth range covered by the slices
+	GLfloat Density;		// Extinction coefficient, per world unit
+	GLfloat Intensity;		// Gain on the in-scattered light, to match the ray-marched scattering
+	GLuint Volume;			// rgb: in-scattered light, a: transmittance, from the camera to each froxel
+
+	// Constructor, allocates the volume and the two 2D targets the slices accumulate into
+	FroxelFog(GLuint width, GLuint height, GLuint depth, GLfloat near, GLfloat far)
+		: Width(width), Height(height), Depth(depth), Near(near), Far(far), Density(0.02f), Intensity(10.0f)
+	{
+		glGenTextures(1, &this->Volume);
+		glBindTexture(GL_TEXTURE_3D, this->Volume);
+		glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA16F, width, height, depth, 0, GL_RGBA, GL_FLOAT, NULL);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+		glBindTexture(GL_TEXTURE_3D, 0);
+
+		glGenTextures(2, this->accumulation);
+		for (GLuint i = 0; i < 2; i++)
+		{
+			glBindTexture(GL_TEXTURE_2D, this->accumulation[i]);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, width, height, 0, GL_RGBA, GL_FLOAT, NULL);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		}
+		glBindTexture(GL_TEXTURE_2D, 0);
+		glGenFramebuffers(1, &this->fbo);
+		glBindFramebuffer(GL_FRAMEBUFFER, this->fbo);
+		GLenum attachments[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+		glDrawBuffers(2, attachments);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+
+	// Injects and integrates every slice. fog must be in use with its light and shadow uniforms
+	// already set; the running sum is read from unit 1.
+	void Update(Shader &fog, const glm::mat4 &projection, const glm::mat4 &view, GLfloat cameraFar)
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, this->fbo);
+		glViewport(0, 0, this->Width, this->Height);
+		glDisable(GL_DEPTH_TEST);
+		glUniformMatrix4fv(glGetUniformLocation(fog.Program, "inverseViewProjection"), 1, GL_FALSE, glm::value_ptr(glm::inverse(projection * view)));
+		glUniform1f(glGetUniformLocation(fog.Program, "cameraFar"), cameraFar);
+		glUniform1f(glGetUniformLocation(fog.Program, "fogNear"), this->Near);
+		glUniform1f(glGetUniformLocation(fog.Program, "fogFar"), this->Far);
+		glUniform1i(glGetUniformLocation(fog.Program, "sliceCount"), this->Depth);
+		glUniform1f(glGetUniformLocation(fog.Program, "density"), this->Density);
+		glUniform1f(glGetUniformLocation(fog.Program, "fogIntensity"), this->Intensity);
+		glUniform1i(glGetUniformLocation(fog.Program, "previous"), 1);
+		glActiveTexture(GL_TEXTURE1);
+		// - Front to back: slice i adds its froxels to the sum up to slice i - 1
+		for (GLuint i = 0; i < this->Depth; i++)
+		{
+			GLuint target = i % 2;
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, this->accumulation[target], 0);
+			glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, this->Volume, 0, i);
+			glBindTexture(GL_TEXTURE_2D, this->accumulation[1 - target]);
+			glUniform1i(glGetUniformLocation(fog.Program, "slice"), i);
+			RenderQuad();
+		}
+		glEnable(GL_DEPTH_TEST);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+
+private:
+	GLuint fbo;
+	GLuint accumulation[2];
+};
@@ -1,5 +1,8 @@
 // Std. Includes
 #include <string>
+#include <vector>
+#include <random>
+#include <chrono>
 
 // GLEW
 #define GLEW_STATIC
@@ -12,6 +15,20 @@
 #include "Shader.h"
 #include "Camera.h"
 #include "Model.h"
+#include "ShadowMap.h"
+#include "ShadowAtlas.h"
+#include "Profiler.h"
+#include "VolumetricLight.h"
+#include "Lights.h"
+#include "FrameGraph.h"
+#include "ClusteredLights.h"
+#include "LightVolumes.h"
+#include "Lightmap.h"
+#include "IrradianceVolume.h"
+#include "Sky.h"
+#include "JobSystem.h"
+#include "EntityStore.h"
+#include "Room.h"
 
 // GLM Mathemtics
 #include <glm/glm.hpp>
@@ -32,57 +49,143 @@ void Do_Movement();
 void set_lights(Shader &shader);
 void RenderQuad();
 void updateLight();
-void updateAngle(GLfloat amount);
-glm::vec3 changeColor(GLint rotation);
-glm::vec3 lerp(glm::vec3 color_1, glm::vec3 color_2, float alpha);
+void updateSky(const Sky &sky, GLfloat timeOfDay);
+void updateStats(GLFWwindow* window);
+void placeLamps(const AABB &bounds);
+void benchJobs();
+void benchSceneGraph();
+void benchEntities();
 
 
 // Camera
 Camera camera(glm::vec3(0.0f, 0.0f, 11.0f));
+GLfloat cameraNear = 0.1f, cameraFar = 100.0f;
 bool keys[1024];
 GLfloat lastX = 400, lastY = 300;
 bool firstMouse = true;
 
 // Light attributes
 glm::vec3 lightPos(0.5f, 15.0f, 0.0f);
-glm::vec3 lampPos(0.5f, -0.8f, -4.2f);
-glm::vec3 spotPos(-0.1f, 1.0f, 2.3f);
 glm::vec3 lightColor;
 
-glm::vec3 day(1.0f, 1.0f, 1.0f);
-glm::vec3 dawn_sunrise(1.0f, 0.498f, 0.314f);
-glm::vec3 night(0.275f, 0.510f, 0.706f);
+PointLight pointLight = ROOM_POINT_LIGHT;
+SpotLight spotLight = ROOM_SPOT_LIGHT;
+
+glm::vec3 night(0.275f, 0.510f, 0.706f);	// Tint of the moonlight
 
 GLfloat lightInt = 1.0f;
 bool nightTime = false;
 
+// Day-night cycle: the sun crosses the sky over the first half, the moon goes back over the second
+GLfloat dayLength = 144.0f;			// Seconds of a whole day and night
+const GLfloat MOON_INTENSITY = 0.5f;	// Moonlight relative to the sun at the same elevation
+glm::vec3 ambientColor;				// Sky light on a surface facing up, from the sky table
+glm::vec3 skyScale(1.0f);			// Brightness of the sky for the sun, or the moon at night
+
+// Shadows
+GLfloat shadowCacheThreshold = 0.5f;	// Degrees the sun can move before the static shadow casters are re-rendered
+GLuint shadowTriangles = 0;			// Triangles rendered into the shadow map this frame
+GLfloat shadowTexelSize = 0.0f;		// World units covered by one texel of the sun's shadow map
+bool useEVSM = true;				// Sample the prefiltered EVSM instead of PCF on the depth map
+const GLuint EVSM_UNIT = 10;		// Texture unit of the EVSM, material textures start at unit 1
+const GLuint ATLAS_UNIT = 11;		// Texture unit of the local lights' shadow atlas
+const GLuint POINT_SHADOW_UNIT = 12;	// Texture unit of the point light's shadow cube map
+GLfloat localShadowFar = 25.0f;		// Far plane of the point and spot light shadows
+bool singlePassCubeShadow = true;	// Render the point shadow's faces in one layered pass instead of six
+GpuTimer cubeShadowTimers[2];		// GPU time of the point shadow, [0] six passes, [1] single pass
+GLuint pcfTaps = 4;					// PCF taps of the sun shadow, each count is a variant of the scene shader
+GLuint shaderVariants = 0;			// Variants of the scene shader compiled so far
+
+// Clustered lamps, unshadowed local lights that only shade the clusters they reach
+GLuint lampCount = 0;				// Lamps scattered over the scene, cycled through 0, 64, 256 and 1024
+std::vector<PointLight> lampPoints;
+std::vector<SpotLight> lampSpots;
+const GLuint CLUSTER_UNIT = 13;		// First of the 3 texture units of the cluster buffers
+const GLuint PROBE_BINDING = 0;		// Uniform block binding of eva's probe irradiance
+GLuint clusterReferences = 0;		// Lamp references in the cluster lists this frame
+bool deferredShading = false;		// Light a G-buffer once per pixel instead of shading while drawing
+bool depthPrepass = false;			// Forward path: lay the depth down first, then shade with GL_EQUAL
+GpuTimer sceneTimers[2];			// GPU time of the forward scene pass, [0] without prepass, [1] with
+GpuCounter sceneSamples(GL_SAMPLES_PASSED);	// Fragments shaded by the forward scene pass
+
+// Volumetric light
+enum ScatteringMode {
+	SCATTERING_HALF_RES,			// Rays marched on a low resolution grid, accumulated over frames
+	SCATTERING_EPIPOLAR,			// Rays marched along epipolar lines with min/max shadow trees
+	SCATTERING_FROXEL				// Every light injected into a froxel volume, applied in the composite
+};
+ScatteringMode scatteringMode = SCATTERING_HALF_RES;
+bool fuseScattering = true;			// Blend the rays into the scene target instead of compositing a rays target
+
+// Frame graph, the screen targets and every pass after the shadow maps go through it
+FrameGraph frameGraph;
+
+// HDR
+// Scene and scattering are rendered in a packed float format, 32 bits per pixel like RGBA8
+const GLenum HDR_FORMAT = GL_R11F_G11F_B10F;
+GLfloat exposure = 1.0f;			// Scale applied to the HDR image before tonemapping
+
 //Delta time
 GLfloat deltaTime = 0.0f;   // Time between current frame and last frame
 GLfloat lastFrame = 0.0f;	// Time of last frame
-GLfloat delta = 0.0f;
-float angle = 90.0f;
+
+//Stats
+GLfloat statsDelta = 0.0f;	// Time since the stats were last shown
+GLuint statsFrames = 0;		// Frames rendered since the stats were last shown
 
 //Eva Movement
-//Relative numbers
-GLfloat evaDelta = 0.0f;	// Delta of time
-float deltaAngle = 0.0f;	// Delta of orientation
-float deltaZ = 0.0f;		// Delta of movement over Z axis
-//Actual position
-glm::vec3 evaPos(0.0f, 0.0f, 0.0f);
-float evaAngle = 0.0f;
 //Sine wave
 float wavelength = 1;
 float amplitude = 0.02;
-float theta = 0.0f;
 //Increments
 float incTheta = 0.03;		// Increment of sine angle
-float updateZ = 0.2f;		// Movement over Z axis
-//Booleans
-bool rotateEva = false;
+
+// Simulation, advanced in fixed steps whatever the frame rate. Rendering draws a blend of the
+// last two states, by how far the frame's time got into the next step.
+const GLfloat SIMULATION_STEP = 0.02f;	// Seconds per step, the rate the sun and eva were tuned at
+const GLfloat MAX_FRAME_TIME = 0.25f;	// Longer frames drop the rest, rather than stepping on and on
+struct SimulationState {
+	GLfloat TimeOfDay;		// Fraction of the day-night cycle gone by, 0 sunrise, 0.25 noon, 0.5 sunset
+	//Eva
+	glm::vec3 EvaPos;
+	GLfloat EvaAngle;
+	GLfloat Theta;			// Phase of the sine wave
+	GLfloat UpdateZ;		// Movement over Z axis per step
+	GLfloat DeltaZ;			// Movement over Z axis since the last turn
+	GLfloat DeltaAngle;		// Orientation changed since the turn started
+	bool RotateEva;
+};
+SimulationState currentState = { 0.25f, glm::vec3(0.0f), 0.0f, 0.0f, 0.2f, 0.0f, 0.0f, false };
+SimulationState previousState = currentState;
+GLfloat simulationTime = 0.0f;		// Frame time not simulated yet, less than a step
+void simulate(SimulationState &state);
+SimulationState interpolate(const SimulationState &from, const SimulationState &to, GLfloat alpha);
 
 // The MAIN function, from here we start our application and run our Game loop
-int main()
+int main(int argc, char** argv)
 {
+	for (int i = 1; i < argc; i++)
+	{
+		// --bench-entities times the entity transform kernels up to a million entities and quits
+		if (std::string(argv[i]) == "--bench-entities")
+		{
+			benchEntities();
+			return 0;
+		}
+		// --bench-scenegraph times the transform update of a large hierarchy and quits
+		if (std::string(argv[i]) == "--bench-scenegraph")
+		{
+			benchSceneGraph();
+			return 0;
+		}
+		// --bench-jobs times the frame's CPU work on 1 to all the cores and quits
+		if (std::string(argv[i]) == "--bench-jobs")
+		{
+			benchJobs();
+			return 0;
+		}
+	}
+
 	// Init GLFW
 	glfwInit();
 	// Set all the required options for GLFW
@@ -113,86 +216,138 @@ int main()
 	// Setup some OpenGL options
 	glEnable(GL_DEPTH_TEST);
 
+	// Let the driver compile on as many threads as it likes
+	if (GLEW_ARB_parallel_shader_compile)
+		glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
+
 	// Setup and compile our shaders
-	Shader shader("shaders/standard_shader.vs", "shaders/standard_shader.fs");
-	Shader lightShader("light.vs", "light.fs");
-	Shader simpleDepthShader("shaders/shadow_mapping_depth.vs", "shaders/shadow_mapping_depth.fs");
-	Shader debugDepthQuad("shaders/debug_quad.vs", "shaders/debug_quad_depth.fs");
-	Shader godRays("shaders/god_rays.vs", "shaders/god_rays.fs");
-	Shader quad("shaders/render.vs", "shaders/render.fs");
+	// Programs are only submitted here, the driver compiles them while the models load
+	GLfloat shadersStart = glfwGetTime();
+	// Every mesh draws with the variant matching its maps, built the first time it is needed
+	ShaderVariants standardShader("shaders/standard_shader.vs", "shaders/standard_shader.fs");
+	// The deferred path writes the G-buffer with a variant per material, then lights it with a variant per PCF kernel
+	ShaderVariants gbufferShader("shaders/standard_shader.vs", "shaders/gbuffer.fs");
+	ShaderVariants deferredLighting("shaders/render.vs", "shaders/deferred_lighting.fs");
+	Shader lightVolume("shaders/light_volume.vs", "shaders/light_volume.fs", nullptr, {}, false);
+	Shader probeLight("shaders/depth_prepass.vs", "shaders/probe_light.fs", nullptr, {}, false);
+	Shader depthPrepassShader("shaders/depth_prepass.vs", "shaders/shadow_mapping_depth.fs", nullptr, {}, false);
+	Shader lightShader("light.vs", "light.fs", nullptr, {}, false);
+	Shader simpleDepthShader("shaders/shadow_mapping_depth.vs", "shaders/shadow_mapping_depth.fs", nullptr, {}, false);
+	Shader debugDepthQuad("shaders/debug_quad.vs", "shaders/debug_quad_depth.fs", nullptr, {}, false);
+	Shader godRays("shaders/render.vs", "shaders/god_rays.fs", nullptr, {}, false);
+	Shader bilateralUpsample("shaders/render.vs", "shaders/bilateral_upsample.fs", nullptr, {}, false);
+	Shader epipolarMinMax("shaders/render.vs", "shaders/epipolar_minmax.fs", nullptr, {}, false);
+	Shader epipolarMarch("shaders/render.vs", "shaders/epipolar_march.fs", nullptr, {}, false);
+	Shader epipolarInterpolate("shaders/render.vs", "shaders/epipolar_interpolate.fs", nullptr, {}, false);
+	// A single sun shadow tap per froxel, the fog blurs it anyway
+	Shader froxelFog("shaders/render.vs", "shaders/froxel_fog.fs", nullptr, { { "PCF_TAPS", "1" } }, false);
+	Shader quad("shaders/render.vs", "shaders/render.fs", nullptr, {}, false);
+	Shader evsmConvert("shaders/render.vs", "shaders/evsm_convert.fs", nullptr, {}, false);
+	Shader gaussianBlur("shaders/render.vs", "shaders/gaussian_blur.fs", nullptr, {}, false);
+	Shader skyShader("shaders/render.vs", "shaders/sky.fs", nullptr, {}, false);
+	// With viewport arrays every tile of the shadow atlas is rendered in a single pass, the
+	// geometry shader routes each triangle to the viewport of every tile it overlaps
+	Shader* atlasShader = nullptr;
+	if (GLEW_ARB_viewport_array)
+		atlasShader = new Shader("shaders/shadow_layered.vs", "shaders/shadow_mapping_depth.fs", "shaders/shadow_atlas.gs", {}, false);
+	// The point shadow's geometry shader sends each triangle to the cube faces it touches
+	Shader cubeShadowShader("shaders/shadow_layered.vs", "shaders/shadow_mapping_depth.fs", "shaders/cube_shadow.gs", {}, false);
+	// The material-less scene variant is built right away, it stands in for the others while they compile
+	standardShader.SetFallback({ { "PCF_TAPS", std::to_string(pcfTaps) } });
+	// The G-buffer holds materials only, the deferred lighting lights the room live
+	gbufferShader.Ignore("HAS_LIGHTMAP");
+	gbufferShader.SetFallback();
+	deferredLighting.SetFallback({ { "PCF_TAPS", std::to_string(pcfTaps) } });
+	GLfloat shadersSubmitted = glfwGetTime();
 
 	// Load models
-	Model ourModel("nope/nope.obj");
+	Model ourModel(ROOM_MODEL, ROOM_LIGHTMAPS);
 	Model eva("eva/eva1.obj");
+	// Scene objects, around the bounds of their models. The room never moves, it is placed once.
+	EntityStore entities;
+	GLuint roomEntity = entities.Create(ROOM_OFFSET, glm::quat(1.0f, 0.0f, 0.0f, 0.0f), glm::vec3(1.0f), ourModel.Bounds());
+	GLuint evaEntity = entities.Create(glm::vec3(0.0f), glm::quat(1.0f, 0.0f, 0.0f, 0.0f), glm::vec3(0.2f), eva.Bounds());
+	entities.Update();
+	ourModel.SetTransform(entities.World(roomEntity));
+	ourModel.UpdateTransforms();
+	// Indirect light of the room for eva, baked with the lightmaps by the lightmap baker
+	IrradianceVolume probes;
+	bool hasProbes = probes.Load(ROOM_PROBES);
+
+	// - Every material and PCF variant of the scene shader compiles in the background
+	Model* sceneModels[] = { &ourModel, &eva };
+	GLuint taps[] = { 1, 4, 9, 16 };
+	for (GLuint i = 0; i < 4; i++)
+	{
+		for (GLuint j = 0; j < 2; j++)
+		{
+			for (GLuint k = 0; k < sceneModels[j]->meshes.size(); k++)
+			{
+				ShaderDefines variant = sceneModels[j]->meshes[k].Defines;
+				gbufferShader.Prefetch(variant);
+				variant["PCF_TAPS"] = std::to_string(taps[i]);
+				if (sceneModels[j] == &eva && hasProbes)
+					variant["HAS_PROBES"] = "1";
+				standardShader.Prefetch(variant);
+			}
+		}
+		deferredLighting.Prefetch({ { "PCF_TAPS", std::to_string(taps[i]) } });
+	}
 
-	//Initialize color light at sunrise
-	lightColor = day;
+	// - Now wait for the programs the first frame needs
+	GLfloat shadersWait = glfwGetTime();
+	Shader* startupShaders[] = { &lightShader, &simpleDepthShader, &debugDepthQuad, &godRays, &bilateralUpsample,
+		&epipolarMinMax, &epipolarMarch, &epipolarInterpolate, &froxelFog, &quad, &evsmConvert, &gaussianBlur, &cubeShadowShader, &lightVolume, &probeLight, &depthPrepassShader, &skyShader };
+	for (GLuint i = 0; i < sizeof(startupShaders) / sizeof(startupShaders[0]); i++)
+		startupShaders[i]->Finish();
+	if (atlasShader != nullptr)
+		atlasShader->Finish();
+	GLfloat shadersDone = glfwGetTime();
+
+	// Startup cost of the programs above, a second run should load every one of them from the cache
+	std::cout << "Shaders: " << Shader::Stats().Compiled << " compiled in " << Shader::Stats().CompileMs << " ms, "
+		<< Shader::Stats().Cached << " loaded from the binary cache in " << Shader::Stats().CacheMs << " ms";
+	if (Shader::Stats().Rejected > 0)
+		std::cout << " (" << Shader::Stats().Rejected << " cached binaries rejected by the driver)";
+	std::cout << ", " << (shadersSubmitted - shadersStart) * 1000.0f << " ms to submit, "
+		<< (shadersDone - shadersWait) * 1000.0f << " ms waiting for the compiler"
+		<< (GLEW_ARB_parallel_shader_compile ? " (parallel compile)" : "") << ", "
+		<< standardShader.PendingCount() << " scene variants still compiling" << std::endl;
+
+	// Sun, ambient and sky light by elevation of the sun, integrated once
+	Sky sky;
+	updateSky(sky, currentState.TimeOfDay);
 	
-	// Configure depth map FBO
-	const GLuint SHADOW_WIDTH = 3000, SHADOW_HEIGHT = 3000;
-	GLuint depthMapFBO;
-	glGenFramebuffers(1, &depthMapFBO);
-	// - Create depth texture
-	GLuint depthMap;
-	glGenTextures(1, &depthMap);
-	glBindTexture(GL_TEXTURE_2D, depthMap);
-
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, SHADOW_WIDTH, SHADOW_HEIGHT, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-
-	glBindFramebuffer(GL_FRAMEBUFFER, depthMapFBO);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthMap, 0);
-	glDrawBuffer(GL_NONE);
-	glReadBuffer(GL_NONE);
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
-
-	//First buffer
-	GLuint framebuffer;
-	glGenFramebuffers(1, &framebuffer);
-	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
-	// Create a color attachment texture
-	GLuint scene;
-	glGenTextures(1, &scene);
-	glBindTexture(GL_TEXTURE_2D, scene);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, screenWidth, screenHeight, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glBindTexture(GL_TEXTURE_2D, 0);
-	// Attach it to currently bound framebuffer object
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, scene, 0);
-	// Create a renderbuffer object for depth and stencil attachment
-	GLuint rbo;
-	glGenRenderbuffers(1, &rbo);
-	glBindRenderbuffer(GL_RENDERBUFFER, rbo);
-	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, screenWidth, screenHeight); // Use a single renderbuffer object for both a depth AND stencil buffer.
-	glBindRenderbuffer(GL_RENDERBUFFER, 0);
-	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, rbo);
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
-
-	//Second Buffer
-	GLuint framebuffer2;
-	glGenFramebuffers(1, &framebuffer2);
-	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer2);
-	// Create a color attachment texture
-	GLuint rays;
-	glGenTextures(1, &rays);
-	glBindTexture(GL_TEXTURE_2D, rays);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, screenWidth, screenHeight, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glBindTexture(GL_TEXTURE_2D, 0);
-	// Attach it to currently bound framebuffer object
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, rays, 0);
-	GLuint rbo2;
-	glGenRenderbuffers(1, &rbo2);
-	glBindRenderbuffer(GL_RENDERBUFFER, rbo2);
-	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, screenWidth, screenHeight); // Use a single renderbuffer object for both a depth AND stencil buffer.
-	glBindRenderbuffer(GL_RENDERBUFFER, 0);
-	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, rbo2);
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	// Configure depth map FBOs: static casters are cached, dynamic casters are drawn on top every frame.
+	// The light frustum is fitted to what the camera sees, so 2048^2 beats the old fixed 3000^2 box
+	const GLuint SHADOW_WIDTH = 2048, SHADOW_HEIGHT = 2048;
+	CachedShadowMap shadowMap(SHADOW_WIDTH, SHADOW_HEIGHT, shadowCacheThreshold);
+	GLuint depthMap = shadowMap.DepthMap();
+	// Filterable copy of the shadow map, prefiltered once per update
+	EVSMShadowMap evsm(1024, 40.0f);
+
+	// Shadow atlas shared by the spot lights, 4096^2 x 24 bit = 48 MB whatever the light count
+	ShadowAtlas atlas(4096, 128, 2048);
+	AtlasShadow spotShadow;
+
+	// Point light shadow in a depth cube map
+	CubeShadowMap pointShadow(1024);
+
+	// Scattering is marched at half resolution (4 for quarter) and upsampled into rays
+	VolumetricScattering scattering(screenWidth, screenHeight, 2);
+	// Or along 256 epipolar lines of 256 rays, whatever the screen resolution
+	EpipolarScattering epipolar(256, 256, 256);
+	// Or injected into 160x90x64 froxels covering the first 50 units in front of the camera
+	FroxelFog fog(160, 90, 64, 0.1f, 50.0f);
+
+	// Lamps are assigned to 16x9 tiles x 24 depth slices
+	ClusteredLights clusteredLights(16, 9, 24);
+	GLuint placedLamps = 0;
+	// Or, on the deferred path, drawn as spheres over the G-buffer
+	LightVolumes lightVolumes;
+
+	// The frame's CPU work runs on every core, the GL thread only submits
+	JobSystem jobs;
 
 	// Game loop
 	while (!glfwWindowShouldClose(window))
@@ -202,23 +357,15 @@ int main()
 		GLfloat currentFrame = glfwGetTime();
 		deltaTime = currentFrame - lastFrame;
 		lastFrame = currentFrame;
-		delta += deltaTime;
-		evaDelta += deltaTime;
-
-		//1,5 per second (range: 30 - 150)
-		if (delta >= 0.02) {
-			GLfloat amount = 0.05f;
-			updateAngle(amount);
-			glm::mat4 rotationMat(1);
-			GLint rotation = 1;
-			if (nightTime)
-				rotation = -1;
-			rotationMat = glm::rotate(rotationMat, glm::radians(amount * rotation), glm::vec3(0.0, 0.0, 1.0));
-			lightPos = glm::vec3(rotationMat * glm::vec4(lightPos, 1.0));
-			lightColor = changeColor(rotation);
-			delta = 0.0f;
-			//std::cout << "Angle:" << angle << std::endl;
+		// Simulate as many steps as the frame's time covers, then draw in between the last two
+		simulationTime += glm::min(deltaTime, MAX_FRAME_TIME);
+		while (simulationTime >= SIMULATION_STEP) {
+			previousState = currentState;
+			simulate(currentState);
+			simulationTime -= SIMULATION_STEP;
 		}
+		SimulationState frameState = interpolate(previousState, currentState, simulationTime / SIMULATION_STEP);
+		updateSky(sky, frameState.TimeOfDay);
 		
 			
 		
@@ -234,154 +381,604 @@ int main()
 		// (from ligth's perspective)
 		// //////////////////////////////////////////////////
 		
-		// - Get light projection/view matrix.
-		glm::mat4 lightProjection, lightView;
-		glm::mat4 lightSpaceMatrix;
-		GLfloat near_plane = 1.0f, far_plane = 100.0f;
-		lightProjection = glm::ortho(-20.0f, 20.0f, -10.0f, 20.0f, near_plane, far_plane);
-		lightView = glm::lookAt(lightPos, glm::vec3(0.0f), glm::vec3(0.0, 1.0, 0.0));
-		lightSpaceMatrix = lightProjection * lightView;
-		// - now render scene from light's point of view
-		glViewport(0, 0, SHADOW_WIDTH, SHADOW_HEIGHT);
-		glBindFramebuffer(GL_FRAMEBUFFER, depthMapFBO);
-		glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-		glEnable(GL_DEPTH_TEST);
+		// Only eva moves: its entity follows the simulation, its meshes follow the entity through
+		// the node hierarchy. The simulation moves eva in unscaled units.
+		entities.SetPosition(evaEntity, 0.2f * frameState.EvaPos);
+		entities.SetRotation(evaEntity, glm::angleAxis(frameState.EvaAngle, glm::vec3(0.0f, 1.0f, 0.0f)));
+		entities.Update();
+		eva.SetTransform(entities.World(evaEntity));
+		eva.UpdateTransforms();
 
+		// Transformation matrices
+		glm::mat4 projection = glm::perspective(camera.Zoom, (float)screenWidth / (float)screenHeight, cameraNear, cameraFar);
+		glm::mat4 view = camera.GetViewMatrix();
+
+		// - Entities in front of the camera, the others are left out of the camera's passes
+		std::vector<GLuint> visibleEntities;
+		entities.Cull(Frustum(projection * view), visibleEntities);
+		bool evaOnScreen = std::find(visibleEntities.begin(), visibleEntities.end(), evaEntity) != visibleEntities.end();
+
+		/////////////////////////////////////////////////////
+		// CPU JOBS
+		// Work that only needs the frame's matrices starts on
+		// the job system here. The GL thread goes on with the
+		// shadow passes and waits where it needs the results
+		// //////////////////////////////////////////////////
+
+		// - Lamp lists of the clusters, rebuilt every frame since the camera moves
+		if (placedLamps != lampCount)
+		{
+			placeLamps(ourModel.Bounds());
+			placedLamps = lampCount;
+		}
+		JobCounter lampsClustered;
+		if (!deferredShading)
+			clusteredLights.Build(lampPoints, lampSpots, projection, view, cameraNear, cameraFar, jobs, lampsClustered);
+
+		// - Faces of the point shadow each mesh overlaps, meshes out of every face are skipped altogether
+		GLfloat pointNear = 0.05f;
+		GLfloat pointRange = glm::min(LightRange(pointLight), localShadowFar);
+		std::vector<glm::mat4> pointMatrices = PointLightMatrices(pointLight.Position, pointNear, pointRange);
+		std::vector<Frustum> pointFrustums;
+		for (GLuint i = 0; i < 6; i++)
+			pointFrustums.push_back(Frustum(pointMatrices[i]));
+		Model* casters[] = { &ourModel, &eva };
+		std::vector<GLint> faceMasks[2];
+		JobCounter castersCulled;
+		for (GLuint i = 0; i < 2; i++)
+		{
+			faceMasks[i].assign(casters[i]->meshes.size(), 0);
+			jobs.ParallelFor(casters[i]->meshes.size(), 16, [&, i](GLuint begin, GLuint end) {
+				for (GLuint j = begin; j < end; j++)
+					faceMasks[i][j] = CubeShadowMap::FaceMask(casters[i]->meshes[j].Bounds.Transform(casters[i]->MeshTransform(j)), pointFrustums);
+			}, castersCulled);
+		}
+
+		// - Fit the light frustum to the part of the static scene inside the camera frustum
+		glm::mat4 inverseViewProjection = glm::inverse(projection * view);
+		glm::vec3 cameraCorners[8];
+		for (int i = 0; i < 8; i++)
+		{
+			glm::vec4 corner = inverseViewProjection * glm::vec4(i & 1 ? 1.0f : -1.0f, i & 2 ? 1.0f : -1.0f, i & 4 ? 1.0f : -1.0f, 1.0f);
+			cameraCorners[i] = glm::vec3(corner) / corner.w;
+		}
+		ShadowFit shadowFit = FitDirectionalShadow(lightPos, ourModel.Bounds(), cameraCorners, SHADOW_WIDTH, 0.1f);
+
+		shadowTriangles = 0;
+		// The background is linear, 0.01 comes out at about 0.1 after gamma
+		glClearColor(0.01f, 0.01f, 0.01f, 1.0f);
+		glEnable(GL_DEPTH_TEST);
+		// Casters between the light and the near plane are clamped onto it instead of being clipped
+		glEnable(GL_DEPTH_CLAMP);
 		simpleDepthShader.Use();
+		// - Re-render the static casters only when the sun moved past the threshold or the fit went stale
+		if (shadowMap.NeedsUpdate(lightPos, shadowFit)) {
+			shadowMap.BeginStatic(lightPos, shadowFit);
+			glUniformMatrix4fv(glGetUniformLocation(simpleDepthShader.Program, "lightSpaceMatrix"), 1, GL_FALSE, glm::value_ptr(shadowMap.LightSpaceMatrix));
+			ourModel.Draw(simpleDepthShader);
+			shadowTriangles += ourModel.TriangleCount();
+		}
+		// Receivers and dynamic casters use the matrix the cached layer was rendered with
+		glm::mat4 lightSpaceMatrix = shadowMap.LightSpaceMatrix;
+
+		// - Copy the cached depth and render the dynamic casters on top of it
+		shadowMap.BeginDynamic();
 		glUniformMatrix4fv(glGetUniformLocation(simpleDepthShader.Program, "lightSpaceMatrix"), 1, GL_FALSE, glm::value_ptr(lightSpaceMatrix));
-		// Draw the loaded model
-		glm::mat4 model;
-		model = glm::translate(model, glm::vec3(0.0f, -1.75f, 0.0f)); // Translate it down a bit so it's at the center of the scene
+		eva.Draw(simpleDepthShader);
+		shadowTriangles += eva.TriangleCount();
+		glDisable(GL_DEPTH_CLAMP);
 		
-		glm::mat4 evaMod;
-		evaMod = glm::scale(evaMod, glm::vec3(0.2f));
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
-		if (evaDelta > 0.02f) {
-			float k = 2 * 3.14 / wavelength;
+		shadowTexelSize = shadowMap.Fit.TexelSize;
 
-			glm::mat4 evaRotationMat(1);
+		/////////////////////////////////////////////////////
+		// PASS 1b
+		// Render the point light's shadow into its cube map
+		// //////////////////////////////////////////////////
 
-			if (deltaZ > 60.0f) {
-				rotateEva = true;
-				deltaZ = 0.0f;
-				updateZ *= 0.2;
+		jobs.Wait(castersCulled);
+
+		GpuTimer &cubeShadowTimer = cubeShadowTimers[singlePassCubeShadow];
+		cubeShadowTimer.Begin();
+		glEnable(GL_POLYGON_OFFSET_FILL);
+		glPolygonOffset(2.0f, 4.0f);
+		if (singlePassCubeShadow) {
+			// - Single pass: the geometry shader emits each triangle once per face it overlaps
+			pointShadow.BindLayered();
+			cubeShadowShader.Use();
+			glUniformMatrix4fv(glGetUniformLocation(cubeShadowShader.Program, "faceMatrices"), 6, GL_FALSE, glm::value_ptr(pointMatrices[0]));
+			GLint model = glGetUniformLocation(cubeShadowShader.Program, "model");
+			GLint faceMask = glGetUniformLocation(cubeShadowShader.Program, "faceMask");
+			for (GLuint i = 0; i < 2; i++)
+			{
+				for (GLuint j = 0; j < casters[i]->meshes.size(); j++)
+				{
+					if (faceMasks[i][j] == 0)
+						continue;
+					glUniformMatrix4fv(model, 1, GL_FALSE, glm::value_ptr(casters[i]->MeshTransform(j)));
+					glUniform1i(faceMask, faceMasks[i][j]);
+					casters[i]->meshes[j].Draw(cubeShadowShader);
+					shadowTriangles += casters[i]->meshes[j].TriangleCount();
+				}
 			}
-			if (deltaAngle > 3.1415) {
-				rotateEva = false;
-				deltaAngle = 0.0f;
-				updateZ *= -5;
+		}
+		else {
+			// - Six passes: one face at a time, each drawing only the meshes it overlaps
+			simpleDepthShader.Use();
+			GLint model = glGetUniformLocation(simpleDepthShader.Program, "model");
+			for (GLuint face = 0; face < 6; face++)
+			{
+				pointShadow.BindFace(face);
+				glUniformMatrix4fv(glGetUniformLocation(simpleDepthShader.Program, "lightSpaceMatrix"), 1, GL_FALSE, glm::value_ptr(pointMatrices[face]));
+				for (GLuint i = 0; i < 2; i++)
+				{
+					for (GLuint j = 0; j < casters[i]->meshes.size(); j++)
+					{
+						if ((faceMasks[i][j] & (1 << face)) == 0)
+							continue;
+						glUniformMatrix4fv(model, 1, GL_FALSE, glm::value_ptr(casters[i]->MeshTransform(j)));
+						casters[i]->meshes[j].Draw(simpleDepthShader);
+						shadowTriangles += casters[i]->meshes[j].TriangleCount();
+					}
+				}
 			}
+		}
+		glDisable(GL_POLYGON_OFFSET_FILL);
+		cubeShadowTimer.End();
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+		/////////////////////////////////////////////////////
+		// PASS 1c
+		// Render the spot lights' shadows into the atlas
+		// //////////////////////////////////////////////////
 
-			evaPos.y += amplitude * sin(k * theta);
-			theta += incTheta;
-
-			evaMod *= glm::translate(evaRotationMat, evaPos);
-			evaPos.z += updateZ;
-			deltaZ += abs(updateZ);
-			if (rotateEva) {
-				GLint rotation = 1;
-				evaAngle += incTheta;
-				deltaAngle += incTheta;
-				evaRotationMat = glm::rotate(evaRotationMat, glm::radians(incTheta * rotation), glm::vec3(0.0, 1.0, 0.0));
+		// - Size the tiles by how much of the screen each light covers
+		GLfloat spotRange = glm::min(LightRange(spotLight), localShadowFar);
+		GLuint spotTileSize = atlas.TileSizeFor(ShadowAtlas::ScreenImportance(spotLight.Position, spotRange, camera.Position, projection[1][1]));
+		ReserveTiles(atlas, spotShadow, 1, spotTileSize);
+		spotShadow.LightSpaceMatrices.assign(1, SpotLightMatrix(spotLight.Position, spotLight.Direction, spotLight.OuterCutOff, 0.05f, spotRange));
+
+		// - Gather every tile to render
+		std::vector<AtlasTile> atlasTiles;
+		std::vector<glm::mat4> atlasMatrices;
+		AtlasShadow* atlasShadows[] = { &spotShadow };
+		for (GLuint i = 0; i < 1; i++)
+		{
+			for (GLuint j = 0; j < atlasShadows[i]->Tiles.size(); j++)
+			{
+				atlasTiles.push_back(atlasShadows[i]->Tiles[j]);
+				atlasMatrices.push_back(atlasShadows[i]->LightSpaceMatrices[j]);
 			}
-			evaMod *= glm::rotate(evaRotationMat, evaAngle, glm::vec3(0.0, 1.0, 0.0));
 		}
 
-		glUniformMatrix4fv(glGetUniformLocation(simpleDepthShader.Program, "model"), 1, GL_FALSE, glm::value_ptr(evaMod));
-		eva.Draw(simpleDepthShader);
-		glUniformMatrix4fv(glGetUniformLocation(simpleDepthShader.Program, "model"), 1, GL_FALSE, glm::value_ptr(model));
-		ourModel.Draw(simpleDepthShader);
-		
+		glBindFramebuffer(GL_FRAMEBUFFER, atlas.FBO);
+		glViewport(0, 0, atlas.Size, atlas.Size);
+		glClear(GL_DEPTH_BUFFER_BIT);
+		glEnable(GL_POLYGON_OFFSET_FILL);
+		if (atlasShader != nullptr && !atlasTiles.empty()) {
+			// - Single pass: one viewport per tile
+			for (GLuint i = 0; i < atlasTiles.size(); i++)
+				glViewportIndexedf(i, (GLfloat)atlasTiles[i].X, (GLfloat)atlasTiles[i].Y, (GLfloat)atlasTiles[i].Size, (GLfloat)atlasTiles[i].Size);
+			atlasShader->Use();
+			glUniformMatrix4fv(glGetUniformLocation(atlasShader->Program, "tileMatrices"), atlasMatrices.size(), GL_FALSE, glm::value_ptr(atlasMatrices[0]));
+			glUniform1i(glGetUniformLocation(atlasShader->Program, "tileCount"), atlasTiles.size());
+			ourModel.Draw(*atlasShader);
+			eva.Draw(*atlasShader);
+			shadowTriangles += ourModel.TriangleCount() + eva.TriangleCount();
+		}
+		else {
+			// - Fallback: one pass per tile
+			simpleDepthShader.Use();
+			for (GLuint i = 0; i < atlasTiles.size(); i++)
+			{
+				glViewport(atlasTiles[i].X, atlasTiles[i].Y, atlasTiles[i].Size, atlasTiles[i].Size);
+				glUniformMatrix4fv(glGetUniformLocation(simpleDepthShader.Program, "lightSpaceMatrix"), 1, GL_FALSE, glm::value_ptr(atlasMatrices[i]));
+				ourModel.Draw(simpleDepthShader);
+				eva.Draw(simpleDepthShader);
+				shadowTriangles += ourModel.TriangleCount() + eva.TriangleCount();
+			}
+		}
+		glDisable(GL_POLYGON_OFFSET_FILL);
 		glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
+		/////////////////////////////////////////////////////
+		// FRAME GRAPH
+		// Every pass declares what it reads and writes. The
+		// graph culls the passes the screen does not depend on
+		// and allocates the screen targets for the frame only
+		// //////////////////////////////////////////////////
+
+		// - Lamp lists of the clusters, built by the jobs during the shadow passes. The deferred
+		// path draws a volume per lamp instead, it only needs the lamps themselves
+		if (deferredShading)
+			clusteredLights.Upload(lampPoints, lampSpots);
+		else {
+			jobs.Wait(lampsClustered);
+			clusteredLights.Submit();
+		}
+		clusterReferences = deferredShading ? 0 : clusteredLights.References();
+
+		frameGraph.Reset();
+		FrameGraph::Resource sunShadow = frameGraph.Import("sun shadow", depthMap);
+		FrameGraph::Resource evsmMoments = frameGraph.Import("evsm", evsm.Moments);
+		FrameGraph::Resource localShadows = frameGraph.Import("shadow atlas", atlas.DepthMap);
+		FrameGraph::Resource pointShadowMap = frameGraph.Import("point shadow", pointShadow.DepthMap);
+		FrameGraph::Resource sceneColor = frameGraph.Create("scene", TargetDesc(screenWidth, screenHeight, HDR_FORMAT));
+		// The scattering pass reads the depth back to find where rays end
+		FrameGraph::Resource sceneDepth = frameGraph.Create("scene depth", TargetDesc(screenWidth, screenHeight, GL_DEPTH24_STENCIL8));
+
+		// - Prefilter the composited depth into the EVSM, culled while the PCF path is used
+		frameGraph.AddPass("evsm", { sunShadow }, { evsmMoments }, [&]() {
+			evsm.Update(depthMap, evsmConvert, gaussianBlur);
+		});
+
 		/////////////////////////////////////////////////////
 		// PASS 2
 		// Render the normal scene
 		// //////////////////////////////////////////////////
 
-		glViewport(0, 0, screenWidth, screenHeight);
-		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-		
-		shader.Use();
-		GLint viewPosLoc = glGetUniformLocation(shader.Program, "viewPos");
-		glUniform3f(viewPosLoc, camera.Position.x, camera.Position.y, camera.Position.z);
-		set_lights(shader);
-		// Transformation matrices
-		glm::mat4 projection = glm::perspective(camera.Zoom, (float)screenWidth / (float)screenHeight, 0.1f, 100.0f);
-		glm::mat4 view = camera.GetViewMatrix();
-		glUniformMatrix4fv(glGetUniformLocation(shader.Program, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
-		glUniformMatrix4fv(glGetUniformLocation(shader.Program, "view"), 1, GL_FALSE, glm::value_ptr(view));
-		glUniformMatrix4fv(glGetUniformLocation(shader.Program, "lightSpaceMatrix"), 1, GL_FALSE, glm::value_ptr(lightSpaceMatrix));
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, depthMap);
-		glUniform1i(glGetUniformLocation(shader.Program, "shadowMap"), 0);
-		glUniformMatrix4fv(glGetUniformLocation(shader.Program, "model"), 1, GL_FALSE, glm::value_ptr(model));
-		ourModel.Draw(shader);
-		
-		
-		glUniformMatrix4fv(glGetUniformLocation(shader.Program, "model"), 1, GL_FALSE, glm::value_ptr(evaMod));
-		eva.Draw(shader);
+		// Uniforms the forward scene shader and the deferred lighting share, set once per variant used
+		auto prepareScene = [&](Shader &shader) {
+			GLint viewPosLoc = glGetUniformLocation(shader.Program, "viewPos");
+			glUniform3f(viewPosLoc, camera.Position.x, camera.Position.y, camera.Position.z);
+			set_lights(shader);
+			glUniformMatrix4fv(glGetUniformLocation(shader.Program, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
+			glUniformMatrix4fv(glGetUniformLocation(shader.Program, "view"), 1, GL_FALSE, glm::value_ptr(view));
+			glUniformMatrix4fv(glGetUniformLocation(shader.Program, "lightSpaceMatrix"), 1, GL_FALSE, glm::value_ptr(lightSpaceMatrix));
+			glActiveTexture(GL_TEXTURE0);
+			glBindTexture(GL_TEXTURE_2D, depthMap);
+			glUniform1i(glGetUniformLocation(shader.Program, "shadowMap"), 0);
+			glActiveTexture(GL_TEXTURE0 + EVSM_UNIT);
+			glBindTexture(GL_TEXTURE_2D, evsm.Moments);
+			glUniform1i(glGetUniformLocation(shader.Program, "evsmMap"), EVSM_UNIT);
+			glUniform1f(glGetUniformLocation(shader.Program, "evsmExponent"), evsm.Exponent);
+			glUniform1i(glGetUniformLocation(shader.Program, "useEVSM"), useEVSM);
+			// Local light shadows: world to atlas matrices and the tile bounds to clamp filtering to
+			glActiveTexture(GL_TEXTURE0 + ATLAS_UNIT);
+			glBindTexture(GL_TEXTURE_2D, atlas.DepthMap);
+			glUniform1i(glGetUniformLocation(shader.Program, "shadowAtlas"), ATLAS_UNIT);
+			glActiveTexture(GL_TEXTURE0 + POINT_SHADOW_UNIT);
+			glBindTexture(GL_TEXTURE_CUBE_MAP, pointShadow.DepthMap);
+			glUniform1i(glGetUniformLocation(shader.Program, "pointShadowMap"), POINT_SHADOW_UNIT);
+			glUniform1i(glGetUniformLocation(shader.Program, "pointLightHasShadow"), true);
+			glUniform1f(glGetUniformLocation(shader.Program, "pointShadowNear"), pointNear);
+			glUniform1f(glGetUniformLocation(shader.Program, "pointShadowFar"), pointRange);
+			glUniform1i(glGetUniformLocation(shader.Program, "spotLightHasShadow"), spotShadow.Tiles.size() == 1);
+			if (spotShadow.Tiles.size() == 1)
+			{
+				glm::mat4 atlasMatrix = atlas.TileMatrix(spotShadow.Tiles[0]) * spotShadow.LightSpaceMatrices[0];
+				glUniformMatrix4fv(glGetUniformLocation(shader.Program, "spotLightShadow"), 1, GL_FALSE, glm::value_ptr(atlasMatrix));
+				glUniform4fv(glGetUniformLocation(shader.Program, "spotLightTile"), 1, glm::value_ptr(atlas.TileBounds(spotShadow.Tiles[0])));
+			}
+		};
+		ShaderDefines shadowDefines = { { "PCF_TAPS", std::to_string(pcfTaps) } };
+		// eva's indirect light, blended from the probes around its centre
+		ShaderDefines evaDefines = shadowDefines;
+		if (hasProbes) {
+			evaDefines["HAS_PROBES"] = "1";
+			probes.Upload(probes.Sample(eva.Bounds().Center()));
+		}
+		std::vector<FrameGraph::Resource> sceneReads = { sunShadow, localShadows, pointShadowMap };
+		if (useEVSM)
+			sceneReads.push_back(evsmMoments);
+		// The G-buffer of the deferred path: sRGB albedo + specular and an octahedral normal, 8 bytes a pixel
+		FrameGraph::Resource gAlbedoSpecular = frameGraph.Create("gbuffer albedo", TargetDesc(screenWidth, screenHeight, GL_SRGB8_ALPHA8));
+		FrameGraph::Resource gNormal = frameGraph.Create("gbuffer normal", TargetDesc(screenWidth, screenHeight, GL_RG16));
+		// Binds the G-buffer to units 1 to 3, the material units are free once it is written
+		auto bindGBuffer = [&](Shader &shader) {
+			glUniformMatrix4fv(glGetUniformLocation(shader.Program, "inverseViewProjection"), 1, GL_FALSE, glm::value_ptr(inverseViewProjection));
+			glActiveTexture(GL_TEXTURE1);
+			glBindTexture(GL_TEXTURE_2D, frameGraph.Texture(gAlbedoSpecular));
+			glUniform1i(glGetUniformLocation(shader.Program, "gAlbedoSpecular"), 1);
+			glActiveTexture(GL_TEXTURE2);
+			glBindTexture(GL_TEXTURE_2D, frameGraph.Texture(gNormal));
+			glUniform1i(glGetUniformLocation(shader.Program, "gNormal"), 2);
+			glActiveTexture(GL_TEXTURE3);
+			glBindTexture(GL_TEXTURE_2D, frameGraph.Texture(sceneDepth));
+			glUniform1i(glGetUniformLocation(shader.Program, "gDepth"), 3);
+		};
+
+		if (!deferredShading) {
+			// - Forward: every fragment is lit as it is drawn, lamps through the cluster lists
+			frameGraph.AddPass("scene", sceneReads, { sceneColor, sceneDepth }, [&]() {
+				sceneTimers[depthPrepass].Begin();
+				glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+				if (depthPrepass) {
+					// Depth alone from the position streams, no texture, no lighting
+					glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+					depthPrepassShader.Use();
+					glUniformMatrix4fv(glGetUniformLocation(depthPrepassShader.Program, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
+					glUniformMatrix4fv(glGetUniformLocation(depthPrepassShader.Program, "view"), 1, GL_FALSE, glm::value_ptr(view));
+					ourModel.DrawDepth(depthPrepassShader);
+					if (evaOnScreen)
+						eva.DrawDepth(depthPrepassShader);
+					glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+					// Only the fragment that won the depth test is shaded, once per pixel
+					glDepthFunc(GL_EQUAL);
+					glDepthMask(GL_FALSE);
+				}
+				sceneSamples.Begin();
+				ourModel.Draw(standardShader, shadowDefines, [&](Shader &shader) {
+					prepareScene(shader);
+					clusteredLights.Bind(shader, CLUSTER_UNIT, screenWidth, screenHeight);
+				});
+				if (evaOnScreen) {
+					eva.Draw(standardShader, evaDefines, [&](Shader &shader) {
+						prepareScene(shader);
+						clusteredLights.Bind(shader, CLUSTER_UNIT, screenWidth, screenHeight);
+						if (hasProbes)
+							probes.Bind(shader, PROBE_BINDING);
+					});
+				}
+				sceneSamples.End();
+				glDepthFunc(GL_LESS);
+				glDepthMask(GL_TRUE);
+				sceneTimers[depthPrepass].End();
+			});
+		}
+		else {
+			// - Deferred: the materials are written out first, then lit once per visible pixel
+			frameGraph.AddPass("gbuffer", {}, { gAlbedoSpecular, gNormal, sceneDepth }, [&]() {
+				glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+				// Encode the albedo to sRGB on write, 8 bits would band the dark tones stored linear
+				glEnable(GL_FRAMEBUFFER_SRGB);
+				ourModel.Draw(gbufferShader, ShaderDefines(), [&](Shader &shader) {
+					glUniformMatrix4fv(glGetUniformLocation(shader.Program, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
+					glUniformMatrix4fv(glGetUniformLocation(shader.Program, "view"), 1, GL_FALSE, glm::value_ptr(view));
+				});
+				if (evaOnScreen) {
+					eva.Draw(gbufferShader, ShaderDefines(), [&](Shader &shader) {
+						glUniformMatrix4fv(glGetUniformLocation(shader.Program, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
+						glUniformMatrix4fv(glGetUniformLocation(shader.Program, "view"), 1, GL_FALSE, glm::value_ptr(view));
+					});
+				}
+				glDisable(GL_FRAMEBUFFER_SRGB);
+			});
+			// - Sun, shadowed point and spot light over the whole screen
+			std::vector<FrameGraph::Resource> lightingReads = sceneReads;
+			lightingReads.push_back(gAlbedoSpecular);
+			lightingReads.push_back(gNormal);
+			lightingReads.push_back(sceneDepth);
+			frameGraph.AddPass("deferred lighting", lightingReads, { sceneColor }, [&]() {
+				glClear(GL_COLOR_BUFFER_BIT);
+				glDisable(GL_DEPTH_TEST);
+				Shader &shader = deferredLighting.Get(shadowDefines);
+				shader.Use();
+				prepareScene(shader);
+				bindGBuffer(shader);
+				RenderQuad();
+				glEnable(GL_DEPTH_TEST);
+			});
+			// - Lamps, each one only over the pixels its volume covers
+			if (clusteredLights.LightCount() > 0) {
+				FrameGraph::Resource litScene = frameGraph.Rename(sceneColor, "scene + lamps");
+				frameGraph.AddPass("lamp volumes", { sceneColor, gAlbedoSpecular, gNormal, sceneDepth }, { litScene }, [&]() {
+					lightVolume.Use();
+					glUniform3f(glGetUniformLocation(lightVolume.Program, "viewPos"), camera.Position.x, camera.Position.y, camera.Position.z);
+					glUniformMatrix4fv(glGetUniformLocation(lightVolume.Program, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
+					glUniformMatrix4fv(glGetUniformLocation(lightVolume.Program, "view"), 1, GL_FALSE, glm::value_ptr(view));
+					bindGBuffer(lightVolume);
+					lightVolumes.Draw(lightVolume, clusteredLights.LightTexture(), clusteredLights.SphereTexture(), CLUSTER_UNIT, clusteredLights.LightCount());
+				});
+				sceneColor = litScene;
+			}
+			// - eva's indirect light from the probes, only over the pixels eva covers
+			if (hasProbes && evaOnScreen) {
+				FrameGraph::Resource probeLitScene = frameGraph.Rename(sceneColor, "scene + probes");
+				frameGraph.AddPass("probe light", { sceneColor, gAlbedoSpecular, gNormal, sceneDepth }, { probeLitScene }, [&]() {
+					probeLight.Use();
+					glUniformMatrix4fv(glGetUniformLocation(probeLight.Program, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
+					glUniformMatrix4fv(glGetUniformLocation(probeLight.Program, "view"), 1, GL_FALSE, glm::value_ptr(view));
+					bindGBuffer(probeLight);
+					probes.Bind(probeLight, PROBE_BINDING);
+					glDisable(GL_DEPTH_TEST);
+					glEnable(GL_BLEND);
+					glBlendFunc(GL_ONE, GL_ONE);
+					eva.DrawDepth(probeLight);
+					glDisable(GL_BLEND);
+					glEnable(GL_DEPTH_TEST);
+				});
+				sceneColor = probeLitScene;
+			}
+		}
 
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
-		
+
+		// - Sky wherever the scene left the background
+		FrameGraph::Resource sceneAndSky = frameGraph.Rename(sceneColor, "scene + sky");
+		frameGraph.AddPass("sky", { sceneColor, sceneDepth }, { sceneAndSky }, [&]() {
+			glDisable(GL_DEPTH_TEST);
+			skyShader.Use();
+			glActiveTexture(GL_TEXTURE0);
+			glBindTexture(GL_TEXTURE_2D, frameGraph.Texture(sceneDepth));
+			glUniform1i(glGetUniformLocation(skyShader.Program, "sceneDepth"), 0);
+			sky.Bind(skyShader, 1);
+			glUniformMatrix4fv(glGetUniformLocation(skyShader.Program, "inverseViewProjection"), 1, GL_FALSE, glm::value_ptr(inverseViewProjection));
+			glUniform3f(glGetUniformLocation(skyShader.Program, "viewPos"), camera.Position.x, camera.Position.y, camera.Position.z);
+			glUniform3f(glGetUniformLocation(skyShader.Program, "lightPos"), lightPos.x, lightPos.y, lightPos.z);
+			glUniform3f(glGetUniformLocation(skyShader.Program, "skyScale"), skyScale.x, skyScale.y, skyScale.z);
+			glUniform1f(glGetUniformLocation(skyShader.Program, "sunDisk"), 20.0f);
+			RenderQuad();
+			glEnable(GL_DEPTH_TEST);
+		});
+		sceneColor = sceneAndSky;
 
 		////////////////////////////////////////////////////
 		// PASS 3
 		// Compute volumetric light scattering
 		// //////////////////////////////////////////////////
 
-		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer2);
-		glViewport(0, 0, screenWidth, screenHeight);
-		glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-		godRays.Use();
-		//initialize view and lights
-		GLint viewPosLoc2 = glGetUniformLocation(godRays.Program, "viewPos");
-		glUniform3f(viewPosLoc2, camera.Position.x, camera.Position.y, camera.Position.z);
-		glUniform3f(glGetUniformLocation(godRays.Program, "lightPos"), lightPos.x, lightPos.y, lightPos.z);
-		glUniform3f(glGetUniformLocation(godRays.Program, "lightColor"), lightColor.x, lightColor.y, lightColor.z);
-		glUniform1f(glGetUniformLocation(godRays.Program, "lightInt"), lightInt);
-		// Transformation matrices
-		glUniformMatrix4fv(glGetUniformLocation(godRays.Program, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
-		glUniformMatrix4fv(glGetUniformLocation(godRays.Program, "view"), 1, GL_FALSE, glm::value_ptr(view));
-		glUniformMatrix4fv(glGetUniformLocation(godRays.Program, "model"), 1, GL_FALSE, glm::value_ptr(model));
-		glUniformMatrix4fv(glGetUniformLocation(godRays.Program, "lightSpaceMatrix"), 1, GL_FALSE, glm::value_ptr(lightSpaceMatrix));
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, depthMap);
-		glUniformMatrix4fv(glGetUniformLocation(godRays.Program, "model"), 1, GL_FALSE, glm::value_ptr(model));
-		ourModel.Draw(godRays);
-		glUniformMatrix4fv(glGetUniformLocation(godRays.Program, "model"), 1, GL_FALSE, glm::value_ptr(evaMod));
-		eva.Draw(godRays);
-		
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
-		
+		// Every mode is declared, the composite only reads the current one's output so the others are culled
+		FrameGraph::Resource halfResScattering = frameGraph.Import("half res scattering", scattering.Latest());
+		FrameGraph::Resource epipolarSamples = frameGraph.Import("epipolar samples", epipolar.LineSamples());
+		FrameGraph::Resource fogVolume = frameGraph.Import("fog volume", fog.Volume);
+		// Fused, the rays are blended into a new version of the scene rather than a target of their own
+		FrameGraph::Resource halfResRays, epipolarRays;
+		std::vector<FrameGraph::Resource> raysReads = { sceneDepth };
+		if (fuseScattering) {
+			halfResRays = frameGraph.Rename(sceneColor, "scene + half res rays");
+			epipolarRays = frameGraph.Rename(sceneColor, "scene + epipolar rays");
+			raysReads.push_back(sceneColor);
+		}
+		else {
+			halfResRays = frameGraph.Create("half res rays", TargetDesc(screenWidth, screenHeight, HDR_FORMAT));
+			epipolarRays = frameGraph.Create("epipolar rays", TargetDesc(screenWidth, screenHeight, HDR_FORMAT));
+		}
+
+		// - March at low resolution up to the scene depth, accumulated over frames
+		std::vector<FrameGraph::Resource> marchReads = { sceneDepth, sunShadow };
+		if (useEVSM)
+			marchReads.push_back(evsmMoments);
+		frameGraph.AddPass("half res march", marchReads, { halfResScattering }, [&]() {
+			godRays.Use();
+			//initialize view and lights
+			GLint viewPosLoc2 = glGetUniformLocation(godRays.Program, "viewPos");
+			glUniform3f(viewPosLoc2, camera.Position.x, camera.Position.y, camera.Position.z);
+			glUniform3f(glGetUniformLocation(godRays.Program, "lightPos"), lightPos.x, lightPos.y, lightPos.z);
+			glUniform3f(glGetUniformLocation(godRays.Program, "lightColor"), lightColor.x, lightColor.y, lightColor.z);
+			glUniform1f(glGetUniformLocation(godRays.Program, "lightInt"), lightInt);
+			glUniformMatrix4fv(glGetUniformLocation(godRays.Program, "lightSpaceMatrix"), 1, GL_FALSE, glm::value_ptr(lightSpaceMatrix));
+			glActiveTexture(GL_TEXTURE0);
+			glBindTexture(GL_TEXTURE_2D, depthMap);
+			glActiveTexture(GL_TEXTURE0 + EVSM_UNIT);
+			glBindTexture(GL_TEXTURE_2D, evsm.Moments);
+			glUniform1i(glGetUniformLocation(godRays.Program, "evsmMap"), EVSM_UNIT);
+			glUniform1f(glGetUniformLocation(godRays.Program, "evsmExponent"), evsm.Exponent);
+			glUniform1i(glGetUniformLocation(godRays.Program, "useEVSM"), useEVSM);
+			scattering.March(godRays, frameGraph.Texture(sceneDepth), projection, view, cameraNear, cameraFar);
+		});
+		// - Depth-aware upsample to full resolution
+		std::vector<FrameGraph::Resource> upsampleReads = raysReads;
+		upsampleReads.push_back(halfResScattering);
+		frameGraph.AddPass("half res upsample", upsampleReads, { halfResRays }, [&]() {
+			if (fuseScattering) {
+				glEnable(GL_BLEND);
+				glBlendFunc(GL_ONE, GL_ONE);
+			}
+			scattering.Upsample(bilateralUpsample, frameGraph.Texture(sceneDepth), cameraNear, cameraFar);
+			glDisable(GL_BLEND);
+		});
+
+		// - Min/max trees of the shadow map along the epipolar lines, then one ray per line sample
+		frameGraph.AddPass("epipolar march", { sceneDepth, sunShadow }, { epipolarSamples }, [&]() {
+			epipolar.Update(projection, view, lightSpaceMatrix, lightPos, camera.Position);
+			epipolar.BuildMinMax(epipolarMinMax, depthMap);
+			epipolarMarch.Use();
+			glUniform3f(glGetUniformLocation(epipolarMarch.Program, "viewPos"), camera.Position.x, camera.Position.y, camera.Position.z);
+			glUniform3f(glGetUniformLocation(epipolarMarch.Program, "lightPos"), lightPos.x, lightPos.y, lightPos.z);
+			glUniform3f(glGetUniformLocation(epipolarMarch.Program, "lightColor"), lightColor.x, lightColor.y, lightColor.z);
+			glUniform1f(glGetUniformLocation(epipolarMarch.Program, "lightInt"), lightInt);
+			glUniformMatrix4fv(glGetUniformLocation(epipolarMarch.Program, "lightSpaceMatrix"), 1, GL_FALSE, glm::value_ptr(lightSpaceMatrix));
+			epipolar.March(epipolarMarch, frameGraph.Texture(sceneDepth), projection, view, cameraNear, cameraFar);
+		});
+		// - Interpolate the screen from the two closest lines
+		std::vector<FrameGraph::Resource> interpolateReads = raysReads;
+		interpolateReads.push_back(epipolarSamples);
+		frameGraph.AddPass("epipolar interpolate", interpolateReads, { epipolarRays }, [&]() {
+			if (fuseScattering) {
+				glEnable(GL_BLEND);
+				glBlendFunc(GL_ONE, GL_ONE);
+			}
+			epipolar.Interpolate(epipolarInterpolate, frameGraph.Texture(sceneDepth), cameraNear, cameraFar);
+			glDisable(GL_BLEND);
+		});
+
+		// - Inject the sun, point and spot light into every froxel and integrate front to back
+		frameGraph.AddPass("froxel fog", { sunShadow, localShadows, pointShadowMap }, { fogVolume }, [&]() {
+			froxelFog.Use();
+			glUniform3f(glGetUniformLocation(froxelFog.Program, "viewPos"), camera.Position.x, camera.Position.y, camera.Position.z);
+			set_lights(froxelFog);
+			glUniformMatrix4fv(glGetUniformLocation(froxelFog.Program, "lightSpaceMatrix"), 1, GL_FALSE, glm::value_ptr(lightSpaceMatrix));
+			glActiveTexture(GL_TEXTURE0);
+			glBindTexture(GL_TEXTURE_2D, depthMap);
+			glUniform1i(glGetUniformLocation(froxelFog.Program, "shadowMap"), 0);
+			glActiveTexture(GL_TEXTURE0 + ATLAS_UNIT);
+			glBindTexture(GL_TEXTURE_2D, atlas.DepthMap);
+			glUniform1i(glGetUniformLocation(froxelFog.Program, "shadowAtlas"), ATLAS_UNIT);
+			glActiveTexture(GL_TEXTURE0 + POINT_SHADOW_UNIT);
+			glBindTexture(GL_TEXTURE_CUBE_MAP, pointShadow.DepthMap);
+			glUniform1i(glGetUniformLocation(froxelFog.Program, "pointShadowMap"), POINT_SHADOW_UNIT);
+			glUniform1i(glGetUniformLocation(froxelFog.Program, "pointLightHasShadow"), true);
+			glUniform1f(glGetUniformLocation(froxelFog.Program, "pointShadowNear"), pointNear);
+			glUniform1f(glGetUniformLocation(froxelFog.Program, "pointShadowFar"), pointRange);
+			glUniform1i(glGetUniformLocation(froxelFog.Program, "spotLightHasShadow"), spotShadow.Tiles.size() == 1);
+			if (spotShadow.Tiles.size() == 1)
+			{
+				glm::mat4 atlasMatrix = atlas.TileMatrix(spotShadow.Tiles[0]) * spotShadow.LightSpaceMatrices[0];
+				glUniformMatrix4fv(glGetUniformLocation(froxelFog.Program, "spotLightShadow"), 1, GL_FALSE, glm::value_ptr(atlasMatrix));
+				glUniform4fv(glGetUniformLocation(froxelFog.Program, "spotLightTile"), 1, glm::value_ptr(atlas.TileBounds(spotShadow.Tiles[0])));
+			}
+			fog.Update(froxelFog, projection, view, cameraFar);
+		});
+
+		// The history is stale once we switch back
+		if (scatteringMode != SCATTERING_HALF_RES)
+			scattering.Invalidate();
+
 		/////////////////////////////////////////////////////
 		// Bind to default framebuffer again and draw the 
 		// quad plane with attched screen texture.
 		// //////////////////////////////////////////////////
 
-		glClear(GL_COLOR_BUFFER_BIT);
-		glDisable(GL_DEPTH_TEST);
-		
-		quad.Use();
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, scene);	
-		glUniform1i(glGetUniformLocation(quad.Program, "scene"), 0);
-		glActiveTexture(GL_TEXTURE1);
-		glBindTexture(GL_TEXTURE_2D, rays);
-		glUniform1i(glGetUniformLocation(quad.Program, "rays"), 1);
-
-		/*debugDepthQuad.Use();
-		glUniform1f(glGetUniformLocation(debugDepthQuad.Program, "near_plane"), near_plane);
-		glUniform1f(glGetUniformLocation(debugDepthQuad.Program, "far_plane"), far_plane);
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, depthMap);*/
-		RenderQuad();
+		FrameGraph::Resource rays = scatteringMode == SCATTERING_EPIPOLAR ? epipolarRays : halfResRays;
+		bool compositeRays = scatteringMode != SCATTERING_FROXEL && !fuseScattering;
+		// Fused, the version of the scene holding the rays is the one to show
+		FrameGraph::Resource finalScene = scatteringMode != SCATTERING_FROXEL && fuseScattering ? rays : sceneColor;
+		std::vector<FrameGraph::Resource> compositeReads = { finalScene };
+		if (scatteringMode == SCATTERING_FROXEL) {
+			// Nothing is marched per pixel, the composite looks the fog up
+			compositeReads.push_back(sceneDepth);
+			compositeReads.push_back(fogVolume);
+		}
+		else if (compositeRays)
+			compositeReads.push_back(rays);
+		frameGraph.AddPass("composite", compositeReads, {}, [&]() {
+			glBindFramebuffer(GL_FRAMEBUFFER, 0);
+			glViewport(0, 0, screenWidth, screenHeight);
+			glClear(GL_COLOR_BUFFER_BIT);
+			glDisable(GL_DEPTH_TEST);
+
+			quad.Use();
+			glActiveTexture(GL_TEXTURE0);
+			glBindTexture(GL_TEXTURE_2D, frameGraph.Texture(finalScene));
+			glUniform1i(glGetUniformLocation(quad.Program, "scene"), 0);
+			glUniform1i(glGetUniformLocation(quad.Program, "useRays"), compositeRays);
+			glUniform1i(glGetUniformLocation(quad.Program, "useFog"), scatteringMode == SCATTERING_FROXEL);
+			glUniform1f(glGetUniformLocation(quad.Program, "exposure"), exposure);
+			if (scatteringMode == SCATTERING_FROXEL) {
+				glActiveTexture(GL_TEXTURE2);
+				glBindTexture(GL_TEXTURE_2D, frameGraph.Texture(sceneDepth));
+				glUniform1i(glGetUniformLocation(quad.Program, "sceneDepth"), 2);
+				glActiveTexture(GL_TEXTURE3);
+				glBindTexture(GL_TEXTURE_3D, fog.Volume);
+				glUniform1i(glGetUniformLocation(quad.Program, "fogVolume"), 3);
+				glUniform1f(glGetUniformLocation(quad.Program, "nearPlane"), cameraNear);
+				glUniform1f(glGetUniformLocation(quad.Program, "farPlane"), cameraFar);
+				glUniform1f(glGetUniformLocation(quad.Program, "fogNear"), fog.Near);
+				glUniform1f(glGetUniformLocation(quad.Program, "fogFar"), fog.Far);
+			}
+			else if (compositeRays) {
+				glActiveTexture(GL_TEXTURE1);
+				glBindTexture(GL_TEXTURE_2D, frameGraph.Texture(rays));
+				glUniform1i(glGetUniformLocation(quad.Program, "rays"), 1);
+			}
+
+			/*debugDepthQuad.Use();
+			glUniform1f(glGetUniformLocation(debugDepthQuad.Program, "near_plane"), shadowMap.Fit.Near);
+			glUniform1f(glGetUniformLocation(debugDepthQuad.Program, "far_plane"), shadowMap.Fit.Far);
+			glActiveTexture(GL_TEXTURE0);
+			glBindTexture(GL_TEXTURE_2D, depthMap);*/
+			RenderQuad();
+			glEnable(GL_DEPTH_TEST);
+		}, true);
+
+		frameGraph.Compile();
+		frameGraph.Execute();
+		shaderVariants = standardShader.Count() + gbufferShader.Count() + deferredLighting.Count();
 		
 		// Swap the buffers
 		glfwSwapBuffers(window);
+		updateStats(window);
 
 	}
 
@@ -395,26 +992,27 @@ void set_lights(Shader &shader) {
 	glUniform3f(glGetUniformLocation(shader.Program, "lightPos"), lightPos.x, lightPos.y, lightPos.z);
 	glUniform3f(glGetUniformLocation(shader.Program, "lightColor"), lightColor.x, lightColor.y, lightColor.z);
 	glUniform1f(glGetUniformLocation(shader.Program, "lightInt"), lightInt);
+	glUniform3f(glGetUniformLocation(shader.Program, "ambientColor"), ambientColor.x, ambientColor.y, ambientColor.z);
 
 	//Point Light
-	glUniform3f(glGetUniformLocation(shader.Program, "pointLight.position"), lampPos.x, lampPos.y, lampPos.z);
-	glUniform3f(glGetUniformLocation(shader.Program, "pointLight.color"), 1.0f, 1.0f, 1.0f);
-	glUniform1f(glGetUniformLocation(shader.Program, "pointLight.intensity"), 0.5f);
-	glUniform1f(glGetUniformLocation(shader.Program, "pointLight.constant"), 1.0f);
-	glUniform1f(glGetUniformLocation(shader.Program, "pointLight.linear"), 0.09);
-	glUniform1f(glGetUniformLocation(shader.Program, "pointLight.quadratic"), 0.032);
+	glUniform3f(glGetUniformLocation(shader.Program, "pointLight.position"), pointLight.Position.x, pointLight.Position.y, pointLight.Position.z);
+	glUniform3f(glGetUniformLocation(shader.Program, "pointLight.color"), pointLight.Color.x, pointLight.Color.y, pointLight.Color.z);
+	glUniform1f(glGetUniformLocation(shader.Program, "pointLight.intensity"), pointLight.Intensity);
+	glUniform1f(glGetUniformLocation(shader.Program, "pointLight.constant"), pointLight.Constant);
+	glUniform1f(glGetUniformLocation(shader.Program, "pointLight.linear"), pointLight.Linear);
+	glUniform1f(glGetUniformLocation(shader.Program, "pointLight.quadratic"), pointLight.Quadratic);
 	
 
 	//Spotlight
-	glUniform3f(glGetUniformLocation(shader.Program, "spotLight.position"), spotPos.x, spotPos.y, spotPos.z);
-	glUniform3f(glGetUniformLocation(shader.Program, "spotLight.direction"), 0.0f, -1.0f, 0.0f);
-	glUniform3f(glGetUniformLocation(shader.Program, "spotLight.color"), 1.0f, 1.0f, 1.0f);
-	glUniform1f(glGetUniformLocation(shader.Program, "spotLight.intensity"), 0.5f);
-	glUniform1f(glGetUniformLocation(shader.Program, "spotLight.constant"), 1.0f);
-	glUniform1f(glGetUniformLocation(shader.Program, "spotLight.linear"), 0.09);
-	glUniform1f(glGetUniformLocation(shader.Program, "spotLight.quadratic"), 0.032);
-	glUniform1f(glGetUniformLocation(shader.Program, "spotLight.cutOff"), glm::cos(glm::radians(12.5f)));
-	glUniform1f(glGetUniformLocation(shader.Program, "spotLight.outerCutOff"), glm::cos(glm::radians(15.0f)));
+	glUniform3f(glGetUniformLocation(shader.Program, "spotLight.position"), spotLight.Position.x, spotLight.Position.y, spotLight.Position.z);
+	glUniform3f(glGetUniformLocation(shader.Program, "spotLight.direction"), spotLight.Direction.x, spotLight.Direction.y, spotLight.Direction.z);
+	glUniform3f(glGetUniformLocation(shader.Program, "spotLight.color"), spotLight.Color.x, spotLight.Color.y, spotLight.Color.z);
+	glUniform1f(glGetUniformLocation(shader.Program, "spotLight.intensity"), spotLight.Intensity);
+	glUniform1f(glGetUniformLocation(shader.Program, "spotLight.constant"), spotLight.Constant);
+	glUniform1f(glGetUniformLocation(shader.Program, "spotLight.linear"), spotLight.Linear);
+	glUniform1f(glGetUniformLocation(shader.Program, "spotLight.quadratic"), spotLight.Quadratic);
+	glUniform1f(glGetUniformLocation(shader.Program, "spotLight.cutOff"), spotLight.CutOff);
+	glUniform1f(glGetUniformLocation(shader.Program, "spotLight.outerCutOff"), spotLight.OuterCutOff);
 	
 }
 
@@ -457,40 +1055,277 @@ void updateLight() {
 	lightPos = glm::vec3(rotationMat * glm::vec4(lightPos, 1.0));
 }
 
-void updateAngle(GLfloat amount)
+// Advances the simulation by one step of SIMULATION_STEP
+void simulate(SimulationState &state)
 {
-	angle += amount;
-	if (angle > 180) {
-		nightTime = true;
-		lightColor = night;
-		lightInt = 0.5f;
-		angle = -180.0f;
+	// 2.5 per second
+	state.TimeOfDay = glm::fract(state.TimeOfDay + SIMULATION_STEP / dayLength);
+
+	// Eva swims along Z on a sine wave and turns around every 60 units
+	float k = 2 * 3.14 / wavelength;
+	if (state.DeltaZ > 60.0f) {
+		state.RotateEva = true;
+		state.DeltaZ = 0.0f;
+		state.UpdateZ *= 0.2;
 	}
-	else if (angle > 1.0f && nightTime) {
-		nightTime = false;
-		lightInt = 1.0f;
+	if (state.DeltaAngle > 3.1415) {
+		state.RotateEva = false;
+		state.DeltaAngle = 0.0f;
+		state.UpdateZ *= -5;
 	}
+	state.EvaPos.y += amplitude * sin(k * state.Theta);
+	state.Theta += incTheta;
+	state.EvaPos.z += state.UpdateZ;
+	state.DeltaZ += abs(state.UpdateZ);
+	if (state.RotateEva) {
+		state.EvaAngle += incTheta;
+		state.DeltaAngle += incTheta;
+	}
+}
+
+// State to draw between two steps, alpha from 0 at from to 1 at to
+SimulationState interpolate(const SimulationState &from, const SimulationState &to, GLfloat alpha)
+{
+	SimulationState state = to;
+	// The time of day wraps around at midnight
+	GLfloat timeOfDay = to.TimeOfDay < from.TimeOfDay ? to.TimeOfDay + 1.0f : to.TimeOfDay;
+	state.TimeOfDay = glm::fract(glm::mix(from.TimeOfDay, timeOfDay, alpha));
+	state.EvaPos = glm::mix(from.EvaPos, to.EvaPos, alpha);
+	state.EvaAngle = glm::mix(from.EvaAngle, to.EvaAngle, alpha);
+	return state;
 }
 
-glm::vec3 changeColor(GLint rotation)
+// Places the sun, or the moon at night, on its arc at timeOfDay and reads its light from the sky table
+void updateSky(const Sky &sky, GLfloat timeOfDay)
 {
-	if (angle > 25.0f && angle < 45.0f) {
-		return lerp(lightColor, day, 0.997f);
-	} else if (angle > 145.0f && angle < 160.0f) {
-		return lerp(lightColor, dawn_sunrise, 0.997f);
-	} else if (angle > 165.0f) {
-		return lerp(lightColor, night, 0.987f);
-	}else if (angle > -5.0f && angle < 25.0f) {
-		return lerp(lightColor, dawn_sunrise, 0.96f);
+	nightTime = timeOfDay >= 0.5f;
+	// 0 on the horizon at +x, 180 on the horizon at -x, the moon goes the sun's way backwards
+	GLfloat arc = nightTime ? 360.0f * (1.0f - timeOfDay) : 360.0f * timeOfDay;
+	glm::mat4 rotationMat = glm::rotate(glm::mat4(), glm::radians(arc - 90.0f), glm::vec3(0.0f, 0.0f, 1.0f));
+	lightPos = glm::vec3(rotationMat * glm::vec4(0.5f, 15.0f, 0.0f, 1.0f));
+
+	Sky::Light light = sky.LightAt(glm::asin(glm::normalize(lightPos).y));
+	skyScale = nightTime ? MOON_INTENSITY * night : glm::vec3(1.0f);
+	// The colour keeps its brightest channel at 1, the intensity carries the rest
+	GLfloat brightest = glm::max(glm::max(light.Sun.r, light.Sun.g), glm::max(light.Sun.b, 1e-4f));
+	lightColor = (nightTime ? night : glm::vec3(1.0f)) * light.Sun / brightest;
+	lightInt = (nightTime ? MOON_INTENSITY : 1.0f) * brightest;
+	ambientColor = skyScale * light.Ambient;
+}
+
+// Scatters lampCount lamps of random colours in the lower half of bounds, one in four a spot
+// pointing down. The generator is seeded so every run gets the same lamps.
+void placeLamps(const AABB &bounds)
+{
+	std::mt19937 generator(1337);
+	std::uniform_real_distribution<GLfloat> unit(0.0f, 1.0f);
+	lampPoints.clear();
+	lampSpots.clear();
+	for (GLuint i = 0; i < lampCount; i++)
+	{
+		glm::vec3 position = bounds.Min + glm::vec3(unit(generator), 0.1f + 0.4f * unit(generator), unit(generator)) * (bounds.Max - bounds.Min);
+		glm::vec3 color = glm::vec3(0.2f) + 0.8f * glm::vec3(unit(generator), unit(generator), unit(generator));
+		if (i % 4 == 3)
+		{
+			SpotLight lamp = { position, glm::vec3(0.0f, -1.0f, 0.0f), color, 1.0f,
+				glm::cos(glm::radians(25.0f)), glm::cos(glm::radians(35.0f)), 1.0f, 0.7f, 1.8f };
+			lampSpots.push_back(lamp);
+		}
+		else
+		{
+			PointLight lamp = { position, color, 1.0f, 1.0f, 0.7f, 1.8f };
+			lampPoints.push_back(lamp);
+		}
+	}
+}
+
+// Times the frame's CPU jobs with 1 thread and more, up to every core: the cluster lists of the
+// 1024 lamps at the most, scattered over the room, and 100k small boxes culled, both for the
+// default camera
+void benchJobs()
+{
+	const GLuint FRAMES = 100, BOXES = 100000;
+	AABB room(glm::vec3(-10.0f, -2.0f, -10.0f), glm::vec3(10.0f, 6.0f, 10.0f));
+	lampCount = 1024;
+	placeLamps(room);
+	glm::mat4 projection = glm::perspective(camera.Zoom, (float)screenWidth / (float)screenHeight, cameraNear, cameraFar);
+	glm::mat4 view = camera.GetViewMatrix();
+	Frustum frustum(projection * view);
+
+	std::mt19937 generator(7);
+	std::uniform_real_distribution<GLfloat> unit(0.0f, 1.0f);
+	std::vector<AABB> boxes(BOXES);
+	for (GLuint i = 0; i < BOXES; i++)
+	{
+		glm::vec3 center = room.Min + glm::vec3(unit(generator), unit(generator), unit(generator)) * (room.Max - room.Min);
+		boxes[i] = AABB(center - 0.1f, center + 0.1f);
+	}
+	std::vector<GLubyte> visible(BOXES);
+
+	ClusteredLights clusters(16, 9, 24);
+	GLuint cores = std::max(std::thread::hardware_concurrency(), 1u);
+	GLfloat first = 0.0f;
+	std::cout << "Jobs: " << lampCount << " lamps, " << BOXES << " boxes, " << FRAMES << " frames" << std::endl;
+	for (GLuint threads = 1; threads <= cores; threads = threads < cores && threads * 2 > cores ? cores : threads * 2)
+	{
+		JobSystem jobs(threads);
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (GLuint frame = 0; frame < FRAMES; frame++)
+		{
+			JobCounter clustered;
+			clusters.Build(lampPoints, lampSpots, projection, view, cameraNear, cameraFar, jobs, clustered);
+			jobs.Wait(clustered);
+		}
+		std::chrono::steady_clock::time_point clustered = std::chrono::steady_clock::now();
+		for (GLuint frame = 0; frame < FRAMES; frame++)
+		{
+			jobs.ParallelFor(BOXES, 1024, [&](GLuint begin, GLuint end) {
+				for (GLuint i = begin; i < end; i++)
+					visible[i] = frustum.Intersects(boxes[i]);
+			});
+		}
+		std::chrono::steady_clock::time_point culled = std::chrono::steady_clock::now();
+
+		GLfloat clusterTime = std::chrono::duration<GLfloat, std::milli>(clustered - start).count() / FRAMES;
+		GLfloat cullTime = std::chrono::duration<GLfloat, std::milli>(culled - clustered).count() / FRAMES;
+		if (threads == 1)
+			first = clusterTime + cullTime;
+		std::cout << "  " << threads << " threads: clusters " << clusterTime << " ms (" << clusters.References() << " refs), culling "
+			<< cullTime << " ms, " << first / (clusterTime + cullTime) << "x" << std::endl;
+		if (threads == cores)
+			break;
+	}
+}
+
+// Times SceneGraph::Update on 100k nodes of a random hierarchy, a few percent of them moved
+// every frame, against moving the root and so recomputing every node
+void benchSceneGraph()
+{
+	const GLuint NODES = 100000, FRAMES = 1000;
+	std::mt19937 generator(11);
+	std::uniform_real_distribution<GLfloat> unit(0.0f, 1.0f);
+	std::uniform_int_distribution<GLuint> anyNode(0, NODES - 1);
+
+	// - Depth first: a new node goes under the last one added or one of its ancestors, at most
+	// 8 levels down like the parts of an object in a scene
+	SceneGraph graph;
+	std::vector<GLuint> path(1, graph.Add(SceneGraph::NO_PARENT, glm::mat4(), "root"));
+	GLuint depth = 0;
+	while (graph.NodeCount() < NODES)
+	{
+		while (path.size() > 1 && (path.size() > 8 || unit(generator) < 0.5f))
+			path.pop_back();
+		glm::vec3 offset = glm::vec3(unit(generator), unit(generator), unit(generator)) * 2.0f - 1.0f;
+		path.push_back(graph.Add(path.back(), glm::rotate(glm::translate(glm::mat4(), offset), unit(generator), glm::vec3(0.0f, 1.0f, 0.0f))));
+		depth = std::max<GLuint>(depth, path.size());
+	}
+	std::cout << "Scene graph: " << NODES << " nodes, " << depth << " levels deep, " << FRAMES << " frames" << std::endl;
+
+	GLfloat percents[] = { 0.0f, 1.0f, 2.0f, 5.0f };
+	for (GLuint p = 0; p < 4; p++)
+	{
+		GLuint moved = (GLuint)(NODES * percents[p] / 100.0f), updated = 0;
+		GLfloat total = 0.0f;
+		for (GLuint frame = 0; frame < FRAMES; frame++)
+		{
+			for (GLuint i = 0; i < moved; i++)
+			{
+				GLuint node = anyNode(generator);
+				graph.SetLocal(node, glm::rotate(graph.Local(node), 0.01f, glm::vec3(0.0f, 1.0f, 0.0f)));
+			}
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			updated += graph.Update();
+			total += std::chrono::duration<GLfloat, std::micro>(std::chrono::steady_clock::now() - start).count();
+		}
+		std::cout << "  " << percents[p] << "% moved: " << total / FRAMES << " us, " << updated / FRAMES << " nodes updated" << std::endl;
+	}
+	GLfloat total = 0.0f;
+	for (GLuint frame = 0; frame < FRAMES / 10; frame++)
+	{
+		graph.SetLocal(0, glm::rotate(graph.Local(0), 0.01f, glm::vec3(0.0f, 1.0f, 0.0f)));
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		graph.Update();
+		total += std::chrono::duration<GLfloat, std::micro>(std::chrono::steady_clock::now() - start).count();
+	}
+	std::cout << "  root moved: " << total / (FRAMES / 10) << " us, " << NODES << " nodes updated" << std::endl;
+}
+
+// Times EntityStore::Update with each kernel the CPU runs, from a thousand to a million entities
+// with random transforms, and the culling of their boxes against the default camera
+void benchEntities()
+{
+	const GLuint COUNTS[] = { 1000, 10000, 100000, 1000000 };
+	std::mt19937 generator(13);
+	std::uniform_real_distribution<GLfloat> unit(-1.0f, 1.0f);
+	glm::mat4 projection = glm::perspective(camera.Zoom, (float)screenWidth / (float)screenHeight, cameraNear, cameraFar);
+	Frustum frustum(projection * camera.GetViewMatrix());
+	std::cout << "Entities: best kernel " << EntityStore::KernelName(EntityStore::Best()) << std::endl;
+	for (GLuint c = 0; c < 4; c++)
+	{
+		EntityStore store;
+		for (GLuint i = 0; i < COUNTS[c]; i++)
+		{
+			glm::vec3 position = glm::vec3(unit(generator), unit(generator), unit(generator)) * 50.0f;
+			glm::quat rotation = glm::normalize(glm::quat(unit(generator), unit(generator), unit(generator), unit(generator)));
+			glm::vec3 scale = glm::vec3(1.0f) + 0.5f * glm::vec3(unit(generator), unit(generator), unit(generator));
+			store.Create(position, rotation, scale, AABB(glm::vec3(-0.5f), glm::vec3(0.5f)));
+		}
+		// - As many frames as make about 10 million entity updates
+		GLuint frames = std::max(10000000 / COUNTS[c], 1u);
+		std::cout << "  " << COUNTS[c] << " entities:";
+		GLfloat scalarTime = 0.0f;
+		EntityStore::Kernel kernels[] = { EntityStore::KERNEL_SCALAR, EntityStore::KERNEL_SSE, EntityStore::KERNEL_AVX2 };
+		for (GLuint k = 0; k < 3; k++)
+		{
+			store.SetKernel(kernels[k]);
+			if (store.CurrentKernel() != kernels[k])
+				continue;
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			for (GLuint frame = 0; frame < frames; frame++)
+				store.Update();
+			GLfloat time = std::chrono::duration<GLfloat, std::milli>(std::chrono::steady_clock::now() - start).count() / frames;
+			if (k == 0)
+				scalarTime = time;
+			std::cout << " " << EntityStore::KernelName(kernels[k]) << " " << time << " ms (" << scalarTime / time << "x),";
+		}
+		std::vector<GLuint> visible;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (GLuint frame = 0; frame < frames; frame++)
+			store.Cull(frustum, visible);
+		GLfloat cullTime = std::chrono::duration<GLfloat, std::milli>(std::chrono::steady_clock::now() - start).count() / frames;
+		std::cout << " culling " << cullTime << " ms (" << visible.size() << " visible)" << std::endl;
 	}
-	
-	return lightColor;
 }
 
-glm::vec3 lerp(glm::vec3 color_1, glm::vec3 color_2, float alpha)
+// Shows frame rate and per-frame counters in the window title, refreshed once per second
+void updateStats(GLFWwindow* window)
 {
-	glm::vec3 color = alpha * color_1 + (1.0f - alpha) * color_2;
-	return color;
+	statsDelta += deltaTime;
+	statsFrames++;
+	if (statsDelta < 1.0f)
+		return;
+
+	std::stringstream title;
+	title << "Magics | " << statsFrames / statsDelta << " fps"
+		<< " | shadow tris: " << shadowTriangles
+		<< " | shadows: " << (useEVSM ? "EVSM" : "PCF " + std::to_string(pcfTaps) + " taps")
+		<< " | shadow density: " << (shadowTexelSize > 0.0f ? 1.0f / shadowTexelSize : 0.0f) << " texels/unit"
+		<< " | point shadow: " << cubeShadowTimers[singlePassCubeShadow].Average() << " ms"
+		<< (singlePassCubeShadow ? " (single pass)" : " (six passes)")
+		<< " | scattering: " << (scatteringMode == SCATTERING_EPIPOLAR ? "epipolar" : scatteringMode == SCATTERING_FROXEL ? "froxel fog" : "half res")
+		<< (fuseScattering ? " (fused)" : " (split)")
+		<< " | passes: " << frameGraph.LivePassCount() << "/" << frameGraph.PassCount()
+		<< " | targets: " << frameGraph.PoolBytes() / (1024 * 1024) << " MB"
+		<< " | shader variants: " << shaderVariants
+		<< " | " << (deferredShading ? "deferred" : "forward")
+		<< " | lamps: " << lampCount;
+	if (!deferredShading)
+		title << " (" << clusterReferences << " cluster refs)"
+			<< " | scene: " << sceneTimers[depthPrepass].Average() << " ms" << (depthPrepass ? " (prepass)" : "")
+			<< ", overdraw: " << sceneSamples.Average() / (screenWidth * screenHeight) << " fragments/pixel";
+	glfwSetWindowTitle(window, title.str().c_str());
+	statsDelta = 0.0f;
+	statsFrames = 0;
 }
 
 
@@ -515,6 +1350,40 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
 {
 	if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
 		glfwSetWindowShouldClose(window, GL_TRUE);
+	// Toggle between EVSM and PCF shadows
+	if (key == GLFW_KEY_E && action == GLFW_PRESS)
+		useEVSM = !useEVSM;
+	// Cycle the PCF kernel through 1, 4, 9 and 16 taps, the variant is compiled on first use
+	if (key == GLFW_KEY_P && action == GLFW_PRESS)
+		pcfTaps = pcfTaps == 16 ? 1 : pcfTaps == 9 ? 16 : pcfTaps == 4 ? 9 : 4;
+	// Cycle through the low resolution, epipolar and froxel scattering
+	if (key == GLFW_KEY_V && action == GLFW_PRESS)
+		scatteringMode = (ScatteringMode)((scatteringMode + 1) % 3);
+	// Toggle between blending the rays into the scene and keeping them in their own target
+	if (key == GLFW_KEY_F && action == GLFW_PRESS)
+		fuseScattering = !fuseScattering;
+	// Toggle between the forward and the deferred path
+	if (key == GLFW_KEY_G && action == GLFW_PRESS)
+		deferredShading = !deferredShading;
+	// Toggle the depth prepass of the forward path, the overdraw average starts over
+	if (key == GLFW_KEY_Z && action == GLFW_PRESS)
+	{
+		depthPrepass = !depthPrepass;
+		sceneTimers[depthPrepass].Reset();
+		sceneSamples.Reset();
+	}
+	// Cycle the clustered lamps through 0, 64, 256 and 1024
+	if (key == GLFW_KEY_L && action == GLFW_PRESS)
+		lampCount = lampCount == 0 ? 64 : lampCount >= 1024 ? 0 : lampCount * 4;
+	// Toggle between the single-pass and six-pass point shadow, printing the time of the mode left
+	if (key == GLFW_KEY_C && action == GLFW_PRESS)
+	{
+		std::cout << "Point shadow " << (singlePassCubeShadow ? "single pass: " : "six passes: ")
+			<< cubeShadowTimers[singlePassCubeShadow].Average() << " ms over "
+			<< cubeShadowTimers[singlePassCubeShadow].Samples() << " frames" << std::endl;
+		singlePassCubeShadow = !singlePassCubeShadow;
+		cubeShadowTimers[singlePassCubeShadow].Reset();
+	}
 
 	if (action == GLFW_PRESS)
 		keys[key] = true;
@@ -0,0 +1,43 @@
+#version 330 core
+in vec2 TexCoords;
+out vec4 color;
+
+// low resolution scattering, a holds the linear depth each texel was computed at
+uniform sampler2D image;
+uniform sampler2D sceneDepth;
+uniform float nearPlane;
+uniform float farPlane;
+
+float LinearizeDepth(float depth)
+{
+    float z = depth * 2.0 - 1.0;
+    return (2.0 * nearPlane * farPlane) / (farPlane + nearPlane - z * (farPlane - nearPlane));
+}
+
+void main()
+{
+    float depth = LinearizeDepth(textureLod(sceneDepth, TexCoords, 0.0).r);
+
+    // the 4 low resolution texels around the pixel, weighted bilinearly and by how close
+    // their depth is to the pixel's, so the scattering does not bleed across silhouettes
+    ivec2 size = textureSize(image, 0);
+    vec2 position = TexCoords * vec2(size) - 0.5;
+    ivec2 base = ivec2(floor(position));
+    vec2 f = fract(position);
+    vec2 bilinear[2] = vec2[](1.0 - f, f);
+
+    vec3 sum = vec3(0.0);
+    float totalWeight = 0.0;
+    for(int y = 0; y < 2; ++y)
+    {
+        for(int x = 0; x < 2; ++x)
+        {
+            ivec2 coords = clamp(base + ivec2(x, y), ivec2(0), size - 1);
+            vec4 texel = texelFetch(image, coords, 0);
+            float weight = bilinear[x].x * bilinear[y].y / (1e-3 + abs(texel.a - depth) / depth);
+            sum += texel.rgb * weight;
+            totalWeight += weight;
+        }
+    }
+    color = vec4(sum / max(totalWeight, 1e-5), 1.0);
+}
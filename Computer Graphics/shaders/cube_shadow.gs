@@ -0,0 +1,39 @@
+#version 330 core
+
+layout (triangles) in;
+layout (triangle_strip, max_vertices = 18) out;
+
+// light view-projection of every cube face, in +X, -X, +Y, -Y, +Z, -Z order
+uniform mat4 faceMatrices[6];
+// faces the current mesh's bounds overlap, bit i set for face i
+uniform int faceMask;
+
+void main()
+{
+    for(int face = 0; face < 6; ++face)
+    {
+        if((faceMask & (1 << face)) == 0)
+            continue;
+
+        // skip the face when the whole triangle is outside one of its frustum planes
+        vec4 clip[3];
+        vec3 allAbove = vec3(1.0);
+        vec3 allBelow = vec3(1.0);
+        for(int i = 0; i < 3; ++i)
+        {
+            clip[i] = faceMatrices[face] * gl_in[i].gl_Position;
+            allAbove *= step(clip[i].w, clip[i].xyz);
+            allBelow *= step(clip[i].xyz, vec3(-clip[i].w));
+        }
+        if(any(greaterThan(allAbove + allBelow, vec3(0.0))))
+            continue;
+
+        for(int i = 0; i < 3; ++i)
+        {
+            gl_Layer = face;
+            gl_Position = clip[i];
+            EmitVertex();
+        }
+        EndPrimitive();
+    }
+}
@@ -0,0 +1,44 @@
+#version 330 core
+
+// Lighting of the deferred path, once per covered pixel: the sun, the shadowed point and spot
+// light and the ambient terms. The material comes from the G-buffer, the position from the depth.
+
+#include "lighting.glsl"
+#include "normal_encoding.glsl"
+
+in vec2 TexCoords;
+out vec4 color;
+
+//G-buffer
+uniform sampler2D gAlbedoSpecular;
+uniform sampler2D gNormal;
+uniform sampler2D gDepth;
+uniform mat4 inverseViewProjection;
+
+//view
+uniform vec3 viewPos;
+
+//shadows
+uniform mat4 lightSpaceMatrix;
+
+void main()
+{
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+	float depth = texelFetch(gDepth, pixel, 0).r;
+	// nothing was drawn here, keep the clear colour
+	if(depth == 1.0)
+		discard;
+	vec4 position = inverseViewProjection * vec4(vec3(TexCoords, depth) * 2.0 - 1.0, 1.0);
+	vec3 fragPos = position.xyz / position.w;
+	vec4 albedoSpecular = texelFetch(gAlbedoSpecular, pixel, 0);
+	vec3 normal = DecodeNormal(texelFetch(gNormal, pixel, 0).rg);
+	vec3 objectColor = albedoSpecular.rgb;
+	vec3 specMap = vec3(albedoSpecular.a);
+
+	vec3 viewDir = normalize(viewPos - fragPos);
+
+	vec3 light = ComputeSun(normal, viewDir, objectColor, specMap, lightSpaceMatrix * vec4(fragPos, 1.0));
+	light += ComputeLocal(normal, fragPos, viewDir, objectColor, specMap);
+
+	color = vec4(light, 1.0f);
+}
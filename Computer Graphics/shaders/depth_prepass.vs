@@ -0,0 +1,14 @@
+#version 330 core
+layout (location = 0) in vec3 position;
+
+uniform mat4 model;
+uniform mat4 view;
+uniform mat4 projection;
+
+// Same expression as standard_shader.vs, both invariant, so the shading pass can test GL_EQUAL
+invariant gl_Position;
+
+void main()
+{
+    gl_Position = projection * view * model * vec4(position, 1.0f);
+}
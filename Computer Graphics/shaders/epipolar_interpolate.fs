@@ -0,0 +1,73 @@
+#version 330 core
+in vec2 TexCoords;
+out vec4 color;
+
+// scattering marched along the epipolar lines, one row per slice, a holds the linear depth
+uniform sampler2D scattering;
+// per epipolar slice, row 0: (entry.xy, exit.xy) of the line on screen
+uniform sampler2D slices;
+uniform vec2 sunPosition;
+uniform sampler2D sceneDepth;
+uniform float nearPlane;
+uniform float farPlane;
+
+float LinearizeDepth(float depth)
+{
+    float z = depth * 2.0 - 1.0;
+    return (2.0 * nearPlane * farPlane) / (farPlane + nearPlane - z * (farPlane - nearPlane));
+}
+
+// Position of a screen border point along the border, in [0, 4): bottom, right, top then left edge
+float BorderPosition(vec2 point)
+{
+    if(point.y <= 1e-4)
+        return point.x;
+    if(point.x >= 1.0 - 1e-4)
+        return 1.0 + point.y;
+    if(point.y >= 1.0 - 1e-4)
+        return 3.0 - point.x;
+    return 4.0 - point.y;
+}
+
+// Adds the two samples of a slice around the pixel, weighted by how close their depth is to the pixel's
+void AddSlice(int slice, float sliceWeight, float depth, inout vec3 sum, inout float totalWeight)
+{
+    vec4 line = texelFetch(slices, ivec2(slice, 0), 0);
+    vec2 direction = line.zw - line.xy;
+    float lineLength = dot(direction, direction);
+    if(lineLength < 1e-8)
+        return;
+    int samples = textureSize(scattering, 0).x;
+    float position = clamp(dot(TexCoords - line.xy, direction) / lineLength, 0.0, 1.0) * float(samples) - 0.5;
+    int base = int(floor(position));
+    float f = fract(position);
+    for(int i = 0; i < 2; ++i)
+    {
+        vec4 texel = texelFetch(scattering, ivec2(clamp(base + i, 0, samples - 1), slice), 0);
+        float weight = sliceWeight * (i == 0 ? 1.0 - f : f) / (1e-3 + abs(texel.a - depth) / depth);
+        sum += texel.rgb * weight;
+        totalWeight += weight;
+    }
+}
+
+void main()
+{
+    float depth = LinearizeDepth(textureLod(sceneDepth, TexCoords, 0.0).r);
+
+    // the epipolar line through the pixel leaves the screen at border, which picks the slices
+    vec2 direction = TexCoords - sunPosition;
+    direction = mix(direction, vec2(1e-6), lessThan(abs(direction), vec2(1e-6)));
+    vec2 toEdge = (step(0.0, direction) - TexCoords) / direction;
+    vec2 border = clamp(TexCoords + direction * min(toEdge.x, toEdge.y), 0.0, 1.0);
+
+    int lines = textureSize(scattering, 0).y;
+    float slice = BorderPosition(border) / 4.0 * float(lines) - 0.5;
+    int first = int(floor(slice));
+    float f = fract(slice);
+
+    vec3 sum = vec3(0.0);
+    float totalWeight = 0.0;
+    AddSlice((first + lines) % lines, 1.0 - f, depth, sum, totalWeight);
+    AddSlice((first + 1) % lines, f, depth, sum, totalWeight);
+    color = vec4(sum / max(totalWeight, 1e-5), 1.0);
+}
@@ -0,0 +1,144 @@
+#version 330 core
+
+#define REFERENCE_SAMPLES 50.0f
+#define G_SCATTERING 0.2f
+#define PI 3.14159f
+#define TAU 0.00002f
+#define MAX_STEPS 512
+
+in vec2 TexCoords;
+// rgb: scattering, a: linear view depth of the sample
+out vec4 color;
+
+//view and directional light
+uniform vec3 viewPos;
+uniform vec3 lightPos;
+uniform vec3 lightColor;
+uniform float lightInt;
+
+uniform mat4 lightSpaceMatrix;
+
+//full resolution scene depth, rays are marched up to the visible surface
+uniform sampler2D sceneDepth;
+uniform mat4 inverseViewProjection;
+uniform float nearPlane;
+uniform float farPlane;
+uniform float maxDistance;
+
+// per epipolar slice, row 0: (entry.xy, exit.xy) of the line on screen,
+// row 1: (origin.xy, extent.xy) of the matching line in shadow map uv
+uniform sampler2D slices;
+// min/max shadow depth trees of every slice, see epipolar_minmax.fs
+uniform sampler2D minMaxTree;
+uniform int treeSize;
+uniform int treeLevels;
+
+float ComputeScattering(float lightDotView)
+{
+  float numerator = 1.0f - G_SCATTERING * G_SCATTERING;
+  float denominator = (4.0f * PI * pow(1.0f + G_SCATTERING * G_SCATTERING - (2.0f * G_SCATTERING *  lightDotView), 1.5f));
+  return numerator/denominator;
+}
+
+float LinearizeDepth(float depth)
+{
+  float z = depth * 2.0 - 1.0;
+  return (2.0 * nearPlane * farPlane) / (farPlane + nearPlane - z * (farPlane - nearPlane));
+}
+
+// Lit length of the ray between tree positions x0 and x1 (in samples), its light depth going
+// linearly from z0 to z1. Nodes the ray is entirely in front of or behind are resolved at once,
+// only the nodes it crosses are refined.
+float LitLength(int slice, float x0, float x1, float z0, float z1)
+{
+  float dz = (z1 - z0) / (x1 - x0);
+  // outside of the shadow map everything is lit
+  float lit = max(min(x1, 0.0) - x0, 0.0) + max(x1 - max(x0, float(treeSize)), 0.0);
+
+  int level = treeLevels;
+  int index = 0;
+  for(int i = 0; i < MAX_STEPS; ++i)
+  {
+    float a = float(index << level);
+    float b = float((index + 1) << level);
+    if(a >= min(x1, float(treeSize)))
+      break;
+
+    float segA = max(a, x0);
+    float segB = min(b, x1);
+    bool resolved = true;
+    if(segB > segA)
+    {
+      vec2 bounds = texelFetch(minMaxTree, ivec2(2 * treeSize - ((2 * treeSize) >> level) + index, slice), 0).rg;
+      float za = z0 + (segA - x0) * dz;
+      float zb = z0 + (segB - x0) * dz;
+      float zMin = min(za, zb);
+      float zMax = max(za, zb);
+      // in front of every caster of the node: lit, behind all of them: shadowed
+      if(zMax <= bounds.x)
+        lit += segB - segA;
+      else if(zMin <= bounds.y)
+      {
+        if(level == 0)
+          lit += (segB - segA) * clamp((0.5 * (bounds.x + bounds.y) - zMin) / max(zMax - zMin, 1e-6), 0.0, 1.0);
+        else
+          resolved = false;
+      }
+    }
+
+    if(resolved)
+    {
+      // next node to the right, climbing up while leaving a right child
+      index++;
+      while((index & 1) == 0 && level < treeLevels)
+      {
+        index >>= 1;
+        level++;
+      }
+    }
+    else
+    {
+      level--;
+      index *= 2;
+    }
+  }
+  return lit;
+}
+
+void main()
+{
+  int slice = int(gl_FragCoord.y);
+  vec4 screenLine = texelFetch(slices, ivec2(slice, 0), 0);
+  vec4 shadowLine = texelFetch(slices, ivec2(slice, 1), 0);
+
+  // reconstruct the visible surface at this sample of the epipolar line
+  vec2 coords = mix(screenLine.xy, screenLine.zw, TexCoords.x);
+  float depth = textureLod(sceneDepth, coords, 0.0).r;
+  vec4 surface = inverseViewProjection * vec4(vec3(coords, depth) * 2.0 - 1.0, 1.0);
+  vec3 rayVector = surface.xyz / surface.w - viewPos;
+  float rayLength = min(length(rayVector), maxDistance);
+  vec3 rayDirection = normalize(rayVector);
+  float mie_phase = ComputeScattering(dot(rayDirection, normalize(lightPos)));
+
+  // the ray projects onto the slice's shadow map line, its light depth varies linearly along it
+  vec3 start = (lightSpaceMatrix * vec4(viewPos, 1.0)).xyz * 0.5 + 0.5;
+  vec3 end = (lightSpaceMatrix * vec4(viewPos + rayDirection * rayLength, 1.0)).xyz * 0.5 + 0.5;
+  float litFraction = 1.0;
+  float extentLength = dot(shadowLine.zw, shadowLine.zw);
+  if(extentLength > 0.0)
+  {
+    float x0 = dot(start.xy - shadowLine.xy, shadowLine.zw) / extentLength * float(treeSize);
+    float x1 = dot(end.xy - shadowLine.xy, shadowLine.zw) / extentLength * float(treeSize);
+    if(x1 - x0 > 1e-3)
+      litFraction = LitLength(slice, x0, x1, start.z, end.z) / (x1 - x0);
+    else if(x0 >= 0.0 && x0 < float(treeSize))
+    {
+      // ray along the light direction: lit down to the caster depth at that single sample
+      vec2 bounds = texelFetch(minMaxTree, ivec2(int(x0), slice), 0).rg;
+      litFraction = clamp((0.5 * (bounds.x + bounds.y) - start.z) / max(end.z - start.z, 1e-6), 0.0, 1.0);
+    }
+  }
+
+  vec3 scattering = (exp(- rayLength * TAU) / REFERENCE_SAMPLES + mie_phase * litFraction) * lightColor;
+  color = vec4(6 * scattering * lightInt, LinearizeDepth(depth));
+}
@@ -0,0 +1,47 @@
+#version 330 core
+out vec2 minMax;
+
+// raw shadow map depth, depth compare disabled
+uniform sampler2D shadowDepth;
+// per epipolar slice, row 1: (origin.xy, extent.xy) of its line in shadow map uv
+uniform sampler2D slices;
+// samples taken along each line, a power of two
+uniform int treeSize;
+
+// Every row holds the 1D min/max tree of one slice: level 0 (treeSize nodes) first, then each
+// coarser level with half as many nodes. A node stores the min and max shadow depth over its samples.
+void main()
+{
+    int texel = int(gl_FragCoord.x);
+    int slice = int(gl_FragCoord.y);
+
+    int level = 0;
+    while(level < 30 && texel >= 2 * treeSize - (treeSize >> level))
+        level++;
+    int index = texel - (2 * treeSize - ((2 * treeSize) >> level));
+
+    vec4 line = texelFetch(slices, ivec2(slice, 1), 0);
+    if(dot(line.zw, line.zw) == 0.0)
+    {
+        // the slice misses the shadow map: everything on it is lit
+        minMax = vec2(1.0);
+        return;
+    }
+
+    ivec2 size = textureSize(shadowDepth, 0);
+    minMax = vec2(1.0, 0.0);
+    for(int i = index << level; i < (index + 1) << level; ++i)
+    {
+        // the 4 texels bilinear filtering would touch, so the bounds stay conservative
+        vec2 coords = (line.xy + line.zw * (float(i) + 0.5) / float(treeSize)) * vec2(size) - 0.5;
+        ivec2 base = ivec2(floor(coords));
+        for(int y = 0; y < 2; ++y)
+        {
+            for(int x = 0; x < 2; ++x)
+            {
+                float depth = texelFetch(shadowDepth, clamp(base + ivec2(x, y), ivec2(0), size - 1), 0).r;
+                minMax = vec2(min(minMax.x, depth), max(minMax.y, depth));
+            }
+        }
+    }
+}
@@ -0,0 +1,24 @@
+#version 330 core
+in vec2 TexCoords;
+out vec2 moments;
+
+uniform sampler2D depthMap;
+uniform float exponent;
+
+vec2 WarpDepth(float depth)
+{
+    float warped = exp(exponent * depth);
+    return vec2(warped, warped * warped);
+}
+
+void main()
+{
+    // The depth map is larger than the moments target: average 4 depth taps spread over
+    // the output texel, in moment space so the result stays filterable
+    vec2 offset = 0.25 * fwidth(TexCoords);
+    moments  = WarpDepth(texture(depthMap, TexCoords + vec2(-offset.x, -offset.y)).r);
+    moments += WarpDepth(texture(depthMap, TexCoords + vec2( offset.x, -offset.y)).r);
+    moments += WarpDepth(texture(depthMap, TexCoords + vec2(-offset.x,  offset.y)).r);
+    moments += WarpDepth(texture(depthMap, TexCoords + vec2( offset.x,  offset.y)).r);
+    moments *= 0.25;
+}
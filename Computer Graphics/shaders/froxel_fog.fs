@@ -0,0 +1,89 @@
+#version 330 core
+
+#define G_SCATTERING 0.2f
+#define PI 3.14159f
+
+#include "lighting.glsl"
+
+in vec2 TexCoords;
+// rgb: light scattered towards the camera from the camera up to the far side of this froxel,
+// a: transmittance over the same distance. Written to the running sum and to the volume slice.
+layout (location = 0) out vec4 accumulation;
+layout (location = 1) out vec4 integrated;
+
+//view, the lights and their shadows come with lighting.glsl
+uniform vec3 viewPos;
+uniform mat4 lightSpaceMatrix;
+
+//froxel being integrated
+uniform mat4 inverseViewProjection;
+uniform float cameraFar;
+uniform float fogNear;
+uniform float fogFar;
+uniform int slice;
+uniform int sliceCount;
+uniform float density;
+uniform float fogIntensity;
+//integration up to the previous slice
+uniform sampler2D previous;
+
+float ComputeScattering(float lightDotView)
+{
+  float numerator = 1.0f - G_SCATTERING * G_SCATTERING;
+  float denominator = (4.0f * PI * pow(1.0f + G_SCATTERING * G_SCATTERING - (2.0f * G_SCATTERING *  lightDotView), 1.5f));
+  return numerator/denominator;
+}
+
+// View depth of a slice boundary, slices are distributed exponentially
+float SliceDepth(float s)
+{
+  return fogNear * pow(fogFar / fogNear, s / float(sliceCount));
+}
+
+float Attenuation(float constant, float linear, float quadratic, float distance)
+{
+  return 1.0f / (constant + linear * distance + quadratic * (distance * distance));
+}
+
+void main()
+{
+  // view ray through the froxel, scaled so that one unit along it is one unit of view depth
+  vec4 farPoint = inverseViewProjection * vec4(TexCoords * 2.0 - 1.0, 1.0, 1.0);
+  vec3 ray = (farPoint.xyz / farPoint.w - viewPos) / cameraFar;
+  vec3 viewDir = normalize(ray);
+  float nearDepth = SliceDepth(float(slice));
+  float farDepth = SliceDepth(float(slice + 1));
+  vec3 position = viewPos + ray * 0.5 * (nearDepth + farDepth);
+
+  // - Inject the light every source scatters towards the camera at the froxel's centre
+  vec3 lightDir = normalize(lightPos);
+  float sunVisibility = 1.0 - ShadowCalculation(lightSpaceMatrix * vec4(position, 1.0));
+  vec3 inScattering = ComputeScattering(dot(viewDir, lightDir)) * sunVisibility * lightColor * lightInt;
+  if(pointLight.intensity > 0)
+  {
+    vec3 toLight = pointLight.position - position;
+    float attenuation = Attenuation(pointLight.constant, pointLight.linear, pointLight.quadratic, length(toLight));
+    float visibility = pointLightHasShadow ? 1.0 - PointShadowCalculation(position) : 1.0;
+    inScattering += ComputeScattering(dot(viewDir, -normalize(toLight))) * visibility
+      * attenuation * pointLight.intensity * pointLight.color;
+  }
+  if(spotLight.intensity > 0)
+  {
+    vec3 toLight = spotLight.position - position;
+    float attenuation = Attenuation(spotLight.constant, spotLight.linear, spotLight.quadratic, length(toLight));
+    float theta = dot(normalize(toLight), normalize(-spotLight.direction));
+    float cone = clamp((theta - spotLight.outerCutOff) / (spotLight.cutOff - spotLight.outerCutOff), 0.0, 1.0);
+    float visibility = spotLightHasShadow ? 1.0 - AtlasShadowCalculation(spotLightShadow, spotLightTile, position) : 1.0;
+    inScattering += ComputeScattering(dot(viewDir, -normalize(toLight))) * visibility
+      * attenuation * cone * spotLight.intensity * spotLight.color;
+  }
+  inScattering *= fogIntensity * density;
+
+  // - Integrate the froxel analytically, assuming constant light and density across it
+  vec4 before = slice == 0 ? vec4(0.0, 0.0, 0.0, 1.0) : texelFetch(previous, ivec2(gl_FragCoord.xy), 0);
+  float stepLength = (farDepth - nearDepth) * length(ray);
+  float transmittance = exp(-density * stepLength);
+  vec3 scattered = (inScattering - inScattering * transmittance) / density;
+  accumulation = vec4(before.rgb + before.a * scattered, before.a * transmittance);
+  integrated = accumulation;
+}
@@ -0,0 +1,20 @@
+#version 330 core
+in vec2 TexCoords;
+out vec4 color;
+
+uniform sampler2D image;
+uniform vec2 direction;	// one texel along the blur axis
+
+// 9-tap Gaussian folded into 5 bilinear fetches
+const float offsets[3] = float[](0.0, 1.3846153846, 3.2307692308);
+const float weights[3] = float[](0.2270270270, 0.3162162162, 0.0702702703);
+
+void main()
+{
+    color = textureLod(image, TexCoords, 0.0) * weights[0];
+    for(int i = 1; i < 3; ++i)
+    {
+        color += textureLod(image, TexCoords + direction * offsets[i], 0.0) * weights[i];
+        color += textureLod(image, TexCoords - direction * offsets[i], 0.0) * weights[i];
+    }
+}
@@ -0,0 +1,42 @@
+#version 330 core
+
+// Material variant, defined by the mesh for the maps it has:
+// HAS_NORMAL_MAP, HAS_SPECULAR_MAP. Lightmaps are left out, the G-buffer pass ignores HAS_LIGHTMAP.
+
+// G-buffer of the deferred path, 8 bytes per pixel next to the depth the position is rebuilt from
+layout (location = 0) out vec4 albedoSpecular;	// rgb albedo, stored sRGB; a specular
+layout (location = 1) out vec2 packedNormal;	// world normal folded onto an octahedron
+
+in VS_OUT {
+    vec3 FragPos;
+    vec3 Normal;
+    vec2 TexCoords;
+    vec4 FragPosLightSpace;
+	mat3 TBN;
+	vec2 LightmapCoords;
+} fs_in;
+
+uniform sampler2D texture_diffuse1;
+uniform sampler2D texture_specular1;
+uniform sampler2D texture_normal1;
+
+#include "normal_encoding.glsl"
+
+void main()
+{
+	vec3 normal = normalize(fs_in.Normal);
+#ifdef HAS_NORMAL_MAP
+	normal = vec3(texture(texture_normal1, fs_in.TexCoords));
+	normal = normalize(normal * 2.0 - 1.0);
+	normal = normalize(fs_in.TBN * normal);
+#endif
+
+#ifdef HAS_SPECULAR_MAP
+	float specular = dot(vec3(texture(texture_specular1, fs_in.TexCoords)), vec3(1.0 / 3.0));
+#else
+	float specular = 0.0;
+#endif
+
+	albedoSpecular = vec4(vec3(texture(texture_diffuse1, fs_in.TexCoords)), specular);
+	packedNormal = EncodeNormal(normal);
+}
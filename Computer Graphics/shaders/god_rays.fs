@@ -1,19 +1,22 @@
 #version 330 core
 
-#define NUM_SAMPLES 50.0f //antilag
+// tuning constants, a variant can override them
+#ifndef NUM_SAMPLES
+#define NUM_SAMPLES 16.0f //few samples, the jittered start and the history fill in the rest
+#endif
+#define REFERENCE_SAMPLES 50.0f
+#ifndef G_SCATTERING
 #define G_SCATTERING 0.2f
+#endif
 #define PI 3.14159f
+#ifndef TAU
 #define TAU 0.00002f
+#endif
 
+in vec2 TexCoords;
+// rgb: scattering accumulated over the previous frames, a: linear view depth it was computed at
 out vec4 color;
 
-in VS_OUT {
-    vec3 FragPos;
-    vec3 Normal;
-    vec2 TexCoords;
-    
-} fs_in;
-
 //view and directional light
 uniform vec3 viewPos;
 uniform vec3 lightPos;
@@ -21,10 +24,28 @@ uniform vec3 lightColor;
 uniform float lightInt;
 
 //shadow map
-uniform sampler2D shadowMap;
+uniform sampler2DShadow shadowMap;
+//prefiltered exponential variance shadow map
+uniform sampler2D evsmMap;
+uniform float evsmExponent;
+uniform bool useEVSM;
 
 uniform mat4 lightSpaceMatrix;
 
+//full resolution scene depth, rays are marched up to the visible surface
+uniform sampler2D sceneDepth;
+uniform mat4 inverseViewProjection;
+uniform float nearPlane;
+uniform float farPlane;
+uniform float maxDistance;
+
+//temporal accumulation
+uniform sampler2D history;
+uniform mat4 previousViewProjection;
+uniform bool historyValid;
+uniform float historyWeight;
+uniform int frame;
+
 float ComputeScattering(float lightDotView)
 {
   float numerator = 1.0f - G_SCATTERING * G_SCATTERING;
@@ -32,22 +53,51 @@ float ComputeScattering(float lightDotView)
   return numerator/denominator;
 }
 
+// Fraction of light reaching a point according to the prefiltered EVSM
+float EVSMVisibility(vec3 projCoords)
+{
+  vec2 moments = textureLod(evsmMap, projCoords.xy, 0.0).xy;
+  float warpedDepth = exp(evsmExponent * projCoords.z);
+  float depthScale = 0.0001 * evsmExponent * warpedDepth;
+  float variance = max(moments.y - moments.x * moments.x, depthScale * depthScale);
+  float d = warpedDepth - moments.x;
+  float pMax = clamp((variance / (variance + d * d) - 0.2) / 0.8, 0.0, 1.0);
+  return warpedDepth <= moments.x ? 1.0 : pMax;
+}
+
+// Interleaved gradient noise (Jimenez 2014), shifted every frame so consecutive frames
+// sample different offsets along each ray
+float InterleavedGradientNoise(vec2 pixel)
+{
+  pixel += 5.588238f * float(frame % 64);
+  return fract(52.9829189f * fract(dot(pixel, vec2(0.06711056f, 0.00583715f))));
+}
+
+float LinearizeDepth(float depth)
+{
+  float z = depth * 2.0 - 1.0;
+  return (2.0 * nearPlane * farPlane) / (farPlane + nearPlane - z * (farPlane - nearPlane));
+}
+
 void main()
 {
-  vec3 rayVector = fs_in.FragPos - viewPos;
+  // reconstruct the visible surface from the depth buffer
+  float depth = textureLod(sceneDepth, TexCoords, 0.0).r;
+  vec4 surface = inverseViewProjection * vec4(vec3(TexCoords, depth) * 2.0 - 1.0, 1.0);
+  vec3 fragPos = surface.xyz / surface.w;
+
+  vec3 rayVector = fragPos - viewPos;
 
-  float rayLength = length(rayVector);
-  vec3 rayDirection = rayVector / rayLength;
+  float rayLength = min(length(rayVector), maxDistance);
+  vec3 rayDirection = normalize(rayVector);
   vec3 lightDir = normalize(lightPos);
   float mie_phase = ComputeScattering(dot(rayDirection, lightDir));
   float stepSize = rayLength / NUM_SAMPLES;
 
-  vec3 currentPosition = viewPos;
+  vec3 currentPosition = viewPos + stepSize * InterleavedGradientNoise(gl_FragCoord.xy) * rayDirection;
 
-   //total light contribution accumulated along the ray
-  float L_insc = 1.0f * exp(- rayLength * TAU);
-  float prev_ins = 1.0f;
-  float curr_ins = 0.0f;
+   //light scattered towards the viewer along the ray
+  float inScattering = 0.0f;
 
   //start the actual ray marching
   for(int i = 0; i < NUM_SAMPLES; i++)
@@ -57,17 +107,26 @@ void main()
     vec3 sample = sampleLS.xyz / sampleLS.w;
     sample = sample * 0.5f + 0.5f;
 
-    float shadowMapValue = texture(shadowMap, sample.xy).r;
-	float d = stepSize * i; //travelled distance on the ray
-    curr_ins = exp(- d * TAU);
-    if (shadowMapValue > sample.z){
-      L_insc += mie_phase;
-    }
-    
-	prev_ins = curr_ins;
+    // hardware depth compare: 1.0 when the sample is lit, filtered across the 2x2 footprint
+    float lit = useEVSM ? EVSMVisibility(sample) : texture(shadowMap, sample);
+    inScattering += mie_phase * lit;
+
 	currentPosition += stepSize * rayDirection;
   }
-  //vec3 scattering = L_insc * mie_phase * lightColor;
-  vec3 scattering = L_insc / NUM_SAMPLES * lightColor;
-  color = 6 * vec4(scattering, 1.0f) * lightInt;
+  // the unattenuated term keeps the weight it had with the reference sample count
+  vec3 scattering = (exp(- rayLength * TAU) / REFERENCE_SAMPLES + inScattering / NUM_SAMPLES) * lightColor;
+  scattering = 6 * scattering * lightInt;
+
+  // blend with where the surface was last frame, unless it was hidden or off screen then
+  float linearDepth = LinearizeDepth(depth);
+  vec4 previous = previousViewProjection * vec4(fragPos, 1.0);
+  vec2 previousCoords = previous.xy / previous.w * 0.5 + 0.5;
+  if(historyValid && all(greaterThanEqual(previousCoords, vec2(0.0))) && all(lessThanEqual(previousCoords, vec2(1.0))))
+  {
+    vec4 past = textureLod(history, previousCoords, 0.0);
+    // the history stores its own depth: reject it when it belongs to another surface
+    if(abs(past.a - previous.w) < 0.1 * previous.w)
+      scattering = mix(scattering, past.rgb, historyWeight);
+  }
+  color = vec4(scattering, linearDepth);
 }
@@ -1,23 +0,0 @@
-#version 330 core
-layout (location = 0) in vec3 position;
-layout (location = 1) in vec3 normal;
-layout (location = 2) in vec2 texCoords;
-
-out VS_OUT {
-    vec3 FragPos;
-    vec3 Normal;
-    vec2 TexCoords;
-} vs_out;
-
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
-
-void main()
-{
-    gl_Position = projection * view * model * vec4(position, 1.0f);
-	vs_out.FragPos = vec3(model * vec4(position, 1.0f)); //world space coordinates
-	vs_out.Normal = transpose(inverse(mat3(model))) * normal;
-    vs_out.TexCoords = texCoords;
-    
-}
@@ -0,0 +1,35 @@
+#version 330 core
+
+// Adds one lamp to the pixels its volume covers, blended on top of the deferred lighting
+out vec4 color;
+
+flat in int lamp;
+
+uniform samplerBuffer lamps;
+uniform sampler2D gAlbedoSpecular;
+uniform sampler2D gNormal;
+uniform sampler2D gDepth;
+uniform mat4 inverseViewProjection;
+uniform vec3 viewPos;
+
+#include "lighting.glsl"
+#include "normal_encoding.glsl"
+
+void main()
+{
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+	float depth = texelFetch(gDepth, pixel, 0).r;
+	vec2 texCoords = gl_FragCoord.xy / vec2(textureSize(gDepth, 0));
+	vec4 position = inverseViewProjection * vec4(vec3(texCoords, depth) * 2.0 - 1.0, 1.0);
+	vec3 fragPos = position.xyz / position.w;
+
+	// the volume only bounds the lamp on screen, the pixel may still be in front of or behind it
+	vec4 positionRange = texelFetch(lamps, lamp);
+	if(depth == 1.0 || length(positionRange.xyz - fragPos) >= positionRange.w)
+		discard;
+
+	vec4 albedoSpecular = texelFetch(gAlbedoSpecular, pixel, 0);
+	vec3 normal = DecodeNormal(texelFetch(gNormal, pixel, 0).rg);
+	vec3 viewDir = normalize(viewPos - fragPos);
+	color = vec4(ComputeLamp(lamps, lamp, normal, fragPos, viewDir, albedoSpecular.rgb, vec3(albedoSpecular.a)), 1.0);
+}
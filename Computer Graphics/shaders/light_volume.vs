@@ -0,0 +1,17 @@
+#version 330 core
+layout (location = 0) in vec3 position;
+
+// One instance per lamp, 4 texels each as ClusteredLights stores them, and the lamp's bounding
+// sphere as ClusteredLights computed it for the clusters
+uniform samplerBuffer lampBounds;
+uniform mat4 projection;
+uniform mat4 view;
+
+flat out int lamp;
+
+void main()
+{
+	lamp = gl_InstanceID * 4;
+	vec4 bounds = texelFetch(lampBounds, gl_InstanceID);
+	gl_Position = projection * view * vec4(bounds.xyz + position * bounds.w, 1.0);
+}
@@ -0,0 +1,310 @@
+// Lighting shared by the forward and the deferred path: the sun, the shadowed point and spot
+// light and the clustered lamps. The froxel fog uses its lights and shadow lookups too. Shader inserts it where a shader has #include "lighting.glsl",
+// after the variant's defines, so they still override the PCF defaults below.
+
+// PCF filtering, selected at compile time, the variant can override the defaults.
+// Every tap is a hardware depth compare, so a single tap already filters a 2x2 texel footprint.
+#define PCF_GRID 0				// taps on a regular grid, one texel apart
+#define PCF_POISSON 1			// taps on a Poisson disk
+#define PCF_ROTATED_POISSON 2	// Poisson disk rotated per pixel, trades banding for noise
+#ifndef PCF_PATTERN
+#define PCF_PATTERN PCF_GRID
+#endif
+#ifndef PCF_TAPS
+#define PCF_TAPS 4				// grid: 1, 4, 9 or 16; Poisson: 1 to 16
+#endif
+#ifndef PCF_RADIUS
+#define PCF_RADIUS 1.5			// Poisson disk radius in texels
+#endif
+
+#if PCF_TAPS >= 16
+#define PCF_GRID_SIDE 4
+#elif PCF_TAPS >= 9
+#define PCF_GRID_SIDE 3
+#elif PCF_TAPS >= 4
+#define PCF_GRID_SIDE 2
+#else
+#define PCF_GRID_SIDE 1
+#endif
+
+struct PointLight {
+	vec3 position;
+	vec3 color;
+	float intensity;
+
+	float constant;
+	float linear;
+	float quadratic;
+};
+
+struct SpotLight {
+	 vec3 position;
+	 vec3 direction;
+	 vec3 color;
+	 float intensity;
+
+	 float cutOff;
+	 float outerCutOff;
+	 float constant;
+	 float linear;
+	 float quadratic;
+};
+
+//directional light
+uniform vec3 lightPos;
+uniform vec3 lightColor;
+uniform float lightInt;
+uniform vec3 ambientColor;	// sky light from above, follows the sun's elevation
+
+//shadows
+uniform sampler2DShadow shadowMap;
+uniform sampler2D evsmMap;
+
+//exponential variance shadow map
+uniform bool useEVSM;
+uniform float evsmExponent;
+
+//lights
+uniform PointLight pointLight;
+uniform SpotLight spotLight;
+
+//shadow atlas of the local lights, matrices map world space straight into the light's tile
+uniform sampler2DShadow shadowAtlas;
+uniform samplerCubeShadow pointShadowMap;
+uniform bool pointLightHasShadow;
+uniform float pointShadowNear;
+uniform float pointShadowFar;
+uniform bool spotLightHasShadow;
+uniform mat4 spotLightShadow;
+uniform vec4 spotLightTile;
+
+#if PCF_PATTERN != PCF_GRID
+const vec2 poissonDisk[16] = vec2[](
+	vec2(-0.94201624, -0.39906216), vec2(0.94558609, -0.76890725),
+	vec2(-0.09418410, -0.92938870), vec2(0.34495938, 0.29387760),
+	vec2(-0.91588581, 0.45771432), vec2(-0.81544232, -0.87912464),
+	vec2(-0.38277543, 0.27676845), vec2(0.97484398, 0.75648379),
+	vec2(0.44323325, -0.97511554), vec2(0.53742981, -0.47373420),
+	vec2(-0.26496911, -0.41893023), vec2(0.79197514, 0.19090188),
+	vec2(-0.24188840, 0.99706507), vec2(-0.81409955, 0.91437590),
+	vec2(0.19984126, 0.78641367), vec2(0.14383161, -0.14100790)
+);
+#endif
+
+float ShadowCalculation(vec4 fragPosLightSpace)
+{
+    // perform perspective divide
+    vec3 projCoords = fragPosLightSpace.xyz / fragPosLightSpace.w;
+    // Transform to [0,1] range
+    projCoords = projCoords * 0.5 + 0.5;
+    // Keep the shadow at 0.0 when outside the far_plane region of the light's frustum.
+    if(projCoords.z > 1.0)
+        return 0.0;
+    // Depth of current fragment from light's perspective, biased to avoid acne
+    float bias = 0.0005;
+    float currentDepth = projCoords.z - bias;
+    // PCF: each texture() call compares and bilinearly filters 4 texels in hardware
+    float lit = 0.0;
+    vec2 texelSize = 1.0 / textureSize(shadowMap, 0);
+#if PCF_PATTERN == PCF_GRID
+    const float start = -0.5 * float(PCF_GRID_SIDE - 1);
+    for(int x = 0; x < PCF_GRID_SIDE; ++x)
+    {
+        for(int y = 0; y < PCF_GRID_SIDE; ++y)
+        {
+            vec2 offset = vec2(start + float(x), start + float(y)) * texelSize;
+            lit += texture(shadowMap, vec3(projCoords.xy + offset, currentDepth));
+        }
+    }
+    lit /= float(PCF_GRID_SIDE * PCF_GRID_SIDE);
+#else
+    mat2 rotation = mat2(1.0);
+#if PCF_PATTERN == PCF_ROTATED_POISSON
+    // Interleaved gradient noise gives a stable per-pixel rotation
+    float angle = 6.2831853 * fract(52.9829189 * fract(dot(gl_FragCoord.xy, vec2(0.06711056, 0.00583715))));
+    rotation = mat2(cos(angle), sin(angle), -sin(angle), cos(angle));
+#endif
+    for(int i = 0; i < PCF_TAPS; ++i)
+    {
+        vec2 offset = rotation * poissonDisk[i] * PCF_RADIUS * texelSize;
+        lit += texture(shadowMap, vec3(projCoords.xy + offset, currentDepth));
+    }
+    lit /= float(PCF_TAPS);
+#endif
+
+    return 1.0 - lit;
+}
+
+// Shadow from the prefiltered exponential variance shadow map: a single filtered fetch
+float EVSMShadowCalculation(vec4 fragPosLightSpace)
+{
+    vec3 projCoords = fragPosLightSpace.xyz / fragPosLightSpace.w;
+    projCoords = projCoords * 0.5 + 0.5;
+    if(projCoords.z > 1.0)
+        return 0.0;
+
+    vec2 moments = texture(evsmMap, projCoords.xy).xy;
+    float warpedDepth = exp(evsmExponent * projCoords.z);
+    // Chebyshev upper bound on the fraction of lit occluders
+    float depthScale = 0.0001 * evsmExponent * warpedDepth;
+    float variance = max(moments.y - moments.x * moments.x, depthScale * depthScale);
+    float d = warpedDepth - moments.x;
+    float pMax = variance / (variance + d * d);
+    // Light bleeding reduction: cut off the tail of the bound
+    pMax = clamp((pMax - 0.2) / 0.8, 0.0, 1.0);
+    float lit = warpedDepth <= moments.x ? 1.0 : pMax;
+
+    return 1.0 - lit;
+}
+
+
+// Shadow of a local light from its tile in the atlas
+float AtlasShadowCalculation(mat4 atlasMatrix, vec4 tileBounds, vec3 fragPos)
+{
+    vec4 fragPosAtlas = atlasMatrix * vec4(fragPos, 1.0);
+    vec3 projCoords = fragPosAtlas.xyz / fragPosAtlas.w;
+    if(projCoords.z > 1.0)
+        return 0.0;
+    // 4 bilinear compare taps, clamped so filtering never reads a neighbouring tile
+    vec2 texelSize = 1.0 / textureSize(shadowAtlas, 0);
+    float lit = 0.0;
+    for(int x = 0; x < 2; ++x)
+    {
+        for(int y = 0; y < 2; ++y)
+        {
+            vec2 coords = projCoords.xy + (vec2(x, y) - 0.5) * texelSize;
+            lit += texture(shadowAtlas, vec3(clamp(coords, tileBounds.xy, tileBounds.zw), projCoords.z));
+        }
+    }
+    return 1.0 - lit * 0.25;
+}
+
+// Shadow of the point light from its depth cube map
+float PointShadowCalculation(vec3 fragPos)
+{
+    vec3 lightToFrag = fragPos - pointLight.position;
+    // The face is picked by the major axis, whose length is the view depth in that face
+    vec3 a = abs(lightToFrag);
+    float viewDepth = max(a.x, max(a.y, a.z));
+    if(viewDepth > pointShadowFar)
+        return 0.0;
+    // Same depth the face's perspective projection wrote, mapped to [0,1]
+    float n = pointShadowNear;
+    float f = pointShadowFar;
+    float ndcDepth = (f + n) / (f - n) - (2.0 * f * n) / ((f - n) * viewDepth);
+    float depth = ndcDepth * 0.5 + 0.5 - 0.0005;
+    return 1.0 - texture(pointShadowMap, vec4(lightToFrag, depth));
+}
+
+// Sun and sky light, the sun shadowed from the PCF or the EVSM map
+vec3 ComputeSun(vec3 normal, vec3 viewDir, vec3 objectColor, vec3 specMap, vec4 fragPosLightSpace)
+{
+	vec3 lightDir = normalize(lightPos);
+
+	//Ambient
+	vec3 ambient = objectColor * ambientColor;
+
+	//Diffuse
+	float diff = max(dot(normal, lightDir),0.0);
+	vec3 diffuse = diff * objectColor * lightColor * lightInt;
+
+	//Specular
+	vec3 halfwayDir = normalize(lightDir + viewDir);
+	float spec = pow(max(dot(normal, halfwayDir), 0.0), 32.0);
+	vec3 specular = spec * specMap * lightColor * lightInt;
+
+	//shadows
+	float shadow = useEVSM ? EVSMShadowCalculation(fragPosLightSpace) : ShadowCalculation(fragPosLightSpace);
+	shadow = min(shadow, 0.75); // reduce shadow strength a little: allow some diffuse/specular light in shadowed regions
+	return (ambient + (1.0 - shadow) * (diffuse + specular));
+}
+
+vec3 ComputePoint(PointLight light, vec3 normal, vec3 fragPos, vec3 viewDir, vec3 objectColor, vec3 specMap, float shadow)
+{
+	float ambientStrength = 0.2f;
+	vec3 lightDir = normalize(light.position - fragPos);
+	// Diffuse
+  	float diff = max(dot(normal, lightDir), 0.0);
+  	// Specular
+	vec3 halfwayDir = normalize(lightDir + viewDir);
+  	float spec = pow(max(dot(normal, halfwayDir), 0.0), 32.0);
+
+  	// Attenuation
+  	float distance = length(light.position - fragPos);
+  	float attenuation = 1.0f / (light.constant + light.linear * distance + light.quadratic * (distance * distance));
+
+  	vec3 ambient = ambientStrength * objectColor;
+  	vec3 diffuse = light.intensity * diff * objectColor;
+  	vec3 specular = spec * specMap;
+
+  return ((ambient + (1.0 - shadow) * (diffuse + specular)) * attenuation * light.color);
+}
+
+vec3 ComputeSpot(SpotLight light, vec3 normal, vec3 fragPos, vec3 viewDir, vec3 objectColor, vec3 specMap, float shadow)
+{
+	float ambientStrength = 0.1f;
+	vec3 lightDir = normalize(light.position - fragPos);
+
+  	// Diffuse
+  	float diff = max(dot(normal, lightDir), 0.0);
+  	// Specular
+  	vec3 reflectDir = reflect(-lightDir, normal);
+  	float spec = pow(max(dot(viewDir, reflectDir), 0.0), 32);
+  	// Attenuation
+  	float distance = length(light.position - fragPos);
+  	float attenuation = 1.0f / (light.constant + light.linear * distance + light.quadratic * (distance * distance));
+  	// Spotlight intensity
+  	float theta = dot(lightDir, normalize(-light.direction));
+  	float epsilon = light.cutOff - light.outerCutOff;
+  	float intensity = clamp((theta - light.outerCutOff) / epsilon, 0.0, 1.0);
+
+  	vec3 ambient = ambientStrength * objectColor;
+  	vec3 diffuse = light.intensity * diff * objectColor;
+  	vec3 specular = spec * specMap;
+
+  	return ((ambient + (1.0 - shadow) * (diffuse + specular)) * attenuation * intensity);
+}
+
+// Point and spot light, each with its shadow when it has one
+vec3 ComputeLocal(vec3 normal, vec3 fragPos, vec3 viewDir, vec3 objectColor, vec3 specMap)
+{
+	vec3 light = vec3(0.0);
+	if(pointLight.intensity > 0)
+	{
+		float pointShadow = pointLightHasShadow ? PointShadowCalculation(fragPos) : 0.0;
+		light += ComputePoint(pointLight, normal, fragPos, viewDir, objectColor, specMap, pointShadow);
+	}
+	if(spotLight.intensity > 0)
+	{
+		float spotShadow = spotLightHasShadow ? AtlasShadowCalculation(spotLightShadow, spotLightTile, fragPos) : 0.0;
+		light += ComputeSpot(spotLight, normal, fragPos, viewDir, objectColor, specMap, spotShadow);
+	}
+	return light;
+}
+
+// Unshadowed lamp from 4 texels of lights, as ClusteredLights stores them. Points are stored as
+// spots with cut-offs no direction can fail.
+vec3 ComputeLamp(samplerBuffer lights, int lamp, vec3 normal, vec3 fragPos, vec3 viewDir, vec3 objectColor, vec3 specMap)
+{
+	vec4 positionRange = texelFetch(lights, lamp);
+	vec3 toLight = positionRange.xyz - fragPos;
+	float distance = length(toLight);
+	if(distance >= positionRange.w)
+		return vec3(0.0);
+	vec4 colorType = texelFetch(lights, lamp + 1);
+	vec4 directionOuter = texelFetch(lights, lamp + 2);
+	vec4 attenuationInner = texelFetch(lights, lamp + 3);
+	vec3 lightDir = toLight / distance;
+
+	float diff = max(dot(normal, lightDir), 0.0);
+	vec3 halfwayDir = normalize(lightDir + viewDir);
+	float spec = pow(max(dot(normal, halfwayDir), 0.0), 32.0);
+
+	float attenuation = 1.0f / (attenuationInner.x + attenuationInner.y * distance + attenuationInner.z * (distance * distance));
+	// Fade out the end of the range, past it the lamp is left out of the cluster lists and volumes
+	float window = clamp(1.0 - pow(distance / positionRange.w, 4.0), 0.0, 1.0);
+	float theta = dot(lightDir, -directionOuter.xyz);
+	float cone = clamp((theta - directionOuter.w) / (attenuationInner.w - directionOuter.w), 0.0, 1.0);
+
+	return (diff * objectColor + spec * specMap) * colorType.rgb * attenuation * window * window * cone;
+}
@@ -0,0 +1,21 @@
+// Normals of the G-buffer, written by gbuffer.fs and read back by the deferred lighting passes
+
+// Projects the unit normal on the octahedron |x| + |y| + |z| = 1 and folds the lower half over
+// the upper one, so the square [-1, 1]^2 covers every direction with an even precision
+vec2 EncodeNormal(vec3 n)
+{
+	n /= abs(n.x) + abs(n.y) + abs(n.z);
+	vec2 signs = vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+	vec2 folded = n.z >= 0.0 ? n.xy : (1.0 - abs(n.yx)) * signs;
+	return folded * 0.5 + 0.5;
+}
+
+// Inverse of EncodeNormal
+vec3 DecodeNormal(vec2 encoded)
+{
+	vec2 f = encoded * 2.0 - 1.0;
+	vec3 n = vec3(f, 1.0 - abs(f.x) - abs(f.y));
+	float t = clamp(-n.z, 0.0, 1.0);
+	n.xy -= vec2(n.x >= 0.0 ? t : -t, n.y >= 0.0 ? t : -t);
+	return normalize(n);
+}
@@ -0,0 +1,24 @@
+#version 330 core
+
+// Adds the probe light of a dynamic object on the deferred path, blended on top of the deferred
+// lighting. Drawn with the object's own geometry, only its pixels that won the G-buffer's depth
+// test are lit.
+out vec4 color;
+
+uniform sampler2D gAlbedoSpecular;
+uniform sampler2D gNormal;
+uniform sampler2D gDepth;
+
+#include "probes.glsl"
+#include "normal_encoding.glsl"
+
+void main()
+{
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+	// depth_prepass.vs and standard_shader.vs are invariant, the depth only differs by its 24 bit storage
+	if(gl_FragCoord.z > texelFetch(gDepth, pixel, 0).r + 1.0e-6)
+		discard;
+	vec3 objectColor = texelFetch(gAlbedoSpecular, pixel, 0).rgb;
+	vec3 normal = DecodeNormal(texelFetch(gNormal, pixel, 0).rg);
+	color = vec4(objectColor * max(ProbeIrradiance(normal), 0.0), 1.0);
+}
@@ -0,0 +1,15 @@
+// Indirect light of the static scene around a dynamic object, L2 SH blended from the probe grid
+// by IrradianceVolume. Read by the forward scene shader and by the deferred path's probe pass.
+
+layout(std140) uniform Probes {
+	vec4 probeIrradiance[9];
+};
+
+vec3 ProbeIrradiance(vec3 n)
+{
+	return probeIrradiance[0].rgb
+		+ probeIrradiance[1].rgb * n.y + probeIrradiance[2].rgb * n.z + probeIrradiance[3].rgb * n.x
+		+ probeIrradiance[4].rgb * (n.x * n.y) + probeIrradiance[5].rgb * (n.y * n.z)
+		+ probeIrradiance[6].rgb * (3.0 * n.z * n.z - 1.0) + probeIrradiance[7].rgb * (n.x * n.z)
+		+ probeIrradiance[8].rgb * (n.x * n.x - n.y * n.y);
+}
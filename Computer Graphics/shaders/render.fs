@@ -3,15 +3,48 @@ in vec2 TexCoords;
 out vec4 color;
 
 uniform sampler2D scene;
+// off when the scattering was blended into the scene already
+uniform bool useRays;
 uniform sampler2D rays;
 
+// froxel fog: rgb in-scattered light, a transmittance, from the camera to each froxel
+uniform bool useFog;
+uniform sampler3D fogVolume;
+uniform sampler2D sceneDepth;
+uniform float nearPlane;
+uniform float farPlane;
+uniform float fogNear;
+uniform float fogFar;
+
+// scene and scattering are linear HDR, mapped to the display here
+uniform float exposure;
+
+// Filmic curve fitted to the ACES reference transform (Narkowicz)
+vec3 ToneMap(vec3 x)
+{
+    return clamp((x * (2.51 * x + 0.03)) / (x * (2.43 * x + 0.59) + 0.14), 0.0, 1.0);
+}
 
 void main()
 {
 
-    vec4 render = texture(scene, TexCoords);
-	vec4 godRays = texture(rays, TexCoords);
+    vec3 hdr = texture(scene, TexCoords).rgb;
+    if(useRays)
+        hdr += texture(rays, TexCoords).rgb;
+
+    // the froxel mode has no rays target, the fog volume replaces it
+    if(useFog)
+    {
+        // one fetch: the slice is found from the pixel's view depth with the volume's exponential distribution
+        float z = texture(sceneDepth, TexCoords).r * 2.0 - 1.0;
+        float depth = (2.0 * nearPlane * farPlane) / (farPlane + nearPlane - z * (farPlane - nearPlane));
+        float slices = float(textureSize(fogVolume, 0).z);
+        float w = log(max(depth, fogNear) / fogNear) / log(fogFar / fogNear) - 0.5 / slices;
+        vec4 fog = texture(fogVolume, vec3(TexCoords, w));
+        hdr = hdr * fog.a + fog.rgb;
+    }
 
-    color =godRays + render;
+    // tonemap and gamma in the same pass, the sum never goes through an 8 bit target
+    color = vec4(pow(ToneMap(hdr * exposure), vec3(1.0 / 2.2)), 1.0);
     //color = vec4(0.5f, 0.5f, 0.5f, 1.0f);
 }
@@ -0,0 +1,38 @@
+#version 330 core
+#extension GL_ARB_viewport_array : require
+
+#define MAX_TILES 8
+
+layout (triangles) in;
+layout (triangle_strip, max_vertices = 24) out;
+
+// light view-projection of every tile, tile i is rendered into viewport i
+uniform mat4 tileMatrices[MAX_TILES];
+uniform int tileCount;
+
+void main()
+{
+    for(int tile = 0; tile < tileCount; ++tile)
+    {
+        // skip the tile when the whole triangle is outside one of its frustum planes
+        vec4 clip[3];
+        vec3 allAbove = vec3(1.0);
+        vec3 allBelow = vec3(1.0);
+        for(int i = 0; i < 3; ++i)
+        {
+            clip[i] = tileMatrices[tile] * gl_in[i].gl_Position;
+            allAbove *= step(clip[i].w, clip[i].xyz);
+            allBelow *= step(clip[i].xyz, vec3(-clip[i].w));
+        }
+        if(any(greaterThan(allAbove + allBelow, vec3(0.0))))
+            continue;
+
+        for(int i = 0; i < 3; ++i)
+        {
+            gl_ViewportIndex = tile;
+            gl_Position = clip[i];
+            EmitVertex();
+        }
+        EndPrimitive();
+    }
+}
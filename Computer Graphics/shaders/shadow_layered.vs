@@ -0,0 +1,10 @@
+#version 330 core
+layout (location = 0) in vec3 position;
+
+uniform mat4 model;
+
+void main()
+{
+    // world space, the geometry shader projects into every tile
+    gl_Position = model * vec4(position, 1.0f);
+}
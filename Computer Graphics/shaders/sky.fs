@@ -0,0 +1,60 @@
+#version 330 core
+
+// Sky dome behind the scene, from the same table the sun and ambient light are read from
+
+in vec2 TexCoords;
+out vec4 color;
+
+uniform sampler2D sceneDepth;
+uniform mat4 inverseViewProjection;
+uniform vec3 viewPos;
+
+// sky table: sky along view elevations x sun elevations, sun transmittance and sky irradiance below
+uniform sampler2D skyTable;
+uniform ivec2 skyTableSize;
+uniform vec3 rayleighScattering;
+uniform float mieG;
+
+// the light crossing the sky: the sun, or the moon scaled by skyScale
+uniform vec3 lightPos;
+uniform vec3 skyScale;
+uniform float sunDisk;
+
+const float PI = 3.14159265;
+
+// Texture coordinate of a sine of elevation on one of the table's axes, spread as sqrt(sin)
+float TableCoord(float elevationSin, int size)
+{
+	return (sqrt(clamp(elevationSin, 0.0, 1.0)) * float(size - 1) + 0.5) / float(size);
+}
+
+void main()
+{
+	// only where nothing was drawn
+	if(texture(sceneDepth, TexCoords).r < 1.0)
+		discard;
+	vec4 far = inverseViewProjection * vec4(TexCoords * 2.0 - 1.0, 1.0, 1.0);
+	vec3 viewDir = normalize(far.xyz / far.w - viewPos);
+	vec3 lightDir = normalize(lightPos);
+
+	int rows = skyTableSize.y + 2;
+	float u = TableCoord(lightDir.y, skyTableSize.x);
+	float v = TableCoord(viewDir.y, skyTableSize.y) * float(skyTableSize.y) / float(rows);
+	vec4 scattered = texture(skyTable, vec2(u, v));
+	// Mie is grey, only its red channel is stored: the rest follows Rayleigh's attenuation
+	vec3 mie = scattered.r > 0.0 ? scattered.rgb * (scattered.a / scattered.r) * (rayleighScattering.r / rayleighScattering) : vec3(0.0);
+
+	float c = dot(viewDir, lightDir);
+	float rayleighPhase = 3.0 / (16.0 * PI) * (1.0 + c * c);
+	float g2 = mieG * mieG;
+	float miePhase = 3.0 / (8.0 * PI) * (1.0 - g2) * (1.0 + c * c) / ((2.0 + g2) * pow(1.0 + g2 - 2.0 * mieG * c, 1.5));
+
+	// radiance times pi, the scale of the scene: a white surface facing the sun shades to its irradiance
+	vec3 sky = PI * (scattered.rgb * rayleighPhase + mie * miePhase);
+
+	// the disk itself, dimmed by the same transmittance as the sun's light
+	if(c > 0.99996)
+		sky += sunDisk * texture(skyTable, vec2(u, (float(skyTableSize.y) + 0.5) / float(rows))).rgb;
+
+	color = vec4(sky * skyScale, 1.0);
+}
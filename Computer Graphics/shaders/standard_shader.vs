@@ -3,6 +3,7 @@ layout (location = 0) in vec3 position;
 layout (location = 1) in vec3 normal;
 layout (location = 2) in vec2 texCoords;
 layout (location = 3) in vec3 tangent;
+layout (location = 4) in vec2 lightmapCoords;
 
 out VS_OUT {
     vec3 FragPos;
@@ -10,6 +11,7 @@ out VS_OUT {
     vec2 TexCoords;
     vec4 FragPosLightSpace;
 	mat3 TBN;
+	vec2 LightmapCoords;
 } vs_out;
 
 uniform mat4 model;
@@ -20,6 +22,9 @@ uniform mat4 lightSpaceMatrix;
 uniform vec3 lightPos;
 uniform vec3 viewPos;
 
+// The depth prepass computes the same position, GL_EQUAL needs bit identical depths
+invariant gl_Position;
+
 void main()
 {
     gl_Position = projection * view * model * vec4(position, 1.0f);
@@ -36,4 +41,5 @@ void main()
     vs_out.TexCoords = texCoords;
     vs_out.FragPosLightSpace = lightSpaceMatrix * vec4(vs_out.FragPos, 1.0);
 	vs_out.TBN = mat3(T, B, N);
+	vs_out.LightmapCoords = lightmapCoords;
 }
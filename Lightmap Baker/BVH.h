@@ -0,0 +1,202 @@
+#pragma once
+
+// Std. Includes
+#include <vector>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+// GL Includes
+#include "GLTypes.h"
+#include <glm/glm.hpp>
+
+#include "Bounds.h"
+
+
+// Bounding volume hierarchy over a triangle soup, for the CPU bakes. Nodes are split at the
+// median centroid along their longest axis and stored depth first, so a node's left child is
+// the next node. Only reads after Build, it can be traced from any number of threads at once.
+class BVH
+{
+public:
+	// Builds the hierarchy over triangles given as 3 consecutive vertices each
+	void Build(const std::vector<glm::vec3> &triangleVertices)
+	{
+		this->vertices = triangleVertices;
+		GLuint count = this->vertices.size() / 3;
+		this->order.resize(count);
+		this->centroids.resize(count);
+		for (GLuint i = 0; i < count; i++)
+		{
+			this->order[i] = i;
+			this->centroids[i] = (this->vertices[3 * i] + this->vertices[3 * i + 1] + this->vertices[3 * i + 2]) / 3.0f;
+		}
+		this->nodes.clear();
+		this->nodes.reserve(2 * count);
+		if (count > 0)
+			this->build(0, count);
+		this->centroids.clear();
+	}
+
+	// True when a triangle lies along the ray closer than maxDistance, stops at the first one found
+	bool Occluded(glm::vec3 origin, glm::vec3 direction, GLfloat maxDistance) const
+	{
+		GLfloat distance = maxDistance;
+		GLuint triangle;
+		glm::vec2 barycentrics;
+		return this->trace(origin, direction, distance, triangle, barycentrics, true);
+	}
+
+	// Closest triangle along the ray, its distance and the barycentric weights of its vertices 1 and 2
+	bool Intersect(glm::vec3 origin, glm::vec3 direction, GLfloat &distance, GLuint &triangle, glm::vec2 &barycentrics) const
+	{
+		distance = FLT_MAX;
+		return this->trace(origin, direction, distance, triangle, barycentrics, false);
+	}
+
+	GLuint TriangleCount() const
+	{
+		return this->vertices.size() / 3;
+	}
+
+	GLuint NodeCount() const
+	{
+		return this->nodes.size();
+	}
+
+private:
+	static const GLuint LEAF_SIZE = 4;
+	static const GLuint MAX_DEPTH = 64;
+
+	struct Node
+	{
+		AABB Bounds;
+		GLuint Start, Count;	// Triangles of a leaf in order, Count is 0 for inner nodes
+		GLuint Right;			// Right child of an inner node
+	};
+
+	std::vector<Node> nodes;
+	std::vector<glm::vec3> vertices;
+	std::vector<GLuint> order;
+	std::vector<glm::vec3> centroids;
+
+	GLuint build(GLuint start, GLuint end)
+	{
+		GLuint index = this->nodes.size();
+		this->nodes.push_back(Node());
+		AABB bounds, centroidBounds;
+		for (GLuint i = start; i < end; i++)
+		{
+			GLuint triangle = this->order[i];
+			for (GLuint j = 0; j < 3; j++)
+				bounds.Extend(this->vertices[3 * triangle + j]);
+			centroidBounds.Extend(this->centroids[triangle]);
+		}
+		this->nodes[index].Bounds = bounds;
+
+		glm::vec3 extent = centroidBounds.Max - centroidBounds.Min;
+		GLuint axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+		if (end - start <= LEAF_SIZE || extent[axis] <= 0.0f)
+		{
+			this->nodes[index].Start = start;
+			this->nodes[index].Count = end - start;
+			return index;
+		}
+
+		GLuint middle = (start + end) / 2;
+		const std::vector<glm::vec3> &centroids = this->centroids;
+		std::nth_element(this->order.begin() + start, this->order.begin() + middle, this->order.begin() + end,
+			[&](GLuint a, GLuint b) { return centroids[a][axis] < centroids[b][axis]; });
+		this->nodes[index].Count = 0;
+		this->build(start, middle);
+		GLuint right = this->build(middle, end);
+		this->nodes[index].Right = right;
+		return index;
+	}
+
+	// Slab test, the ray's parameter range entering and leaving the box overlaps [0, maxDistance].
+	// A zero direction component gives an infinite inverse, times a zero distance when the origin
+	// lies on that slab's plane: the NaN would make min and max depend on their argument order.
+	// The ray then runs along the plane, inside the closed slab, so that axis bounds nothing.
+	static bool hitsBox(const AABB &box, glm::vec3 origin, glm::vec3 inverseDirection, GLfloat maxDistance)
+	{
+		glm::vec3 t0 = (box.Min - origin) * inverseDirection;
+		glm::vec3 t1 = (box.Max - origin) * inverseDirection;
+		glm::vec3 entries = glm::min(t0, t1), exits = glm::max(t0, t1);
+		for (GLuint i = 0; i < 3; i++)
+		{
+			if (std::isnan(t0[i]) || std::isnan(t1[i]))
+			{
+				entries[i] = -FLT_MAX;
+				exits[i] = FLT_MAX;
+			}
+		}
+		GLfloat enter = glm::max(glm::max(entries.x, entries.y), glm::max(entries.z, 0.0f));
+		GLfloat exit = glm::min(glm::min(exits.x, exits.y), glm::min(exits.z, maxDistance));
+		return enter <= exit;
+	}
+
+	// Moller-Trumbore ray/triangle intersection
+	bool hitsTriangle(GLuint triangle, glm::vec3 origin, glm::vec3 direction, GLfloat &distance, glm::vec2 &barycentrics) const
+	{
+		const glm::vec3 &a = this->vertices[3 * triangle];
+		glm::vec3 edge1 = this->vertices[3 * triangle + 1] - a;
+		glm::vec3 edge2 = this->vertices[3 * triangle + 2] - a;
+		glm::vec3 p = glm::cross(direction, edge2);
+		GLfloat determinant = glm::dot(edge1, p);
+		if (std::fabs(determinant) < 1e-12f)
+			return false;
+		GLfloat inverse = 1.0f / determinant;
+		glm::vec3 s = origin - a;
+		GLfloat u = glm::dot(s, p) * inverse;
+		if (u < 0.0f || u > 1.0f)
+			return false;
+		glm::vec3 q = glm::cross(s, edge1);
+		GLfloat v = glm::dot(direction, q) * inverse;
+		if (v < 0.0f || u + v > 1.0f)
+			return false;
+		GLfloat t = glm::dot(edge2, q) * inverse;
+		if (t <= 0.0f || t >= distance)
+			return false;
+		distance = t;
+		barycentrics = glm::vec2(u, v);
+		return true;
+	}
+
+	bool trace(glm::vec3 origin, glm::vec3 direction, GLfloat &distance, GLuint &triangle, glm::vec2 &barycentrics, bool anyHit) const
+	{
+		if (this->nodes.empty())
+			return false;
+		glm::vec3 inverseDirection = 1.0f / direction;
+		GLuint stack[MAX_DEPTH];
+		GLuint depth = 0;
+		stack[depth++] = 0;
+		bool hit = false;
+		while (depth > 0)
+		{
+			const Node &node = this->nodes[stack[--depth]];
+			if (!hitsBox(node.Bounds, origin, inverseDirection, distance))
+				continue;
+			if (node.Count > 0)
+			{
+				for (GLuint i = node.Start; i < node.Start + node.Count; i++)
+				{
+					if (this->hitsTriangle(this->order[i], origin, direction, distance, barycentrics))
+					{
+						triangle = this->order[i];
+						hit = true;
+						if (anyHit)
+							return true;
+					}
+				}
+			}
+			else
+			{
+				GLuint left = &node - &this->nodes[0] + 1;
+				stack[depth++] = node.Right;
+				stack[depth++] = left;
+			}
+		}
+		return hit;
+	}
+};
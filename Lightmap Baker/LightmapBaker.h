@@ -0,0 +1,368 @@
+#pragma once
+
+// Std. Includes
+#include <string>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <cmath>
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+// GL Includes
+#include "GLTypes.h"
+#include <glm/glm.hpp>
+#include <assimp/Importer.hpp>
+#include <assimp/scene.h>
+#include <assimp/postprocess.h>
+
+// Other Libs, SOIL's image reader and DDS writer alone: the rest of SOIL needs a GL context
+#include <stb_image_aug.h>
+extern "C" {
+#include <image_DXT.h>
+}
+
+#include "Lights.h"
+#include "Bounds.h"
+#include "SceneGraph.h"
+#include "LightmapLayout.h"
+#include "BVH.h"
+
+
+// Offline bake of the static point and spot light into lightmaps, with soft shadows traced on
+// the CPU. Needs no window, no GL and nothing of the renderer but the shared headers. Each mesh of the model gets a layout and a DDS
+// lightmap in directory, next to the model. The light is computed as ComputePoint and
+// ComputeSpot do without their specular term: a surface shades to albedo * lightmap.
+// Once loaded, the scene also answers Radiance queries for the irradiance probe bake.
+class LightmapBaker
+{
+public:
+	// Constructor, shadows are softened over SHADOW_SAMPLES points on a sphere of lightRadius
+	LightmapBaker(GLfloat lightRadius = 0.05f, GLuint threads = std::thread::hardware_concurrency())
+		: LightRadius(lightRadius), Threads(std::max(threads, 1u))
+	{
+	}
+
+	GLfloat LightRadius;
+	GLuint Threads;
+
+	// Loads the model's geometry and materials, placed by model, and the lights it is baked with
+	bool Load(const std::string &path, const glm::mat4 &model, const PointLight &pointLight, const SpotLight &spotLight)
+	{
+		// - The geometry alone, in the order and with the flags Model uses
+		Assimp::Importer importer;
+		const aiScene* scene = importer.ReadFile(path, aiProcess_Triangulate | aiProcess_FlipUVs | aiProcess_GenSmoothNormals | aiProcess_CalcTangentSpace);
+		if (!scene || scene->mFlags == AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode)
+		{
+			std::cout << "ERROR::ASSIMP:: " << importer.GetErrorString() << std::endl;
+			return false;
+		}
+		this->directory = path.substr(0, path.find_last_of('/'));
+		this->meshes.clear();
+		this->collect(scene->mRootNode, scene, model * AssimpMatrix(scene->mRootNode->mTransformation));
+
+		// - Every triangle of the model casts shadows, and reflects the light of its mesh's albedo
+		std::vector<glm::vec3> triangles;
+		this->triangleNormals.clear();
+		this->triangleAlbedo.clear();
+		this->bounds = AABB();
+		for (GLuint i = 0; i < this->meshes.size(); i++)
+		{
+			for (GLuint j = 0; j < this->meshes[i].Indices.size(); j++)
+			{
+				triangles.push_back(this->meshes[i].Positions[this->meshes[i].Indices[j]]);
+				this->triangleNormals.push_back(this->meshes[i].Normals[this->meshes[i].Indices[j]]);
+				this->bounds.Extend(triangles.back());
+			}
+			this->triangleAlbedo.insert(this->triangleAlbedo.end(), this->meshes[i].Indices.size() / 3, this->meshes[i].Albedo);
+		}
+		this->bvh.Build(triangles);
+		std::cout << "Static scene: " << this->meshes.size() << " meshes, " << this->bvh.TriangleCount() << " triangles, "
+			<< this->bvh.NodeCount() << " BVH nodes, " << this->Threads << " threads" << std::endl;
+
+		this->point = pointLight;
+		this->spot = spotLight;
+		this->spot.Direction = glm::normalize(this->spot.Direction);
+		return true;
+	}
+
+	// Bakes the loaded model into directory, next to the model
+	bool Bake(const std::string &directory)
+	{
+		std::string output = this->directory + "/" + directory;
+#ifdef _WIN32
+		_mkdir(output.c_str());
+#else
+		mkdir(output.c_str(), 0755);
+#endif
+		for (GLuint i = 0; i < this->meshes.size(); i++)
+		{
+			if (!this->bakeMesh(this->meshes[i], LightmapPath(output, i, ".layout"), LightmapPath(output, i, ".dds")))
+				return false;
+		}
+		return true;
+	}
+
+	// Light leaving the first surface along the ray: its albedo times the direct light it
+	// receives, without the ambient term. Rays that escape the model or reach the back of a
+	// face bring nothing, backface tells the latter apart.
+	glm::vec3 Radiance(glm::vec3 origin, glm::vec3 direction, bool &backface) const
+	{
+		GLfloat distance;
+		GLuint triangle;
+		glm::vec2 barycentrics;
+		backface = false;
+		if (!this->bvh.Intersect(origin, direction, distance, triangle, barycentrics))
+			return glm::vec3(0.0f);
+		const glm::vec3 *normals = &this->triangleNormals[3 * triangle];
+		glm::vec3 normal = glm::normalize((1.0f - barycentrics.x - barycentrics.y) * normals[0] + barycentrics.x * normals[1] + barycentrics.y * normals[2]);
+		if (glm::dot(normal, direction) > 0.0f)
+		{
+			backface = true;
+			return glm::vec3(0.0f);
+		}
+		return this->triangleAlbedo[triangle] * this->irradiance(origin + direction * distance, normal, false);
+	}
+
+	// World space bounds of the loaded model
+	AABB Bounds() const
+	{
+		return this->bounds;
+	}
+
+private:
+	static const GLuint SHADOW_SAMPLES = 16;
+	static const GLuint DILATE_PASSES = 4;
+
+	struct BakeMesh
+	{
+		std::vector<glm::vec3> Positions;	// World space
+		std::vector<glm::vec3> Normals;
+		std::vector<GLuint> Indices;
+		std::vector<glm::vec3> ObjectPositions;	// As loaded, the layout is unwrapped from these
+		glm::vec3 Albedo;					// Mean linear colour of the diffuse map
+	};
+
+	std::string directory;
+	std::vector<BakeMesh> meshes;
+	BVH bvh;
+	std::vector<glm::vec3> triangleNormals;	// 3 per triangle, in BVH order
+	std::vector<glm::vec3> triangleAlbedo;
+	AABB bounds;
+	PointLight point;
+	SpotLight spot;
+
+	// Meshes of node and its children in world space, model includes the node's transform
+	void collect(aiNode* node, const aiScene* scene, const glm::mat4 &model)
+	{
+		glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(model)));
+		for (GLuint i = 0; i < node->mNumMeshes; i++)
+		{
+			aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
+			BakeMesh baked;
+			for (GLuint j = 0; j < mesh->mNumVertices; j++)
+			{
+				glm::vec3 position(mesh->mVertices[j].x, mesh->mVertices[j].y, mesh->mVertices[j].z);
+				baked.ObjectPositions.push_back(position);
+				baked.Positions.push_back(glm::vec3(model * glm::vec4(position, 1.0f)));
+				baked.Normals.push_back(glm::normalize(normalMatrix * glm::vec3(mesh->mNormals[j].x, mesh->mNormals[j].y, mesh->mNormals[j].z)));
+			}
+			for (GLuint j = 0; j < mesh->mNumFaces; j++)
+				for (GLuint k = 0; k < mesh->mFaces[j].mNumIndices; k++)
+					baked.Indices.push_back(mesh->mFaces[j].mIndices[k]);
+			baked.Albedo = this->albedo(scene->mMaterials[mesh->mMaterialIndex]);
+			this->meshes.push_back(baked);
+		}
+		for (GLuint i = 0; i < node->mNumChildren; i++)
+			this->collect(node->mChildren[i], scene, model * AssimpMatrix(node->mChildren[i]->mTransformation));
+	}
+
+	// Mean colour of a material's diffuse map, decoded from sRGB as the sampler does at runtime
+	glm::vec3 albedo(aiMaterial* material) const
+	{
+		aiString file;
+		if (material->GetTextureCount(aiTextureType_DIFFUSE) > 0 && material->GetTexture(aiTextureType_DIFFUSE, 0, &file) == AI_SUCCESS)
+		{
+			int width, height, channels;
+			unsigned char* image = stbi_load((this->directory + '/' + file.C_Str()).c_str(), &width, &height, &channels, 3);
+			if (image != nullptr)
+			{
+				glm::dvec3 sum(0.0);
+				for (int i = 0; i < width * height; i++)
+					sum += glm::dvec3(glm::pow(glm::vec3(image[3 * i], image[3 * i + 1], image[3 * i + 2]) / 255.0f, glm::vec3(2.2f)));
+				stbi_image_free(image);
+				return glm::vec3(sum / (GLdouble)std::max(width * height, 1));
+			}
+		}
+		aiColor3D diffuse(0.5f, 0.5f, 0.5f);
+		material->Get(AI_MATKEY_COLOR_DIFFUSE, diffuse);
+		return glm::vec3(diffuse.r, diffuse.g, diffuse.b);
+	}
+
+	bool bakeMesh(const BakeMesh &mesh, const std::string &layoutPath, const std::string &lightmapPath)
+	{
+		LightmapLayout layout = LightmapLayout::Unwrap(mesh.ObjectPositions, mesh.Indices);
+		if (layout.Indices.empty())
+			return true;
+		GLuint size = layout.Size;
+
+		// - Rasterize the triangles in lightmap space, keeping the surface point at every texel centre
+		std::vector<glm::vec3> texelPositions(size * size), texelNormals(size * size);
+		std::vector<bool> covered(size * size, false);
+		for (GLuint t = 0; t + 2 < layout.Indices.size(); t += 3)
+		{
+			glm::vec2 uv[3];
+			glm::vec3 p[3], n[3];
+			for (GLuint j = 0; j < 3; j++)
+			{
+				GLuint v = layout.Indices[t + j];
+				uv[j] = layout.Coords[v] * (GLfloat)size - 0.5f;
+				p[j] = mesh.Positions[layout.Sources[v]];
+				n[j] = mesh.Normals[layout.Sources[v]];
+			}
+			GLfloat area = (uv[1].x - uv[0].x) * (uv[2].y - uv[0].y) - (uv[2].x - uv[0].x) * (uv[1].y - uv[0].y);
+			if (std::fabs(area) < 1e-8f)
+				continue;
+			glm::ivec2 low = glm::max(glm::ivec2(glm::floor(glm::min(uv[0], glm::min(uv[1], uv[2])))), glm::ivec2(0));
+			glm::ivec2 high = glm::min(glm::ivec2(glm::ceil(glm::max(uv[0], glm::max(uv[1], uv[2])))), glm::ivec2(size - 1));
+			for (GLint y = low.y; y <= high.y; y++)
+			{
+				for (GLint x = low.x; x <= high.x; x++)
+				{
+					glm::vec2 texel((GLfloat)x, (GLfloat)y);
+					GLfloat w1 = ((texel.x - uv[0].x) * (uv[2].y - uv[0].y) - (uv[2].x - uv[0].x) * (texel.y - uv[0].y)) / area;
+					GLfloat w2 = ((uv[1].x - uv[0].x) * (texel.y - uv[0].y) - (texel.x - uv[0].x) * (uv[1].y - uv[0].y)) / area;
+					GLfloat w0 = 1.0f - w1 - w2;
+					if (w0 < -1e-4f || w1 < -1e-4f || w2 < -1e-4f)
+						continue;
+					GLuint index = y * size + x;
+					texelPositions[index] = w0 * p[0] + w1 * p[1] + w2 * p[2];
+					texelNormals[index] = glm::normalize(w0 * n[0] + w1 * n[1] + w2 * n[2]);
+					covered[index] = true;
+				}
+			}
+		}
+
+		// - Light every covered texel, the threads take rows in turn
+		std::vector<glm::vec3> light(size * size, glm::vec3(0.0f));
+		std::atomic<GLuint> nextRow(0);
+		std::vector<std::thread> workers;
+		for (GLuint i = 0; i < this->Threads; i++)
+		{
+			workers.push_back(std::thread([&]() {
+				for (GLuint y = nextRow++; y < size; y = nextRow++)
+					for (GLuint x = 0; x < size; x++)
+						if (covered[y * size + x])
+							light[y * size + x] = this->irradiance(texelPositions[y * size + x], texelNormals[y * size + x], true);
+			}));
+		}
+		for (GLuint i = 0; i < workers.size(); i++)
+			workers[i].join();
+
+		// - Grow the charts into their padding so filtering at the borders reads lit texels
+		for (GLuint pass = 0; pass < DILATE_PASSES; pass++)
+		{
+			std::vector<bool> grown = covered;
+			for (GLint y = 0; y < (GLint)size; y++)
+			{
+				for (GLint x = 0; x < (GLint)size; x++)
+				{
+					if (covered[y * size + x])
+						continue;
+					glm::vec3 sum(0.0f);
+					GLuint count = 0;
+					for (GLint dy = -1; dy <= 1; dy++)
+					{
+						for (GLint dx = -1; dx <= 1; dx++)
+						{
+							GLint nx = x + dx, ny = y + dy;
+							if (nx >= 0 && ny >= 0 && nx < (GLint)size && ny < (GLint)size && covered[ny * size + nx])
+							{
+								sum += light[ny * size + nx];
+								count++;
+							}
+						}
+					}
+					if (count > 0)
+					{
+						light[y * size + x] = sum / (GLfloat)count;
+						grown[y * size + x] = true;
+					}
+				}
+			}
+			covered.swap(grown);
+		}
+
+		// - RGBM, the multiplier rounded up so the colour never needs more than 1
+		std::vector<unsigned char> rgbm(4 * size * size);
+		for (GLuint i = 0; i < size * size; i++)
+		{
+			glm::vec3 color = glm::min(light[i], glm::vec3(LIGHTMAP_RANGE));
+			GLfloat m = glm::clamp(std::max(color.r, std::max(color.g, color.b)) / LIGHTMAP_RANGE, 1.0f / 255.0f, 1.0f);
+			m = std::ceil(m * 255.0f) / 255.0f;
+			glm::vec3 scaled = color / (m * LIGHTMAP_RANGE);
+			for (GLuint c = 0; c < 3; c++)
+				rgbm[4 * i + c] = (unsigned char)glm::clamp(scaled[c] * 255.0f + 0.5f, 0.0f, 255.0f);
+			rgbm[4 * i + 3] = (unsigned char)(m * 255.0f + 0.5f);
+		}
+		if (!layout.Save(layoutPath) || !save_image_as_DDS(lightmapPath.c_str(), size, size, 4, &rgbm[0]))
+		{
+			std::cout << "ERROR::LIGHTMAP::Could not write " << lightmapPath << std::endl;
+			return false;
+		}
+		std::cout << "  " << lightmapPath << ": " << size << "x" << size << std::endl;
+		return true;
+	}
+
+	// Fraction of the light sphere visible from position, over a Fibonacci spiral of points
+	GLfloat visibility(glm::vec3 position, glm::vec3 normal, glm::vec3 light) const
+	{
+		glm::vec3 origin = position + normal * 0.005f;
+		GLuint visible = 0;
+		for (GLuint i = 0; i < SHADOW_SAMPLES; i++)
+		{
+			GLfloat z = 1.0f - (2.0f * i + 1.0f) / SHADOW_SAMPLES;
+			GLfloat r = std::sqrt(1.0f - z * z);
+			GLfloat phi = 2.39996323f * i;
+			glm::vec3 target = light + this->LightRadius * glm::vec3(r * std::cos(phi), r * std::sin(phi), z);
+			glm::vec3 toLight = target - origin;
+			GLfloat distance = glm::length(toLight);
+			if (!this->bvh.Occluded(origin, toLight / distance, distance))
+				visible++;
+		}
+		return (GLfloat)visible / SHADOW_SAMPLES;
+	}
+
+	// Light the shaders would give a white surface, ambient terms included or not
+	glm::vec3 irradiance(glm::vec3 position, glm::vec3 normal, bool ambient) const
+	{
+		glm::vec3 result(0.0f);
+		if (this->point.Intensity > 0.0f)
+		{
+			glm::vec3 toLight = this->point.Position - position;
+			GLfloat distance = glm::length(toLight);
+			GLfloat diff = std::max(glm::dot(normal, toLight / distance), 0.0f);
+			GLfloat attenuation = 1.0f / (this->point.Constant + this->point.Linear * distance + this->point.Quadratic * distance * distance);
+			GLfloat lit = diff > 0.0f ? this->visibility(position, normal, this->point.Position) : 0.0f;
+			result += ((ambient ? 0.2f : 0.0f) + lit * this->point.Intensity * diff) * attenuation * this->point.Color;
+		}
+		if (this->spot.Intensity > 0.0f)
+		{
+			glm::vec3 toLight = this->spot.Position - position;
+			GLfloat distance = glm::length(toLight);
+			glm::vec3 lightDir = toLight / distance;
+			GLfloat diff = std::max(glm::dot(normal, lightDir), 0.0f);
+			GLfloat attenuation = 1.0f / (this->spot.Constant + this->spot.Linear * distance + this->spot.Quadratic * distance * distance);
+			GLfloat theta = glm::dot(lightDir, -this->spot.Direction);
+			GLfloat cone = glm::clamp((theta - this->spot.OuterCutOff) / (this->spot.CutOff - this->spot.OuterCutOff), 0.0f, 1.0f);
+			GLfloat lit = diff > 0.0f && cone > 0.0f ? this->visibility(position, normal, this->spot.Position) : 0.0f;
+			result += glm::vec3(((ambient ? 0.1f : 0.0f) + lit * this->spot.Intensity * diff) * attenuation * cone);
+		}
+		return result;
+	}
+};
@@ -0,0 +1,70 @@
+#pragma once
+
+// Std. Includes
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <cmath>
+
+// GL Includes
+#include "GLTypes.h"
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+#include "Bounds.h"
+#include "ProbeGrid.h"
+#include "LightmapBaker.h"
+
+
+// Bakes the irradiance probes of a static scene loaded by LightmapBaker, from the light its
+// surfaces reflect. The renderer loads the saved grid into an IrradianceVolume.
+class ProbeBaker : public ProbeGrid
+{
+public:
+	// Gathers rays from the centre of every cell, over a Fibonacci sphere. Probes that see the
+	// back of faces in more than a quarter of their rays are buried in walls, they get no weight.
+	void Bake(const LightmapBaker &scene, const AABB &bounds, glm::uvec3 counts, GLuint rays = 256)
+	{
+		this->bounds = bounds;
+		this->counts = counts;
+		this->probes.assign(counts.x * counts.y * counts.z, SH9());
+		this->weights.assign(this->probes.size(), 0.0f);
+
+		std::atomic<GLuint> next(0);
+		std::vector<std::thread> workers;
+		for (GLuint t = 0; t < scene.Threads; t++)
+		{
+			workers.push_back(std::thread([&]() {
+				for (GLuint i = next++; i < this->probes.size(); i = next++)
+				{
+					glm::uvec3 cell(i % counts.x, (i / counts.x) % counts.y, i / (counts.x * counts.y));
+					glm::vec3 position = this->bounds.Min + (glm::vec3(cell) + 0.5f) * this->cellSize();
+					GLfloat radiance[9][3] = {};
+					GLuint backfaces = 0;
+					for (GLuint r = 0; r < rays; r++)
+					{
+						GLfloat z = 1.0f - (2.0f * r + 1.0f) / rays;
+						GLfloat s = std::sqrt(1.0f - z * z);
+						GLfloat phi = 2.39996323f * r;
+						glm::vec3 direction(s * std::cos(phi), s * std::sin(phi), z);
+						bool backface;
+						glm::vec3 light = scene.Radiance(position, direction, backface);
+						backfaces += backface ? 1 : 0;
+						GLfloat basis[9];
+						evaluate(direction, basis);
+						for (GLuint k = 0; k < 9; k++)
+							for (GLuint c = 0; c < 3; c++)
+								radiance[k][c] += light[c] * basis[k];
+					}
+					// Monte Carlo weight 4 pi / rays, then the cosine lobe divided by pi: 1, 2/3, 1/4 per band
+					GLfloat band[9] = { 1.0f, 2.0f / 3.0f, 2.0f / 3.0f, 2.0f / 3.0f, 0.25f, 0.25f, 0.25f, 0.25f, 0.25f };
+					for (GLuint k = 0; k < 9; k++)
+						this->probes[i].Coefficients[k] = glm::vec3(radiance[k][0], radiance[k][1], radiance[k][2]) * (4.0f * glm::pi<GLfloat>() / rays) * band[k] * SH_BASIS[k];
+					this->weights[i] = backfaces * 4 > rays ? 0.0f : 1.0f;
+				}
+			}));
+		}
+		for (GLuint t = 0; t < workers.size(); t++)
+			workers[t].join();
+	}
+};
@@ -0,0 +1,40 @@
+// Std. Includes
+#include <string>
+#include <iostream>
+#include <chrono>
+#include <thread>
+
+// GL includes
+#include "Room.h"
+#include "LightmapBaker.h"
+#include "ProbeBaker.h"
+
+// GLM Mathemtics
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+
+// Bakes the room's static lights into its lightmaps and its irradiance probes, without a window
+// or a GL context. Run it from the renderer's directory, where the room's model is.
+// --threads n bakes on n threads instead of one per core.
+int main(int argc, char** argv)
+{
+	GLuint threads = std::thread::hardware_concurrency();
+	for (int i = 1; i + 1 < argc; i++)
+		if (std::string(argv[i]) == "--threads")
+			threads = std::stoi(argv[i + 1]);
+
+	std::chrono::steady_clock::time_point bakeStart = std::chrono::steady_clock::now();
+	LightmapBaker baker(0.05f, threads);
+	bool baked = baker.Load(ROOM_MODEL, glm::translate(glm::mat4(), ROOM_OFFSET), ROOM_POINT_LIGHT, ROOM_SPOT_LIGHT) && baker.Bake(ROOM_LIGHTMAPS);
+	// The light the room reflects, for the objects that move through it
+	if (baked)
+	{
+		ProbeBaker probes;
+		probes.Bake(baker, baker.Bounds(), ProbeBaker::CountsFor(baker.Bounds(), 1.0f));
+		baked = probes.Save(ROOM_PROBES);
+		std::cout << "  " << ROOM_PROBES << ": " << probes.ProbeCount() << " probes" << std::endl;
+	}
+	std::cout << "Lightmaps " << (baked ? "baked" : "failed") << " in " << std::chrono::duration<GLfloat>(std::chrono::steady_clock::now() - bakeStart).count() << " s" << std::endl;
+	return baked ? 0 : 1;
+}